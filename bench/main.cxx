@@ -0,0 +1,543 @@
+//
+//  main.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/1/20.
+//
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <ctime>
+#include <unistd.h>
+
+#include "probe.hxx"
+#include "synthetic_tree.hxx"
+#include "node_info.hxx"
+#include "node_id_set.hxx"
+#include "tree_builder.hxx"
+#include "tree_watcher.hxx"
+#include "integral_set.hxx"
+#include "children_policy.hxx"
+#include "run_loop.hxx"
+
+using namespace fs;
+using namespace std;
+using namespace bench;
+using namespace chrono;
+
+namespace {
+	struct options {
+		tree_shape shape;
+		filesystem::path location;
+		bool keep = false;
+		size_t repeats = 5;
+		size_t concurrency = 0;
+		size_t io_queue_depth = 0;
+		size_t operations = 1 << 17;
+		size_t roots = 64;
+		size_t timers = 65536;
+	};
+	
+	// Fires every period from its first deadline on, as ui::timer does, counting how many times it did.
+	class periodic_source: public ui::run_loop::event_source {
+	public:
+		periodic_source (time_point first, duration period, size_t &fired): _deadline (first), _period (period), _fired (fired) {}
+		
+		virtual bool has_event (time_point const &now) const override {
+			return now >= this->_deadline;
+		}
+		
+		virtual void process_event (time_point const &) override {
+			this->_deadline += this->_period;
+			this->_fired++;
+		}
+		
+		virtual duration next_event_interval (time_point const &now) const override {
+			return max (this->_deadline - now, duration::zero ());
+		}
+		
+	private:
+		time_point _deadline;
+		duration const _period;
+		size_t &_fired;
+	};
+}
+
+static void print_usage (char const *argv0) {
+	cerr << "Usage: " << argv0 << " [-D depth] [-F fanout] [-n files] [-s min_size:max_size] [-l hardlinks_ratio] [-S symlinks] [-e seed]" << endl;
+	cerr << "       " << string (strlen (argv0), ' ') << " [-t directory] [-k] [-r repeats] [-j jobs] [-q io_queue_depth] [-N operations] [-R roots] [-T timers]" << endl;
+	cerr << "Makes a tree below directory, tmpfs by default, and times scanning it, followed by micro-benchmarks of sets of inodes and roots, of run loop timers, of posting to the run loop from -j threads, and of files created and removed in the tree while it is watched." << endl;
+}
+
+static optional <uintmax_t> parse_size (string_view str) {
+	uintmax_t result = 0;
+	size_t i = 0;
+	for (; (i < str.size ()) && isdigit (static_cast <unsigned char> (str [i])); i++) {
+		result = result * 10 + static_cast <uintmax_t> (str [i] - '0');
+	}
+	if (!i) {
+		return nullopt;
+	}
+	if (i == str.size ()) {
+		return result;
+	}
+	auto const unit = "KMGT"sv.find (str [i]);
+	if ((unit == string_view::npos) || (i + 1 != str.size ())) {
+		return nullopt;
+	}
+	return result << (10 * (unit + 1));
+}
+
+static filesystem::path default_location () {
+	error_code error;
+	if (filesystem::path const shm = "/dev/shm"; filesystem::is_directory (shm, error)) {
+		return shm;
+	}
+	return filesystem::temp_directory_path ();
+}
+
+static void print_scan (string const &name, vector <measurement> const &runs, optional <size_t> syscalls) {
+	vector <double> seconds;
+	size_t peak_rss = 0;
+	for (auto const &run: runs) {
+		seconds.push_back (run.seconds);
+		peak_rss = max (peak_rss, run.peak_rss);
+	}
+	sort (seconds.begin (), seconds.end ());
+	auto const &sample = runs.front ();
+	auto const entries = static_cast <double> (max <size_t> (sample.entries, 1));
+
+	cout << name << ": " << sample.entries << " entries, best " << seconds.front () << " s, median " << seconds [seconds.size () / 2] << " s, ";
+	cout << static_cast <uintmax_t> (entries / seconds.front ()) << " entries/s, ";
+	if (syscalls) {
+		cout << static_cast <double> (*syscalls) / entries << " syscalls/entry, ";
+	} else {
+		cout << "syscalls not counted, ";
+	}
+	cout << "peak RSS " << static_cast <double> (peak_rss) / (1 << 20) << " MiB, ";
+	cout << static_cast <double> (sample.memory) / entries << " bytes/node" << endl;
+}
+
+static void run_scan (string const &name, options const &options, probe_body_t const &body) {
+	vector <measurement> runs;
+	for (size_t i = 0; i < max <size_t> (options.repeats, 1); i++) {
+		runs.push_back (run_probe (body, false));
+	}
+	print_scan (name, runs, run_probe (body, true).syscalls);
+}
+
+template <typename _Fn>
+static double nanoseconds_per_operation (size_t count, _Fn &&body) {
+	auto const start = steady_clock::now ();
+	body ();
+	return duration <double, nano> (steady_clock::now () - start).count () / static_cast <double> (max <size_t> (count, 1));
+}
+
+// Inode numbers mostly come in long runs, but sets of them are also checked against scattered ones, e.g. of other devices.
+static void run_integral_set (options const &options) {
+	mt19937_64 engine (options.shape.seed);
+	vector <uint64_t> dense (options.operations), sparse (options.operations), missing (options.operations);
+	auto const base = engine () >> 16;
+	for (size_t i = 0; i < options.operations; i++) {
+		dense [i] = base + i;
+		sparse [i] = engine ();
+		missing [i] = engine ();
+	}
+	shuffle (dense.begin (), dense.end (), engine);
+
+	size_t hits = 0;
+	for (auto const &[name, values]: { pair <char const *, vector <uint64_t> const *> { "dense", &dense }, { "sparse", &sparse } }) {
+		util::integral_set <uint64_t> set;
+		auto const insert = nanoseconds_per_operation (values->size (), [&] {
+			for (auto const value: *values) {
+				hits += set.insert (value);
+			}
+		});
+		auto const contains = nanoseconds_per_operation (values->size (), [&] {
+			for (auto const value: *values) {
+				hits += set.contains (value);
+			}
+		});
+		auto const misses = nanoseconds_per_operation (missing.size (), [&] {
+			for (auto const value: missing) {
+				hits += set.contains (value);
+			}
+		});
+		util::integral_set <uint64_t> batch_set;
+		auto const batch = nanoseconds_per_operation (values->size (), [&] {
+			hits += batch_set.insert (values->begin (), values->end ());
+		});
+		cout << "integral_set (" << name << ", " << values->size () << " values): insert " << insert << " ns, contains " << contains << " ns, ";
+		cout << "contains missing " << misses << " ns, batch insert " << batch << " ns per value" << endl;
+	}
+	// Keeps the loops from being optimized out.
+	if (!hits) {
+		cout << "no values inserted" << endl;
+	}
+}
+
+// A thousand timers fire every 100 ms with deadlines spread evenly over it, as animations and progress updates would, among more of them waiting for an hour.
+// Time is that of the loop thread on CPU per timer fired, once all of them are registered; it should grow no faster than log (timers) with those waiting.
+static void run_run_loop (options const &options) {
+	auto constexpr period = 100ms, length = 1000ms, warmup = 50ms;
+	int constexpr firing_count = 1024;
+	ui::run_loop::duration constexpr spacing = duration_cast <ui::run_loop::duration> (period) / firing_count;
+	for (auto const waiting_count: { size_t (0), options.timers / 8, options.timers }) {
+		auto const loop = ui::run_loop::make_unique ();
+		size_t fired = 0;
+		vector <shared_ptr <periodic_source>> sources;
+		auto const start = ui::run_loop::clock_type::now ();
+		for (int i = 0; i < firing_count; i++) {
+			sources.push_back (make_shared <periodic_source> (start + warmup + spacing * i, period, fired));
+		}
+		for (size_t i = 0; i < waiting_count; i++) {
+			sources.push_back (make_shared <periodic_source> (start + 1h, 1h, fired));
+		}
+		for (auto const &source: sources) {
+			loop->add_event_source (source);
+		}
+		
+		// Both ends are taken on the loop thread, between iterations.
+		timespec cpu_start, cpu_end;
+		size_t fired_start = 0;
+		thread stopper ([&] {
+			this_thread::sleep_until (start + warmup);
+			loop->add_pending_callback_invocation ([&] {
+				::clock_gettime (CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+				fired_start = fired;
+			});
+			this_thread::sleep_until (start + warmup + length);
+			loop->add_pending_callback_invocation ([&] {
+				::clock_gettime (CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+				loop->exit (0);
+			});
+		});
+		loop->run ();
+		stopper.join ();
+		
+		auto const cpu = seconds (cpu_end.tv_sec - cpu_start.tv_sec) + nanoseconds (cpu_end.tv_nsec - cpu_start.tv_nsec);
+		auto const count = fired - fired_start;
+		cout << "run_loop (" << firing_count << " timers every " << period.count () << " ms, " << waiting_count << " waiting): " << count << " fired, ";
+		cout << duration <double, nano> (cpu).count () / static_cast <double> (max <size_t> (count, 1)) << " ns on CPU per timer fired" << endl;
+	}
+}
+
+// Every producer thread posts operations invocations numbered in order, and every fourth of them coalesced under a key of its own as well,
+// faster than the loop runs them, so that the queue keeps overflowing. Numbers seen by the loop tell whether it kept each producer's order.
+static void run_run_loop_posts (options const &options) {
+	auto const producers = options.concurrency ? options.concurrency : size_t (8);
+	auto const loop = ui::run_loop::make_unique ();
+	vector <size_t> next (producers), latest_coalesced (producers);
+	size_t ran = 0, out_of_order = 0;
+	auto const start = steady_clock::now ();
+	vector <thread> threads;
+	for (size_t producer = 0; producer < producers; producer++) {
+		threads.emplace_back ([&, producer] {
+			for (size_t sequence = 0; sequence < options.operations; sequence++) {
+				loop->add_pending_callback_invocation ([&, producer, sequence] {
+					out_of_order += (next [producer] != sequence);
+					next [producer] = sequence + 1;
+					ran++;
+				});
+				if (!(sequence % 4)) {
+					loop->add_coalesced_callback_invocation (producer + 1, [&, producer, sequence] {
+						out_of_order += (latest_coalesced [producer] > sequence);
+						latest_coalesced [producer] = sequence;
+					});
+				}
+			}
+		});
+	}
+	thread stopper ([&] {
+		for (auto &thread: threads) {
+			thread.join ();
+		}
+		// Runs after every invocation posted so far, as long as the loop keeps order between producers as well.
+		loop->add_pending_callback_invocation ([&] {
+			loop->exit (0);
+		});
+	});
+	loop->run ();
+	stopper.join ();
+	auto const elapsed = steady_clock::now () - start;
+	
+	auto const total = producers * options.operations;
+	auto const last_coalesced = (options.operations - 1) / 4 * 4;
+	auto const coalesced_missed = static_cast <size_t> (count_if (latest_coalesced.begin (), latest_coalesced.end (), [last_coalesced] (size_t sequence) {
+		return sequence != last_coalesced;
+	}));
+	cout << "run_loop posts (" << producers << " threads, " << options.operations << " each): " << ran << " of " << total << " ran, " << out_of_order << " out of order, ";
+	cout << coalesced_missed << " latest coalesced missed, " << duration <double, nano> (elapsed).count () / static_cast <double> (max <size_t> (total, 1)) << " ns per invocation" << endl;
+}
+
+// Creates files in a new directory of the watched tree and removes them again, a few rounds over, waiting each time until the tree shows the change.
+// Time applying is that of watcher callbacks on the loop thread; records in the arena should stay about the same across rounds, as released ones are taken again.
+static void run_tree_watcher (options const &options, children_policy const &policy, filesystem::path const &root) {
+	size_t constexpr churn_files = 5000, churn_rounds = 3;
+	auto constexpr patience = 60s;
+	auto const builder = tree_builder::make_unique (policy.copy ());
+	builder->set_concurrency (options.concurrency);
+	promise <void> done;
+	builder->start ([&done] { done.set_value (); });
+	done.get_future ().wait ();
+	auto &tree = builder->tree ();
+	auto const records_before = tree.size ();
+	
+	auto const loop = ui::run_loop::make_unique ();
+	steady_clock::duration applying {};
+	auto const dispatch = [&loop, &applying] (util::callback_t const &callback) {
+		loop->add_pending_callback_invocation ([&applying, callback] {
+			auto const start = steady_clock::now ();
+			callback ();
+			applying += steady_clock::now () - start;
+		});
+	};
+	auto const watcher = tree_watcher::make_unique (tree, builder->roots (), builder->policy ().copy ());
+	if (!watcher->start (dispatch, [] {})) {
+		cout << "tree_watcher: watching changes is not supported" << endl;
+		return;
+	}
+	
+	auto const churn = root / "churn";
+	// Polls the tree on the loop thread until the churn directory holds files files.
+	auto const wait_for_files = [&] (size_t files) {
+		for (auto const deadline = steady_clock::now () + patience; steady_clock::now () < deadline; this_thread::sleep_for (1ms)) {
+			promise <bool> seen;
+			loop->add_pending_callback_invocation ([&] {
+				auto const children = builder->roots ().front ().as_dir ().children ();
+				seen.set_value (any_of (children.begin (), children.end (), [&] (node_info const &child) {
+					return child.is_dir () && (child.name () == churn.filename ().native ()) && (child.files () == files);
+				}));
+			});
+			if (seen.get_future ().get ()) {
+				return true;
+			}
+		}
+		return false;
+	};
+	bool applied = false;
+	auto const start = steady_clock::now ();
+	thread producer ([&] {
+		error_code error;
+		applied = filesystem::create_directory (churn, error) && wait_for_files (0);
+		for (size_t round = 0; applied && (round < churn_rounds); round++) {
+			for (size_t i = 0; i < churn_files; i++) {
+				ofstream (churn / ("f" + to_string (i))) << "churn";
+			}
+			applied = wait_for_files (churn_files);
+			for (size_t i = 0; i < churn_files; i++) {
+				filesystem::remove (churn / ("f" + to_string (i)), error);
+			}
+			applied = applied && wait_for_files (0);
+		}
+		loop->add_pending_callback_invocation ([&] {
+			loop->exit (0);
+		});
+	});
+	loop->run ();
+	producer.join ();
+	auto const elapsed = steady_clock::now () - start;
+	watcher->stop ();
+	error_code error;
+	filesystem::remove_all (churn, error);
+	
+	cout << "tree_watcher (" << watcher->backend () << ", " << churn_rounds << " rounds of " << churn_files << " files created and removed): ";
+	if (!applied) {
+		cout << "changes not shown within " << patience.count () << " s" << endl;
+		return;
+	}
+	cout << duration <double> (elapsed).count () << " s until shown, " << duration <double, micro> (applying).count () / static_cast <double> (2 * churn_files * churn_rounds) << " us applying per file created or removed, ";
+	cout << records_before << " records before and " << tree.size () << " after" << endl;
+}
+
+// Roots are made of directories of the tree, since they are resolved when added, and paths are taken from all of its entries.
+static void run_children_policy (options const &options, filesystem::path const &root) {
+	vector <filesystem::path> dirs, entries;
+	for (auto const &entry: filesystem::recursive_directory_iterator (root)) {
+		(entry.is_directory () && !entry.is_symlink () ? dirs : entries).push_back (entry.path ());
+	}
+	entries.insert (entries.end (), dirs.begin (), dirs.end ());
+	if (dirs.empty () || entries.empty ()) {
+		return;
+	}
+
+	mt19937_64 engine (options.shape.seed);
+	auto const policy = children_policy::make_unique ();
+	for (size_t i = 0; i < options.roots; i++) {
+		policy->add_root (dirs [engine () % dirs.size ()]);
+	}
+	vector <filesystem::path> queries;
+	for (size_t i = 0; i < options.operations; i++) {
+		queries.push_back (entries [engine () % entries.size ()]);
+	}
+
+	size_t hits = 0;
+	auto const contains = nanoseconds_per_operation (queries.size (), [&] {
+		for (auto const &query: queries) {
+			hits += policy->contains (query);
+		}
+	});
+	cout << "children_policy (" << policy->roots ().size () << " roots, " << queries.size () << " paths, " << hits << " within): contains " << contains << " ns per path" << endl;
+}
+
+int main (int argc, char *const argv []) {
+	options options;
+	options.location = default_location ();
+	for (int option; (option = ::getopt (argc, argv, "D:F:n:s:l:S:e:t:kr:j:q:N:R:T:")) != -1; ) {
+		switch (option) {
+		case 'D':
+			options.shape.depth = strtoul (optarg, nullptr, 10);
+			break;
+		case 'F':
+			options.shape.fanout = strtoul (optarg, nullptr, 10);
+			break;
+		case 'n':
+			options.shape.files = strtoul (optarg, nullptr, 10);
+			break;
+		case 's': {
+			auto const sizes = string_view (optarg);
+			auto const separator = sizes.find (':');
+			auto const min_size = parse_size (sizes.substr (0, separator));
+			auto const max_size = (separator != string_view::npos) ? parse_size (sizes.substr (separator + 1)) : min_size;
+			if (!min_size || !max_size || (*min_size > *max_size)) {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			options.shape.min_size = *min_size;
+			options.shape.max_size = *max_size;
+			break;
+		}
+		case 'l':
+			options.shape.hardlinks_ratio = strtod (optarg, nullptr);
+			break;
+		case 'S':
+			options.shape.symlinks = strtoul (optarg, nullptr, 10);
+			break;
+		case 'e':
+			options.shape.seed = strtoull (optarg, nullptr, 10);
+			break;
+		case 't':
+			options.location = optarg;
+			break;
+		case 'k':
+			options.keep = true;
+			break;
+		case 'r':
+			options.repeats = strtoul (optarg, nullptr, 10);
+			break;
+		case 'j':
+			options.concurrency = strtoul (optarg, nullptr, 10);
+			break;
+		case 'q':
+			options.io_queue_depth = strtoul (optarg, nullptr, 10);
+			break;
+		case 'N':
+			options.operations = strtoul (optarg, nullptr, 10);
+			break;
+		case 'R':
+			options.roots = max <size_t> (strtoul (optarg, nullptr, 10), 1);
+			break;
+		case 'T':
+			options.timers = max <size_t> (strtoul (optarg, nullptr, 10), 1);
+			break;
+		default:
+			print_usage (argv [0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc) {
+		print_usage (argv [0]);
+		return EXIT_FAILURE;
+	}
+
+	auto const root = options.location / ("wtfhd-bench-" + to_string (::getpid ()));
+	tree_stats stats;
+	try {
+		stats = make_synthetic_tree (root, options.shape);
+	} catch (system_error const &e) {
+		cerr << root.native () << ": " << e.code ().message () << endl;
+		error_code error;
+		filesystem::remove_all (root, error);
+		return EXIT_FAILURE;
+	}
+	cout << fixed << setprecision (3);
+	cout << "tree: " << stats.dirs << " directories, " << stats.files << " files, " << stats.hardlinks << " hard links, " << stats.symlinks << " symlinks, ";
+	cout << static_cast <double> (stats.size) / (1 << 30) << " GiB at " << root.native () << (is_on_tmpfs (root) ? "" : " (not tmpfs, times include the disk)") << endl;
+
+	auto const policy = children_policy::make_unique ();
+	policy->set_fs_boundaries_policy (boundaries_policy::transparent);
+	policy->add_root (root);
+
+	auto status = EXIT_SUCCESS;
+	try {
+		run_scan ("load_info", options, [&policy, &root] {
+			node_tree tree;
+			node_id_set visited;
+			auto node = node_info::make (tree, filesystem::path (root), *policy, visited);
+			node.load_info (*policy, visited);
+			return pair (tree.size (), tree.memory_usage ());
+		});
+		auto const builder_name = "tree_builder (" + (options.concurrency ? to_string (options.concurrency) : "default") + " jobs, queue depth " + to_string (options.io_queue_depth) + ")";
+		run_scan (builder_name, options, [&policy, &options] {
+			auto const builder = tree_builder::make_unique (policy->copy ());
+			builder->set_concurrency (options.concurrency);
+			builder->set_io_queue_depth (options.io_queue_depth);
+			promise <void> done;
+			builder->start ([&done] { done.set_value (); });
+			done.get_future ().wait ();
+			return pair (builder->tree ().size (), builder->tree ().memory_usage ());
+		});
+		// As in report mode; entries are counted from totals, since records of reported subtrees are given back.
+		auto const scan_reporting = [&policy, &options] {
+			auto const builder = tree_builder::make_unique (policy->copy ());
+			builder->set_concurrency (options.concurrency);
+			builder->set_io_queue_depth (options.io_queue_depth);
+			atomic <size_t> dirs = 0;
+			builder->set_subtree_callback ([&dirs] (dir_info const &, size_t) {
+				dirs.fetch_add (1, memory_order::relaxed);
+			});
+			builder->set_discards_subtrees (true);
+			promise <void> done;
+			builder->start ([&done] { done.set_value (); });
+			done.get_future ().wait ();
+			return tuple (dirs.load () + builder->roots ().front ().files (), builder->tree ().size (), builder->tree ().memory_usage ());
+		};
+		run_scan ("tree_builder discarding reported subtrees", options, [&scan_reporting] {
+			auto const [entries, records, memory] = scan_reporting ();
+			return pair (entries, memory);
+		});
+		auto const [entries, records, memory] = scan_reporting ();
+		auto const records_memory = records * sizeof (node_record);
+		cout << "report mode: " << entries << " entries in " << records << " records, " << static_cast <double> (records_memory) / (1 << 20) << " MiB of them and ";
+		cout << static_cast <double> (memory - min (memory, records_memory)) / (1 << 20) << " MiB of names and chunk slack" << endl;
+	} catch (exception const &e) {
+		cerr << e.what () << endl;
+		status = EXIT_FAILURE;
+	}
+
+	if (status == EXIT_SUCCESS) {
+		run_integral_set (options);
+		run_children_policy (options, root);
+		run_run_loop (options);
+		run_run_loop_posts (options);
+		run_tree_watcher (options, *policy, root);
+	}
+	if (!options.keep) {
+		error_code error;
+		filesystem::remove_all (root, error);
+	}
+	return status;
+}
@@ -0,0 +1,171 @@
+//
+//  probe.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/1/20.
+//
+
+#include "probe.hxx"
+
+#include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#if defined (__linux__)
+#	include <sys/ptrace.h>
+#	include <sys/syscall.h>
+#endif
+
+using namespace std;
+using namespace bench;
+using namespace chrono;
+
+namespace {
+	struct report {
+		double seconds;
+		size_t entries, memory;
+		size_t inherited_rss;
+	};
+}
+
+static void throw_errno_if (bool condition) {
+	if (condition) {
+		throw system_error (errno, system_category ());
+	}
+}
+
+// Brackets body, so that syscalls made by the process around it are left out; nothing else asks for the parent process.
+static void mark_body () {
+	::getppid ();
+}
+
+// Resets the peak resident memory of the process to what it holds now, pages shared with the parent included, and returns that.
+static size_t reset_peak_rss () {
+#if defined (__linux__)
+	if (int const fd = ::open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC); fd != -1) {
+		auto const written = ::write (fd, "5", 1);
+		::close (fd);
+		if (written == 1) {
+			size_t pages, resident = 0;
+			if (auto const statm = ::fopen ("/proc/self/statm", "re")) {
+				if (::fscanf (statm, "%zu %zu", &pages, &resident) != 2) {
+					resident = 0;
+				}
+				::fclose (statm);
+			}
+			return resident * static_cast <size_t> (::sysconf (_SC_PAGESIZE));
+		}
+	}
+#endif
+	return 0;
+}
+
+#if defined (__linux__)
+// Follows the child and every thread it starts until it exits, counting syscalls made between marks.
+static optional <size_t> trace_syscalls (pid_t pid, int &status, struct ::rusage &usage) {
+	throw_errno_if (::wait4 (pid, &status, __WALL, &usage) != pid);
+	// Children which may not be traced run to the end at once.
+	if (!WIFSTOPPED (status)) {
+		return nullopt;
+	}
+	if (::ptrace (PTRACE_SETOPTIONS, pid, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL)) {
+		::ptrace (PTRACE_DETACH, pid, nullptr, nullptr);
+		throw_errno_if (::wait4 (pid, &status, 0, &usage) != pid);
+		return nullopt;
+	}
+	throw_errno_if (::ptrace (PTRACE_SYSCALL, pid, nullptr, nullptr));
+
+	size_t count = 0;
+	auto counting = false, valid = true;
+	for (;;) {
+		int thread_status;
+		struct ::rusage thread_usage;
+		auto const thread = ::wait4 (-1, &thread_status, __WALL, &thread_usage);
+		if (thread == -1) {
+			throw_errno_if (errno != EINTR);
+			continue;
+		}
+		if (WIFEXITED (thread_status) || WIFSIGNALED (thread_status)) {
+			if (thread == pid) {
+				status = thread_status;
+				usage = thread_usage;
+				break;
+			}
+			continue;
+		}
+
+		int signal = 0;
+		if (WSTOPSIG (thread_status) == (SIGTRAP | 0x80)) {
+			struct __ptrace_syscall_info info;
+			if (::ptrace (PTRACE_GET_SYSCALL_INFO, thread, sizeof (info), &info) <= 0) {
+				valid = false;
+			} else if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				if (info.entry.nr == SYS_getppid) {
+					counting = !counting;
+				} else if (counting) {
+					count++;
+				}
+			}
+		} else if ((WSTOPSIG (thread_status) != SIGTRAP) && (WSTOPSIG (thread_status) != SIGSTOP)) {
+			// Threads start stopped and clones are reported with SIGTRAP; anything else is delivered as is.
+			signal = WSTOPSIG (thread_status);
+		}
+		::ptrace (PTRACE_SYSCALL, thread, nullptr, signal);
+	}
+	return valid ? optional (count) : nullopt;
+}
+#endif
+
+measurement bench::run_probe (probe_body_t const &body, bool count_syscalls) {
+	int fds [2];
+	throw_errno_if (::pipe (fds));
+	auto const pid = ::fork ();
+	throw_errno_if (pid == -1);
+	if (!pid) {
+		::close (fds [0]);
+#if defined (__linux__)
+		if (count_syscalls && !::ptrace (PTRACE_TRACEME, 0, nullptr, nullptr)) {
+			::raise (SIGSTOP);
+		}
+#endif
+		auto const inherited_rss = reset_peak_rss ();
+		mark_body ();
+		auto const start = steady_clock::now ();
+		auto const [entries, memory] = body ();
+		report const result { duration <double> (steady_clock::now () - start).count (), entries, memory, inherited_rss };
+		mark_body ();
+		auto const written = ::write (fds [1], &result, sizeof (result));
+		::_exit ((written == sizeof (result)) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	::close (fds [1]);
+
+	int status;
+	struct ::rusage usage;
+	optional <size_t> syscalls;
+#if defined (__linux__)
+	if (count_syscalls) {
+		syscalls = trace_syscalls (pid, status, usage);
+	} else
+#endif
+	{
+		throw_errno_if (::wait4 (pid, &status, 0, &usage) != pid);
+	}
+
+	report result;
+	auto const received = ::read (fds [0], &result, sizeof (result));
+	::close (fds [0]);
+	if (!WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS) || (received != sizeof (result))) {
+		throw runtime_error ("benchmark process failed");
+	}
+#if defined (__APPLE__)
+	auto const peak_rss = static_cast <size_t> (usage.ru_maxrss);
+#else
+	auto const peak_rss = static_cast <size_t> (usage.ru_maxrss) * 1024;
+#endif
+	return { result.seconds, result.entries, result.memory, peak_rss - min (peak_rss, result.inherited_rss), syscalls };
+}
@@ -0,0 +1,36 @@
+//
+//  probe.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/1/20.
+//
+
+#ifndef probe_hxx
+#define probe_hxx
+
+#include <cstddef>
+#include <utility>
+#include <optional>
+#include <functional>
+
+namespace bench {
+	struct measurement;
+	// Returns the number of entries loaded and the bytes taken by the tree holding them.
+	typedef std::function <std::pair <std::size_t, std::size_t> ()> probe_body_t;
+
+	// Runs body in a child process, so that its peak memory is not mixed up with that of earlier runs.
+	// Syscalls are counted by tracing the child where supported, which slows it down a lot, so such runs are not timed.
+	measurement run_probe (probe_body_t const &body, bool count_syscalls);
+}
+
+struct bench::measurement {
+	double seconds;
+	std::size_t entries;
+	std::size_t memory;
+	// Above what the process held once forked, where that can be told.
+	std::size_t peak_rss;
+	// Made by every thread of body; missing if they could not be traced.
+	std::optional <std::size_t> syscalls;
+};
+
+#endif /* probe_hxx */
@@ -0,0 +1,128 @@
+//
+//  synthetic_tree.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/1/20.
+//
+
+#include "synthetic_tree.hxx"
+
+#include <cmath>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined (__linux__)
+#	include <sys/vfs.h>
+#	include <linux/magic.h>
+#else
+#	include <sys/mount.h>
+#endif
+
+using namespace std;
+using namespace bench;
+using namespace filesystem;
+
+namespace {
+	// Standard distributions may differ between libraries, so values are derived from the raw engine output, which may not.
+	class random_source {
+	public:
+		random_source (uint64_t seed): _engine (seed) {}
+
+		size_t uniform (size_t bound) {
+			return static_cast <size_t> ((static_cast <unsigned __int128> (this->_engine ()) * bound) >> 64);
+		}
+
+		double unit () {
+			return static_cast <double> (this->_engine () >> 11) * 0x1p-53;
+		}
+
+		bool chance (double probability) {
+			return this->unit () < probability;
+		}
+
+	private:
+		mt19937_64 _engine;
+	};
+}
+
+static void throw_errno_if (bool condition) {
+	if (condition) {
+		throw system_error (errno, system_category ());
+	}
+}
+
+static char const *const extensions [] = { "c", "h", "o", "txt", "log", "jpg", "mp4", "json", "tar.gz", "" };
+
+tree_stats bench::make_synthetic_tree (path const &root, tree_shape const &shape) {
+	random_source random (shape.seed);
+	tree_stats result {};
+	vector <path> dirs, files;
+	auto const min_size = static_cast <double> (max <uintmax_t> (shape.min_size, 1));
+	auto const scale = log (max (static_cast <double> (shape.max_size) / min_size, 1.0));
+
+	struct level_dir {
+		path location;
+		size_t depth;
+	};
+	deque <level_dir> pending { { root, 0 } };
+	throw_errno_if (::mkdir (root.c_str (), 0755));
+	for (; !pending.empty (); pending.pop_front ()) {
+		auto const &dir = pending.front ();
+		dirs.push_back (dir.location);
+		result.dirs++;
+
+		for (size_t i = 0; i < shape.files; i++) {
+			auto const extension = extensions [random.uniform (size (extensions))];
+			auto file = dir.location / ("f" + to_string (i) + (*extension ? "." : "") + extension);
+			if (!files.empty () && random.chance (shape.hardlinks_ratio)) {
+				throw_errno_if (::link (files [random.uniform (files.size ())].c_str (), file.c_str ()));
+				result.hardlinks++;
+				continue;
+			}
+
+			auto const file_size = static_cast <uintmax_t> (min_size * exp (scale * random.unit ()));
+			auto const fd = ::open (file.c_str (), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+			throw_errno_if (fd == -1);
+			auto const truncated = ::ftruncate (fd, static_cast <off_t> (file_size));
+			::close (fd);
+			throw_errno_if (truncated);
+			files.push_back (std::move (file));
+			result.files++;
+			result.size += file_size;
+		}
+
+		if (dir.depth < shape.depth) {
+			for (size_t i = 0; i < shape.fanout; i++) {
+				auto subdir = dir.location / ("d" + to_string (i));
+				throw_errno_if (::mkdir (subdir.c_str (), 0755));
+				pending.push_back ({ std::move (subdir), dir.depth + 1 });
+			}
+		}
+	}
+
+	for (size_t i = 0; i < shape.symlinks; i++) {
+		auto const &target = (files.empty () || random.chance (0.5)) ? dirs [random.uniform (dirs.size ())] : files [random.uniform (files.size ())];
+		auto const link = dirs [random.uniform (dirs.size ())] / ("l" + to_string (i));
+		throw_errno_if (::symlink (target.c_str (), link.c_str ()));
+		result.symlinks++;
+	}
+	return result;
+}
+
+bool bench::is_on_tmpfs (path const &path) {
+	struct ::statfs info;
+	if (::statfs (path.c_str (), &info)) {
+		return false;
+	}
+#if defined (__linux__)
+	return info.f_type == TMPFS_MAGIC;
+#else
+	return !strcmp (info.f_fstypename, "tmpfs");
+#endif
+}
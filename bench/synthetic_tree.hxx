@@ -0,0 +1,45 @@
+//
+//  synthetic_tree.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/1/20.
+//
+
+#ifndef synthetic_tree_hxx
+#define synthetic_tree_hxx
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace bench {
+	struct tree_shape;
+	struct tree_stats;
+
+	// Creates a tree below root, which must not exist yet; the same shape always makes the same tree.
+	tree_stats make_synthetic_tree (std::filesystem::path const &root, tree_shape const &shape);
+	// Tells whether path lies on tmpfs, so that scans are not bound by a disk.
+	bool is_on_tmpfs (std::filesystem::path const &path);
+}
+
+struct bench::tree_shape {
+	// Levels of directories below root, each directory but the deepest ones having fanout subdirectories.
+	std::size_t depth = 4;
+	std::size_t fanout = 6;
+	std::size_t files = 32;
+	// File sizes are spread evenly on a logarithmic scale; files are sparse, so sizes cost no memory.
+	std::uintmax_t min_size = 1;
+	std::uintmax_t max_size = std::uintmax_t (1) << 24;
+	// Share of files made as hard links to files made earlier.
+	double hardlinks_ratio = 0.05;
+	// Links to random files and directories made earlier, placed into random directories.
+	std::size_t symlinks = 64;
+	std::uint64_t seed = 1;
+};
+
+struct bench::tree_stats {
+	std::size_t dirs, files, hardlinks, symlinks;
+	std::uintmax_t size;
+};
+
+#endif /* synthetic_tree_hxx */
@@ -7,29 +7,70 @@
 
 #include "children_policy.hxx"
 
+#include <map>
+#include <limits>
+#include <string>
+#include <vector>
+#include <fnmatch.h>
+#include <dirent.h>
+
 using namespace fs;
 using namespace std;
 using namespace filesystem;
 
+// Provided by the standard library itself since C++20 was amended, starting with libstdc++ 12.
+#if !(defined (_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 12))
 template <>
-struct hash <path> {
+struct std::hash <path> {
 	size_t operator () (path const &value) const {
 		return hash_value (value);
 	}
 };
+#endif
 
 namespace fs::impl {
 	class children_policy: public ::children_policy {
 	public:
-		children_policy (): ::children_policy () {}
+		children_policy (): ::children_policy (), _trie (1) {}
 		
 		virtual unique_ptr <::children_policy> copy () const override;
 		virtual bool contains (path const &child) const override;
+		virtual bool accepts (string_view name, unsigned char type) const override;
+		virtual bool has_rules () const override;
+		virtual void add_rule (entry_rule rule, string_view pattern) override;
 		virtual unordered_set <path> const &roots () const override;
 		virtual void add_root (path const &root) override;
 		
 	private:
+		// Roots are marked in a trie of path components, so that a path is checked by a single walk over its string.
+		struct trie_node {
+			map <string, size_t, less <>> children;
+			bool is_root = false;
+		};
+		
+		struct compiled_rule {
+			enum struct form {
+				literal,
+				prefix,
+				suffix,
+				glob,
+			};
+			
+			entry_rule rule;
+			form form;
+			string pattern;
+			// Pattern without its leading or trailing star for prefix and suffix forms.
+			string fixed;
+			
+			bool matches (string_view name) const;
+		};
+		
+		template <typename _Fp>
+		static void for_each_component (string_view path, _Fp &&body);
+		
 		unordered_set <path> _roots;
+		vector <trie_node> _trie;
+		vector <compiled_rule> _rules;
 	};
 }
 
@@ -40,18 +81,61 @@ unique_ptr <children_policy> children_policy::make_unique () {
 std::unique_ptr <children_policy> impl::children_policy::copy () const {
 	auto result = std::make_unique <children_policy> ();
 	result->set_fs_boundaries_policy (this->fs_boundaries_policy ());
+	result->set_hardlinks_policy (this->hardlinks_policy ());
 	result->_roots = this->_roots;
+	result->_trie = this->_trie;
+	result->_rules = this->_rules;
 	return result;
 }
 
 bool impl::children_policy::contains (path const &child) const {
-	if (this->_roots.contains (child)) {
-		return true;
-	} else if (child.has_relative_path ()) {
-		return this->contains (child.parent_path ());
-	} else {
-		return false;
+	size_t node = 0;
+	auto result = this->_trie [node].is_root;
+	for_each_component (child.native (), [this, &node, &result] (string_view component) {
+		if (result || (node == numeric_limits <size_t>::max ())) {
+			return;
+		}
+		auto const &children = this->_trie [node].children;
+		auto const it = children.find (component);
+		node = (it != children.end ()) ? it->second : numeric_limits <size_t>::max ();
+		result = (node != numeric_limits <size_t>::max ()) && this->_trie [node].is_root;
+	});
+	return result;
+}
+
+bool impl::children_policy::accepts (string_view name, unsigned char type) const {
+	for (auto const &rule: this->_rules) {
+		if ((rule.rule == entry_rule::exclude_dir) && (type != DT_DIR)) {
+			continue;
+		}
+		if (rule.matches (name)) {
+			return rule.rule == entry_rule::include;
+		}
 	}
+	return true;
+}
+
+bool impl::children_policy::has_rules () const {
+	return !this->_rules.empty ();
+}
+
+void impl::children_policy::add_rule (entry_rule rule, string_view pattern) {
+	auto const is_literal = [] (string_view value) {
+		return value.find_first_of ("*?[\\") == string_view::npos;
+	};
+	
+	compiled_rule result { rule, compiled_rule::form::glob, string (pattern), {} };
+	if (is_literal (pattern)) {
+		result.form = compiled_rule::form::literal;
+		result.fixed = pattern;
+	} else if ((pattern.size () > 1) && (pattern.front () == '*') && is_literal (pattern.substr (1))) {
+		result.form = compiled_rule::form::suffix;
+		result.fixed = pattern.substr (1);
+	} else if ((pattern.size () > 1) && (pattern.back () == '*') && is_literal (pattern.substr (0, pattern.size () - 1))) {
+		result.form = compiled_rule::form::prefix;
+		result.fixed = pattern.substr (0, pattern.size () - 1);
+	}
+	this->_rules.push_back (std::move (result));
 }
 
 unordered_set <path> const &impl::children_policy::roots () const {
@@ -60,7 +144,48 @@ unordered_set <path> const &impl::children_policy::roots () const {
 
 void impl::children_policy::add_root (path const &root) {
 	auto canonical_root = canonical (root);
-	if (!this->contains (canonical_root)) {
-		this->_roots.insert (canonical_root);
+	if (this->contains (canonical_root)) {
+		return;
+	}
+	
+	size_t node = 0;
+	for_each_component (canonical_root.native (), [this, &node] (string_view component) {
+		auto const it = this->_trie [node].children.find (component);
+		if (it != this->_trie [node].children.end ()) {
+			node = it->second;
+			return;
+		}
+		auto const child = this->_trie.size ();
+		this->_trie [node].children.emplace (component, child);
+		this->_trie.emplace_back ();
+		node = child;
+	});
+	this->_trie [node].is_root = true;
+	this->_roots.insert (canonical_root);
+}
+
+template <typename _Fp>
+void impl::children_policy::for_each_component (string_view path, _Fp &&body) {
+	while (!path.empty ()) {
+		auto const separator = path.find ('/');
+		auto const component = path.substr (0, separator);
+		if (!component.empty () && (component != ".")) {
+			body (component);
+		}
+		path.remove_prefix ((separator == string_view::npos) ? path.size () : separator + 1);
+	}
+}
+
+bool impl::children_policy::compiled_rule::matches (string_view name) const {
+	switch (this->form) {
+	case form::literal:
+		return name == this->fixed;
+	case form::prefix:
+		return name.substr (0, this->fixed.size ()) == this->fixed;
+	case form::suffix:
+		return (name.size () >= this->fixed.size ()) && (name.substr (name.size () - this->fixed.size ()) == this->fixed);
+	case form::glob:
+		return !::fnmatch (this->pattern.c_str (), string (name).c_str (), 0);
 	}
+	return false;
 }
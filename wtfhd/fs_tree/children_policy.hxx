@@ -10,20 +10,44 @@
 
 #include <memory>
 #include <filesystem>
+#include <string_view>
 #include <sys/types.h>
 #include <unordered_set>
 
 namespace fs {
 	enum struct boundaries_policy;
+	enum struct attribution_policy;
+	enum struct entry_rule;
 	class children_policy;
 };
 
+// How mount points met while scanning are treated.
 enum struct fs::boundaries_policy {
+	// Devices are not told apart, sharing the same workers.
 	ignore = 0,
+	// Mount points are crossed, and every device is scanned by workers of its own.
 	transparent,
+	// Directories and link targets on other devices than the entries they are reached through are not loaded.
 	stay_within,
 };
 
+// How the size of a file with several hard links is charged to the directories containing them.
+enum struct fs::attribution_policy {
+	// The whole size goes to the first path scanned, the rest count as empty.
+	first_path = 0,
+	// Every path gets size / st_nlink, including links that lie outside the scanned roots, so the roots total less than the file when not all of its links are inside them.
+	split,
+};
+
+// Rules match glob patterns against entry names, not paths; the first matching one decides and entries matching none are included.
+// Excluded directories are neither opened nor counted.
+enum struct fs::entry_rule {
+	include = 0,
+	exclude,
+	// Applies to directories only.
+	exclude_dir,
+};
+
 class fs::children_policy {
 public:
 	static std::unique_ptr <children_policy> make_unique ();	
@@ -37,8 +61,23 @@ public:
 		this->_fs_policy = policy;
 	}
 	
+	attribution_policy hardlinks_policy () const {
+		return this->_hardlinks_policy;
+	}
+
+	void set_hardlinks_policy (attribution_policy policy) {
+		this->_hardlinks_policy = policy;
+	}
+	
 	virtual std::unique_ptr <children_policy> copy () const = 0;
+	// Tells whether path lies within one of roots; entries met while scanning are within their parents, so only roots and link targets are checked.
 	virtual bool contains (std::filesystem::path const &path) const = 0;
+	// Decides on an entry of a directory which is itself included; type is one of DT_* constants,
+	// DT_UNKNOWN if it is not known yet, in which case rules for directories only do not apply.
+	virtual bool accepts (std::string_view name, unsigned char type) const = 0;
+	virtual bool has_rules () const = 0;
+	// Patterns are compiled here once, so that matching a name mostly takes a single comparison.
+	virtual void add_rule (entry_rule rule, std::string_view pattern) = 0;
 	virtual std::unordered_set <std::filesystem::path> const &roots () const = 0;
 	virtual void add_root (std::filesystem::path const &root) = 0;
 
@@ -47,6 +86,7 @@ protected:
 
 private:
 	boundaries_policy _fs_policy;
+	attribution_policy _hardlinks_policy = attribution_policy::first_path;
 };
 
 #endif /* children_policy_hxx */
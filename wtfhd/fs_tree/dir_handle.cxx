@@ -0,0 +1,143 @@
+//
+//  dir_handle.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/16/20.
+//
+
+#include "dir_handle.hxx"
+
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <system_error>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#if defined (__linux__)
+#	include <sys/syscall.h>
+#endif
+
+using namespace fs;
+using namespace std;
+
+static inline void throw_errno_if (bool condition) {
+	if (condition) {
+		throw system_error (errno, system_category ());
+	}
+}
+
+static inline bool is_dot_or_dot_dot (string_view const name) {
+	return (name == ".") || (name == "..");
+}
+
+// Paths are those of roots and of resolved link targets, which are directories themselves but may lie below links; entries of directories are never followed.
+static int constexpr path_open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+static int constexpr entry_open_flags = path_open_flags | O_NOFOLLOW;
+
+dir_handle::dir_handle (char const *path): _fd (::open (path, path_open_flags)) {
+	throw_errno_if (this->_fd == -1);
+}
+
+dir_handle::dir_handle (dir_handle const &parent, char const *name): _fd (::openat (parent._fd, name, entry_open_flags)) {
+	throw_errno_if (this->_fd == -1);
+}
+
+dir_handle::~dir_handle () {
+	if (this->is_open ()) {
+		::close (this->_fd);
+	}
+}
+
+dir_handle &dir_handle::operator = (dir_handle &&other) {
+	if (this != &other) {
+		if (this->is_open ()) {
+			::close (this->_fd);
+		}
+		this->_fd = other._fd;
+		other._fd = -1;
+	}
+	return *this;
+}
+
+void dir_handle::stat (struct ::stat &info) const {
+	throw_errno_if (::fstat (this->_fd, &info));
+}
+
+void dir_handle::stat (char const *name, struct ::stat &info) const {
+	throw_errno_if (::fstatat (this->_fd, name, &info, AT_SYMLINK_NOFOLLOW));
+}
+
+string dir_handle::readlink (char const *name) const {
+	static thread_local array <char, PATH_MAX> target_path {};
+	ssize_t const target_path_len = ::readlinkat (this->_fd, name, target_path.data (), target_path.size ());
+	throw_errno_if (target_path_len == -1);
+	return string (target_path.data (), target_path.data () + target_path_len);
+}
+
+#if defined (__linux__)
+
+struct linux_dirent64 {
+	::ino64_t d_ino;
+	::off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name [];
+};
+
+void dir_handle::read_entries (entry_handler const &handler) const {
+	alignas (linux_dirent64) static thread_local array <char, 64 * 1024> buffer;
+
+	for (;;) {
+		auto const length = ::syscall (SYS_getdents64, this->_fd, buffer.data (), buffer.size ());
+		throw_errno_if (length == -1);
+		if (!length) {
+			break;
+		}
+
+		for (long offset = 0; offset < length; ) {
+			auto const entry = reinterpret_cast <linux_dirent64 const *> (buffer.data () + offset);
+			offset += entry->d_reclen;
+
+			auto const name = string_view (entry->d_name);
+			if (!is_dot_or_dot_dot (name)) {
+				invoke (handler, name, entry->d_type);
+			}
+		}
+	}
+}
+
+#else
+
+void dir_handle::read_entries (entry_handler const &handler) const {
+	int const fd = ::dup (this->_fd);
+	throw_errno_if (fd == -1);
+	DIR *const dirp = ::fdopendir (fd);
+	if (!dirp) {
+		::close (fd);
+		throw_errno_if (true);
+	}
+
+	try {
+		for (;;) {
+			errno = 0;
+			struct dirent const *const entry = ::readdir (dirp);
+			if (!entry) {
+				throw_errno_if (errno);
+				break;
+			}
+
+			auto const name = string_view (entry->d_name, entry->d_namlen);
+			if (!is_dot_or_dot_dot (name)) {
+				invoke (handler, name, entry->d_type);
+			}
+		}
+		::closedir (dirp);
+	} catch (...) {
+		::closedir (dirp);
+		throw;
+	}
+}
+
+#endif
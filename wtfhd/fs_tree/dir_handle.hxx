@@ -0,0 +1,55 @@
+//
+//  dir_handle.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/16/20.
+//
+
+#ifndef dir_handle_hxx
+#define dir_handle_hxx
+
+#include <string>
+#include <functional>
+#include <string_view>
+#include <sys/stat.h>
+
+namespace fs {
+	class dir_handle;
+}
+
+class fs::dir_handle {
+public:
+	typedef std::function <void (std::string_view name, unsigned char type)> entry_handler;
+
+	dir_handle (): _fd (-1) {}
+	dir_handle (char const *path);
+	dir_handle (dir_handle const &parent, char const *name);
+	dir_handle (dir_handle &&other): _fd (other._fd) {
+		other._fd = -1;
+	}
+	dir_handle (dir_handle const &) = delete;
+	~dir_handle ();
+
+	dir_handle &operator = (dir_handle &&other);
+	dir_handle &operator = (dir_handle const &) = delete;
+
+	bool is_open () const {
+		return this->_fd != -1;
+	}
+
+	int fd () const {
+		return this->_fd;
+	}
+
+	void stat (struct ::stat &info) const;
+	void stat (char const *name, struct ::stat &info) const;
+	std::string readlink (char const *name) const;
+
+	// Entry type is one of DT_* constants; DT_UNKNOWN means filesystem did not report it and stat is required.
+	void read_entries (entry_handler const &handler) const;
+
+private:
+	int _fd;
+};
+
+#endif /* dir_handle_hxx */
@@ -0,0 +1,52 @@
+//
+//  node_id_set.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/21/20.
+//
+
+#ifndef node_id_set_hxx
+#define node_id_set_hxx
+
+#include <tuple>
+#include <initializer_list>
+
+#include "node_info.hxx"
+#include "integral_set.hxx"
+
+namespace fs {
+	class node_id_set;
+}
+
+// Set of (device, inode) pairs which may be used from several threads at once.
+class fs::node_id_set {
+public:
+	typedef node_info::id node_id_t;
+
+	node_id_set () {}
+	node_id_set (std::initializer_list <node_id_t> const &values) {
+		for (auto const &value: values) {
+			this->insert (value);
+		}
+	}
+
+	~node_id_set () = default;
+
+	bool contains (node_id_t const &value) const {
+		return std::apply ([this] (auto const ...components) { return this->_values.contains (components...); }, value.as_tuple ());
+	}
+
+	// Returns false if value is already present, so that concurrent callers may use it as test-and-insert.
+	bool insert (node_id_t const &value) {
+		return std::apply ([this] (auto const ...components) { return this->_values.insert (components...); }, value.as_tuple ());
+	}
+
+	bool remove (node_id_t const &value) {
+		return std::apply ([this] (auto const ...components) { return this->_values.remove (components...); }, value.as_tuple ());
+	}
+
+private:
+	util::concurrent_integral_set <::dev_t, ::ino_t> _values;
+};
+
+#endif /* node_id_set_hxx */
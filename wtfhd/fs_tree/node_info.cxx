@@ -6,101 +6,448 @@
 //
 
 #include "node_info.hxx"
+#include "node_id_set.hxx"
 
-#include <array>
 #include <tuple>
+#include <algorithm>
+#include <system_error>
 #include <dirent.h>
-#include <unistd.h>
 #include <sys/stat.h>
 
 using namespace fs;
 using namespace std;
 using namespace filesystem;
 
-unique_ptr <node_info> node_info::make (class path &&path, fs::children_policy &policy) {
-	if (!policy.contains (path)) {
-		return nullptr;
-	}
-	
-	struct ::stat info;
-	node_info::throw_errno_if (::lstat (path.c_str (), &info));
-//	TODO
-//	if (policy.contains ({ info.st_ino, info.st_dev })) {
-//		return nullptr;
-//	}
-	
-	unique_ptr <node_info> result;
-	switch (info.st_mode & S_IFMT) {
+// Enough to fill a screen, so that most directories are never sorted past that.
+static size_t constexpr ordered_children_min = 256;
+
+static node_type node_type_of (mode_t mode) {
+	switch (mode & S_IFMT) {
 	case S_IFLNK:
-		result = make_unique <link_info> (std::move (path), info);
-		break;
+		return node_type::link;
 	case S_IFDIR:
-		result = make_unique <dir_info> (std::move (path), info);
-		break;
+		return node_type::dir;
 	default:
-		result = make_unique <file_info> (std::move (path), info);
+		return node_type::file;
+	}
+}
+
+node_info node_info::make (node_tree &tree, class path &&path, fs::children_policy const &policy, node_id_set &visited, link_info const *link) {
+	if (!policy.contains (path)) {
+		return {};
+	}
+
+	struct ::stat info;
+	node_info::throw_errno_if ((link ? ::stat : ::lstat) (path.c_str (), &info));
+	if (link && (policy.fs_boundaries_policy () == boundaries_policy::stay_within) && (info.st_dev != link->identifier ().device)) {
+		return {};
+	}
+
+	auto const result = node_info (tree, tree.allocate (1));
+	auto &record = result.record ();
+	record = node_record {};
+	record.device = tree.intern_device (info.st_dev);
+	record.parent = record.first = node_tree::npos;
+	record.name = tree.intern (path.native ());
+	record.type = node_type_of (info.st_mode);
+	result.set_info (info);
+	result.did_set_info (info, policy, visited);
+	return result;
+}
+
+node_info node_info::make (dir_info const &parent, stat_batch::entry const &entry, node_index index, fs::children_policy const &policy, node_id_set &visited) {
+	auto &tree = parent.tree ();
+	auto const &parent_record = parent.record ();
+	auto const result = node_info (tree, index);
+	auto &record = result.record ();
+	record = node_record {};
+	record.device = (tree.device (parent_record.device) == entry.info.st_dev) ? parent_record.device : tree.intern_device (entry.info.st_dev);
+	record.parent = parent.index ();
+	record.first = node_tree::npos;
+	record.name = tree.intern (entry.name);
+	record.type = node_type_of (entry.info.st_mode);
+	result.set_info (entry.info);
+	result.did_set_info (entry.info, policy, visited);
+	return result;
+}
+
+uintmax_t node_info::size (size_metric metric) const {
+	auto const &record = this->record ();
+	auto const allocated = (metric == size_metric::allocated);
+	if ((record.type != node_type::link) || (record.first == node_tree::npos)) {
+		return allocated ? record.total_allocated : record.total_size;
+	}
+	auto const &target = (*this->_tree) [record.first];
+	return allocated ? (record.allocated + target.total_allocated) : (record.size + target.total_size);
+}
+
+size_t node_info::files () const {
+	auto const &record = this->record ();
+	if ((record.type != node_type::link) || (record.first == node_tree::npos)) {
+		return record.total_files;
+	}
+	return record.total_files + (*this->_tree) [record.first].total_files;
+}
+
+void node_info::load_info (fs::children_policy const &policy, node_id_set &visited) {
+	switch (this->record ().type) {
+	case node_type::dir:
+		return this->as_dir ().load_info (policy, visited);
+	case node_type::link:
+		return this->as_link ().load_info (policy, visited);
+	case node_type::file:
+		return;
+	}
+}
+
+bool node_info::visit (fs::children_policy const &policy, node_id_set &visited) const {
+	if (visited.insert (this->identifier ())) {
+		return true;
+	}
+	if (this->is_dir () || (policy.hardlinks_policy () == attribution_policy::first_path)) {
+		auto &record = this->record ();
+		record.size = record.total_size = 0;
+		record.allocated = record.total_allocated = 0;
+	}
+	return false;
+}
+
+node_info::delta node_info::refresh (struct ::stat const &info, fs::children_policy const &policy) const {
+	auto &record = this->record ();
+	auto const split = (policy.hardlinks_policy () == attribution_policy::split) && (info.st_nlink > 1);
+	// Hard links attributed to another path stay empty.
+	if (!record.size && !record.allocated && !split && (info.st_nlink > 1)) {
+		return {};
+	}
+	auto const old_size = this->size (), old_allocated = this->allocated ();
+	this->set_info (info);
+	if (split) {
+		record.size = record.total_size = record.size / info.st_nlink;
+		record.allocated = record.total_allocated = record.allocated / info.st_nlink;
+	}
+	return { static_cast <intmax_t> (this->size ()) - static_cast <intmax_t> (old_size), static_cast <intmax_t> (this->allocated ()) - static_cast <intmax_t> (old_allocated), 0 };
+}
+
+class path node_info::path () const {
+	vector <string_view> components;
+	auto index = this->_index;
+	for (;;) {
+		auto const &record = (*this->_tree) [index];
+		components.push_back (this->_tree->name (record.name));
+		if ((record.parent == node_tree::npos) || ((*this->_tree) [record.parent].type != node_type::dir)) {
+			break;
+		}
+		index = record.parent;
+	}
+
+	class path result (components.back ());
+	for (auto it = components.rbegin () + 1; it != components.rend (); it++) {
+		result /= *it;
 	}
-//	TODO
-//	policy.add_node (result->identifier ());
 	return result;
 }
 
-node_info::node_info (class path &&path, struct ::stat const &info): _path (std::move (path)) {
-	this->_dev = info.st_dev;
-	this->_inode = info.st_ino;
-	this->_mtime_sec = info.st_mtimespec.tv_sec;
-	this->_mtime_nsec = (uint32_t) info.st_mtimespec.tv_nsec;
-	this->_size = info.st_size;
+void node_info::set_info (struct ::stat const &info) const {
+	auto &record = this->record ();
+	// Directories made from bare entry type get their device only once opened.
+	if (this->_tree->device (record.device) != info.st_dev) {
+		record.device = this->_tree->intern_device (info.st_dev);
+	}
+	record.inode = info.st_ino;
+#if defined (__APPLE__)
+	record.mtime = info.st_mtimespec.tv_sec * INT64_C (1000000000) + info.st_mtimespec.tv_nsec;
+#else
+	record.mtime = info.st_mtim.tv_sec * INT64_C (1000000000) + info.st_mtim.tv_nsec;
+#endif
+	record.size = record.total_size = static_cast <uint64_t> (info.st_size);
+	// Taken from the same stat call, so accounting for disk usage costs nothing extra.
+	record.allocated = record.total_allocated = static_cast <uint64_t> (info.st_blocks) * 512;
+	record.total_files = (record.type == node_type::dir) ? 0 : 1;
+}
+
+void node_info::did_set_info (struct ::stat const &info, fs::children_policy const &policy, node_id_set &visited) const {
+	if (this->is_dir ()) {
+		return;
+	}
+	if ((policy.hardlinks_policy () == attribution_policy::split) && (info.st_nlink > 1)) {
+		auto &record = this->record ();
+		record.size = record.total_size = record.size / info.st_nlink;
+		record.allocated = record.total_allocated = record.allocated / info.st_nlink;
+	}
+	this->visit (policy, visited);
+}
+
+void dir_info::load_info (fs::children_policy const &policy, node_id_set &visited) {
+	this->load_info (policy, visited, nullptr);
+}
+
+void dir_info::load_info (fs::children_policy const &policy, node_id_set &visited, dir_handle const *parent_handle) {
+	auto const handle = this->open (parent_handle);
+	if (!this->is_within_boundaries (policy) || !this->visit (policy, visited)) {
+		return;
+	}
+	for (auto child: this->load_children (policy, visited, handle)) {
+		child.load_info (policy, visited, (child.parent () == *this) ? &handle : nullptr);
+	}
+	this->children_did_load ();
 }
 
-void dir_info::load_info (fs::children_policy &policy) {
-	DIR *const dirp = ::opendir (this->path ().c_str ());
-	this->throw_errno_if (!dirp);
-	
+dir_handle dir_info::open (dir_handle const *parent_handle) {
+	struct ::stat info;
+	if (!(parent_handle && this->parent ())) {
+		auto result = dir_handle (this->path ().c_str ());
+		result.stat (info);
+		this->set_info (info);
+		return result;
+	}
+
+	auto const name = string (this->name ());
 	try {
-		struct dirent *result = nullptr;
-		do {
-			struct dirent entry;
-			this->throw_errno_if (::readdir_r (dirp, &entry, &result));
-			if (!result) {
-				continue;
-			}
-			
-			if ((*entry.d_name == '.') && ((entry.d_namlen == 1) || ((entry.d_namlen == 2) && (entry.d_name [1] == '.')))) {
-				continue;
-			}
-			
-			auto child_path = this->path ();
-			child_path /= string (entry.d_name, entry.d_name + entry.d_namlen);
-			auto child = node_info::make (std::move (child_path), policy);
-			if (!child) {
-				continue;
-			}
-			child->load_info (policy);
-			this->_children_size += child->size ();
-			this->_children.push_back (std::move (child));
-		} while (result);
-		closedir (dirp);
-		std::sort (this->_children.begin (), this->_children.end (), [] (unique_ptr <node_info> const &lhs, unique_ptr <node_info> const &rhs) {
-			return lhs->size () > rhs->size ();
-		});
-		
-	} catch (...) {
-		closedir (dirp);
+		auto result = dir_handle (*parent_handle, name.c_str ());
+		result.stat (info);
+		this->set_info (info);
+		return result;
+	} catch (system_error const &) {
+		try {
+			parent_handle->stat (name.c_str (), info);
+			this->set_info (info);
+		} catch (system_error const &) {}
 		throw;
 	}
 }
 
-void link_info::load_info (fs::children_policy &policy) {
-	static thread_local std::array <char, PATH_MAX> target_path {};
-	ssize_t const target_path_len = ::readlink (this->path ().c_str (), target_path.data (), target_path.size ());
-	this->throw_errno_if (target_path_len == -1);
+bool dir_info::is_within_boundaries (fs::children_policy const &policy) const {
+	if (policy.fs_boundaries_policy () != boundaries_policy::stay_within) {
+		return true;
+	}
+	// Targets of links refer to the links as their parents, which lie on the device of the directories containing them.
+	auto const &record = this->record ();
+	return (record.parent == node_tree::npos) || (this->tree () [record.parent].device == record.device);
+}
+
+vector <dir_info> dir_info::load_children (fs::children_policy const &policy, node_id_set &visited, dir_handle const &handle) {
+	static thread_local auto batch = stat_batch::make_unique (0);
+	batch->clear ();
+	this->enqueue_children (policy, handle, *batch);
+	batch->run ();
+	return this->children_did_stat (policy, visited, handle, batch->begin (), batch->end ());
+}
+
+void dir_info::enqueue_children (fs::children_policy const &policy, dir_handle const &handle, stat_batch &batch) const {
+	auto const from = batch.size ();
+	enqueue_entries (handle, batch);
+	exclude_entries (policy, batch, from);
+}
+
+void dir_info::enqueue_entries (dir_handle const &handle, stat_batch &batch) {
+	handle.read_entries ([&] (string_view name, unsigned char type) {
+		batch.add (handle, name, type);
+	});
+}
+
+void dir_info::exclude_entries (fs::children_policy const &policy, stat_batch &batch, size_t from) {
+	if (!policy.has_rules ()) {
+		return;
+	}
+	batch.erase (remove_if (batch.begin () + static_cast <ptrdiff_t> (from), batch.end (), [&policy] (stat_batch::entry const &entry) {
+		return !policy.accepts (entry.name, entry.type);
+	}), batch.end ());
+}
+
+bool dir_info::is_child_entry (fs::children_policy const &policy, stat_batch::entry const &entry) {
+	if (entry.error) {
+		return false;
+	}
+	// Type of entries coming as DT_UNKNOWN is known only now, so rules for directories are checked once more.
+	return (entry.type != DT_UNKNOWN) || !S_ISDIR (entry.info.st_mode) || !policy.has_rules () || policy.accepts (entry.name, DT_DIR);
+}
+
+vector <dir_info> dir_info::children_did_stat (fs::children_policy const &policy, node_id_set &visited, dir_handle const &handle, stat_batch::iterator begin, stat_batch::iterator end) {
+	auto const count = count_if (begin, end, [&policy] (stat_batch::entry const &entry) { return is_child_entry (policy, entry); });
+	auto &record = this->record ();
+	record.first = count ? this->tree ().allocate (count) : node_tree::npos;
+	record.count = static_cast <uint32_t> (count);
+
+	vector <dir_info> result;
+	auto index = record.first;
+	for (auto it = begin; it != end; it++) {
+		if (!is_child_entry (policy, *it)) {
+			continue;
+		}
+
+		auto const child = node_info::make (*this, *it, index++, policy, visited);
+		auto pending = child;
+		if (child.is_symlink ()) {
+			pending = child.as_link ().load_target (policy, visited, &handle);
+		}
+		if (pending && pending.is_dir ()) {
+			result.push_back (pending.as_dir ());
+		}
+	}
+	return result;
+}
+
+vector <pair <dir_info, node_index>> dir_info::children_did_reuse (fs::children_policy const &policy, node_tree const &baseline, node_index baseline_index, node_id_set &visited) {
+	auto &tree = this->tree ();
+	auto const &source = baseline [baseline_index];
+	auto &record = this->record ();
+	record.total_size = source.total_size;
+	record.total_allocated = source.total_allocated;
+	record.total_files = source.total_files;
+	record.sorted = source.sorted;
+	record.sorted_by = source.sorted_by;
+
+	// Rules may have changed since baseline was scanned; dropping entries keeps the rest in order.
+	vector <node_index> sources;
+	sources.reserve (source.count);
+	for (uint32_t i = 0; i < source.count; i++) {
+		auto const &child = baseline [source.first + i];
+		if (!policy.has_rules () || policy.accepts (baseline.name (child.name), (child.type == node_type::dir) ? DT_DIR : DT_REG)) {
+			sources.push_back (source.first + i);
+			continue;
+		}
+		auto const *target = ((child.type == node_type::link) && (child.first != node_tree::npos)) ? &baseline [child.first] : nullptr;
+		record.total_size -= child.total_size + (target ? target->total_size : 0);
+		record.total_allocated -= child.total_allocated + (target ? target->total_allocated : 0);
+		record.total_files -= child.total_files + (target ? target->total_files : 0);
+		if (i < source.sorted) {
+			record.sorted--;
+		}
+	}
+	record.count = static_cast <uint32_t> (sources.size ());
+	record.first = record.count ? tree.allocate (record.count) : node_tree::npos;
+
+	// Device and name ids are local to a tree, so they are interned again.
+	auto const copy_record = [&tree, &baseline] (node_index index, node_index source_index, node_index parent) {
+		auto &copy = tree [index];
+		copy = baseline [source_index];
+		copy.device = tree.intern_device (baseline.device (copy.device));
+		copy.name = tree.intern (baseline.name (copy.name));
+		copy.parent = parent;
+		if (copy.type == node_type::dir) {
+			copy.first = node_tree::npos;
+			copy.count = 0;
+		}
+		return node_info (tree, index);
+	};
+
+	vector <pair <dir_info, node_index>> result;
+	auto const reuse = [&result, &visited] (node_info const &node, node_index source_index) {
+		if (node.is_dir ()) {
+			result.emplace_back (node.as_dir (), source_index);
+		} else {
+			visited.insert (node.identifier ());
+		}
+	};
+	for (uint32_t i = 0; i < record.count; i++) {
+		auto const child = copy_record (record.first + i, sources [i], this->index ());
+		if (!child.is_symlink ()) {
+			reuse (child, sources [i]);
+			continue;
+		}
+		if (auto const target_source = baseline [sources [i]].first; target_source != node_tree::npos) {
+			auto const target = copy_record (tree.allocate (1), target_source, child.index ());
+			tree [child.index ()].first = target.index ();
+			reuse (target, target_source);
+		}
+	}
+	return result;
+}
+
+void dir_info::children_did_load () {
+	auto &record = this->record ();
+	record.total_size = record.size;
+	record.total_allocated = record.allocated;
+	record.total_files = 0;
+	record.sorted = 0;
+	for (auto const node: this->children ()) {
+		record.total_size += node.size ();
+		record.total_allocated += node.allocated ();
+		record.total_files += static_cast <uint32_t> (node.files ());
+	}
+	this->order_children (ordered_children_min);
+}
+
+void dir_info::order_children (size_t count, size_metric metric) {
+	auto &tree = this->tree ();
+	auto &record = this->record ();
+	if (record.sorted_by != metric) {
+		record.sorted = 0;
+		record.sorted_by = metric;
+	}
+	if (min <size_t> (count, record.count) <= record.sorted) {
+		return;
+	}
+	// Ordered children are never smaller than the rest, so only the rest is looked at.
+	auto const from = record.sorted;
+	count = min <size_t> (max ({ count, size_t (from) * 2, ordered_children_min }), record.count);
+
+	struct child {
+		uintmax_t size;
+		node_index index;
+		node_record record;
+	};
+
+	vector <child> children;
+	children.reserve (record.count - from);
+	for (auto index = record.first + from; index < record.first + record.count; index++) {
+		children.push_back ({ node_info (tree, index).size (metric), index, tree [index] });
+	}
+	// Ties are broken by position to make the order total.
+	auto const larger = [] (child const &lhs, child const &rhs) {
+		return (lhs.size > rhs.size) || ((lhs.size == rhs.size) && (lhs.index < rhs.index));
+	};
+	auto const middle = children.begin () + static_cast <ptrdiff_t> (count - from);
+	nth_element (children.begin (), middle, children.end (), larger);
+	sort (children.begin (), middle, larger);
+	record.sorted = static_cast <uint32_t> (count);
+
+	// Grandchildren and link targets refer to their parents by index, so moved records must be followed by them.
+	auto index = record.first + from;
+	for (auto const &child: children) {
+		tree [index] = child.record;
+		if (child.index != index) {
+			switch (child.record.type) {
+			case node_type::dir:
+				for (uint32_t i = 0; i < child.record.count; i++) {
+					tree [child.record.first + i].parent = index;
+				}
+				break;
+			case node_type::link:
+				if (child.record.first != node_tree::npos) {
+					tree [child.record.first].parent = index;
+				}
+				break;
+			case node_type::file:
+				break;
+			}
+		}
+		index++;
+	}
+}
+
+void link_info::load_info (fs::children_policy const &policy, node_id_set &visited) {
+	if (auto target = this->load_target (policy, visited)) {
+		target.load_info (policy, visited);
+	}
+}
+
+node_info link_info::load_target (fs::children_policy const &policy, node_id_set &visited, dir_handle const *parent_handle) {
+	auto &record = this->record ();
+	record.first = node_tree::npos;
 	try {
-		if (auto target = node_info::make (string (target_path.data (), target_path.data () + target_path_len), policy)) {
-			target->load_info (policy);
-			this->_target = std::move (target);
+		auto const parent = this->parent ();
+		auto const parent_path = parent ? parent.path () : this->path ().parent_path ();
+		auto const name = string (this->name ());
+		auto const target_path = (parent_handle && parent) ? filesystem::path (parent_handle->readlink (name.c_str ())) : read_symlink (this->path ());
+		// Targets may be links themselves, or lie below some; resolving them in full checks them against roots where they really are.
+		auto const target = node_info::make (this->tree (), weakly_canonical (parent_path / target_path), policy, visited, this);
+		if (target) {
+			this->tree () [target.index ()].parent = this->index ();
+			record.first = target.index ();
 		}
 	} catch (...) {}
+	return this->target ();
 }
 
 void node_info::throw_errno_if (bool condition) {
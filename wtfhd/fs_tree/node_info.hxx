@@ -12,150 +12,277 @@
 #include <chrono>
 #include <vector>
 #include <utility>
+#include <iterator>
 #include <filesystem>
+#include <string_view>
 #include <sys/stat.h>
 
 #include "children_policy.hxx"
+#include "dir_handle.hxx"
+#include "stat_batch.hxx"
+#include "node_tree.hxx"
 
 namespace fs {
 	class node_info;
 	class file_info;
 	class dir_info;
 	class link_info;
+	class node_id_set;
 };
 
+// Nodes are thin views (tree, index) over node_tree records; copying one does not copy the node.
 class fs::node_info {
 public:
+	// Change of size (), allocated () and files () of a node, which its ancestors should follow.
+	struct delta {
+		std::intmax_t size, allocated, files;
+	};
+
 	struct id {
 		typedef std::tuple <::dev_t, ::ino_t> tuple_type;
-		
+
 		::dev_t const device;
 		::ino_t const inode;
-		
+
 		id (::dev_t device, ::ino_t inode): device (device), inode (inode) {}
 		id (tuple_type value): id (value, std::make_index_sequence <std::tuple_size_v <tuple_type>> ()) {}
 		~id () = default;
-		
+
 		tuple_type constexpr as_tuple () const {
 			return { this->device, this->inode };
 		}
-		
+
 	private:
 		template <std::size_t ..._Idx>
 		id (tuple_type value, std::index_sequence <_Idx...> indices): id (std::get <_Idx> (value)...) {}
 	};
-	
-	static std::unique_ptr <node_info> make (std::filesystem::path &&, children_policy &);
+
+	// Returns an invalid node if path is excluded by policy. Path is followed if it is the target of link,
+	// and under boundaries_policy::stay_within a target on another device than the link is excluded as well.
+	static node_info make (node_tree &tree, std::filesystem::path &&, children_policy const &, node_id_set &visited, link_info const *link = nullptr);
+	// Fills the record at index, which must be allocated by the caller.
+	static node_info make (dir_info const &parent, stat_batch::entry const &entry, node_index index, children_policy const &, node_id_set &visited);
+
+	node_info (): _tree (), _index (node_tree::npos) {}
+	node_info (node_tree &tree, node_index index): _tree (&tree), _index (index) {}
+
+	explicit operator bool () const {
+		return this->_tree && (this->_index != node_tree::npos);
+	}
+
+	bool operator == (node_info const &other) const {
+		return (this->_tree == other._tree) && (this->_index == other._index);
+	}
+
+	bool operator != (node_info const &other) const {
+		return !(*this == other);
+	}
+
+	node_index index () const {
+		return this->_index;
+	}
 
 	id identifier () const {
-		return { this->_dev, this->_inode };
+		return { this->_tree->device (this->record ().device), static_cast <::ino_t> (this->record ().inode) };
 	}
 
 	auto mtime () const {
-		return std::chrono::file_clock::time_point (std::chrono::seconds (this->_mtime_sec) + std::chrono::nanoseconds (this->_mtime_nsec));
+		return std::chrono::file_clock::time_point (std::chrono::nanoseconds (this->record ().mtime));
 	}
 
-	std::string name () const {
-		return this->_path.filename ();
+	std::string_view name () const {
+		return this->_tree->name (this->record ().name);
 	}
-	
-	virtual std::uintmax_t size () const {
-		return this->_size;
+
+	// Invalid for roots and link targets.
+	dir_info parent () const;
+
+	// Totals of the subtree, or of a link along with its target.
+	std::uintmax_t size () const {
+		return this->size (size_metric::apparent);
 	}
-	
-	virtual bool is_dir () const {
-		return false;
+
+	std::uintmax_t allocated () const {
+		return this->size (size_metric::allocated);
 	}
-	
-	virtual bool is_symlink () const {
-		return false;
+
+	std::uintmax_t size (size_metric metric) const;
+	std::size_t files () const;
+
+	bool is_dir () const {
+		return this->record ().type == node_type::dir;
 	}
 
-	virtual ~node_info () = default;
-	
-	virtual void load_info (children_policy &) = 0;
-	
-	std::filesystem::path const &path () const {
-		return this->_path;
+	bool is_symlink () const {
+		return this->record ().type == node_type::link;
 	}
-	
-	node_info (std::filesystem::path &&, struct ::stat const &);
 
-	node_info (node_info &&) = default;
-	node_info (node_info const &) = delete;
-	node_info &operator = (node_info const &) = delete;
-	
+	dir_info as_dir () const;
+	link_info as_link () const;
+
+	void load_info (children_policy const &, node_id_set &visited);
+
+	// Records the inode as visited; if it has been seen already, returns false and drops own size unless policy splits it among hard links.
+	bool visit (children_policy const &, node_id_set &visited) const;
+	// Takes new size of a file or symlink itself from info; returns the change its ancestors should follow.
+	delta refresh (struct ::stat const &, children_policy const &) const;
+
+	std::filesystem::path path () const;
+
 protected:
 	static void throw_errno_if (bool condition);
-	
+
+	node_record &record () const {
+		return (*this->_tree) [this->_index];
+	}
+
+	node_tree &tree () const {
+		return *this->_tree;
+	}
+
+	void set_info (struct ::stat const &) const;
+	// Splits size among hard links if asked to by policy and visits non-directories; directories are visited once opened.
+	void did_set_info (struct ::stat const &, children_policy const &, node_id_set &visited) const;
+
 private:
-	std::filesystem::path const _path;
-	
-	::off_t _size;
-	::ino_t _inode;
-	::time_t _mtime_sec;
-	::uint32_t _mtime_nsec;
-	::dev_t _dev;
+	node_tree *_tree;
+	node_index _index;
 };
 
 class fs::file_info: public node_info {
 public:
-	file_info (file_info &&) = default;
-	file_info (file_info const &) = delete;
-	file_info &operator = (file_info const &) = delete;
-
-	file_info (std::filesystem::path &&path, struct stat const &info): node_info (std::move (path), info) {}
-
-	virtual void load_info (children_policy &) override {}
+	using node_info::node_info;
 };
 
 class fs::dir_info: public node_info {
 public:
-	dir_info (dir_info &&) = default;
-	dir_info (dir_info const &) = delete;
-	dir_info &operator = (dir_info const &) = delete;
+	class iterator {
+	public:
+		typedef std::ptrdiff_t difference_type;
+		typedef node_info value_type;
+		typedef node_info reference;
+		typedef void pointer;
+		typedef std::input_iterator_tag iterator_category;
+
+		iterator (node_tree &tree, node_index index): _tree (&tree), _index (index) {}
 
-	dir_info (std::filesystem::path &&path, struct stat const &info): node_info (std::move (path), info), _children_size () {}
+		node_info operator * () const {
+			return { *this->_tree, this->_index };
+		}
 
-	virtual void load_info (children_policy &) override;
-	
-	virtual bool is_dir () const override {
-		return true;
+		iterator &operator ++ () {
+			this->_index++;
+			return *this;
+		}
+
+		iterator operator ++ (int) {
+			auto result = *this;
+			this->_index++;
+			return result;
+		}
+
+		bool operator == (iterator const &other) const {
+			return this->_index == other._index;
+		}
+
+		bool operator != (iterator const &other) const {
+			return this->_index != other._index;
+		}
+
+	private:
+		node_tree *_tree;
+		node_index _index;
+	};
+
+	struct children_range {
+		iterator const begin_, end_;
+
+		iterator begin () const {
+			return this->begin_;
+		}
+
+		iterator end () const {
+			return this->end_;
+		}
+	};
+
+	using node_info::node_info;
+
+	void load_info (children_policy const &, node_id_set &visited);
+	void load_info (children_policy const &, node_id_set &visited, dir_handle const *parent_handle);
+
+	// Opens relative to parent_handle when it is given and refreshes own info, which is incomplete for children made from bare entry type.
+	dir_handle open (dir_handle const *parent_handle);
+	// Tells whether the directory may be loaded under policy, i.e. it lies on the same device as the entry it was reached through
+	// unless boundaries may be crossed; mount points left out are kept as empty directories. Valid once opened.
+	bool is_within_boundaries (children_policy const &) const;
+	// Reads immediate children only; returns directories which must be loaded before children_did_load () is called.
+	std::vector <dir_info> load_children (children_policy const &, node_id_set &visited, dir_handle const &handle);
+	// Split form of load_children, allowing entries of several directories to be stat'ed as a single batch; entries excluded by name are not stat'ed.
+	void enqueue_children (children_policy const &, dir_handle const &handle, stat_batch &batch) const;
+	// Parts of enqueue_children, letting time spent on reading entries and on matching their names be told apart;
+	// exclude_entries drops entries past from which rules exclude.
+	static void enqueue_entries (dir_handle const &handle, stat_batch &batch);
+	static void exclude_entries (children_policy const &, stat_batch &batch, std::size_t from);
+	std::vector <dir_info> children_did_stat (children_policy const &, node_id_set &visited, dir_handle const &handle, stat_batch::iterator begin, stat_batch::iterator end);
+	// Copies children of an unchanged directory from the record at baseline_index of another tree instead of reading them,
+	// along with its total size; returns directories which must still be loaded, paired with their baseline records.
+	// Children excluded by policy are left out, along with their share of totals.
+	std::vector <std::pair <dir_info, node_index>> children_did_reuse (children_policy const &, node_tree const &baseline, node_index baseline_index, node_id_set &visited);
+	// Tells whether children_did_stat makes a child of a stat'ed entry; children follow such entries in the same order.
+	static bool is_child_entry (children_policy const &, stat_batch::entry const &entry);
+	// Sums up children and orders the largest of them by apparent size; this moves their records, so views of children taken earlier become stale.
+	void children_did_load ();
+	// Orders at least count leading children by metric, and likely some more to spare the following calls; moves records like children_did_load.
+	void order_children (std::size_t count, size_metric metric = size_metric::apparent);
+
+	std::size_t children_count () const {
+		return this->record ().count;
 	}
-	
-	virtual std::uintmax_t size () const override {
-		return node_info::size () + this->_children_size;
+
+	bool is_loading () const {
+		return this->record ().loading;
+	}
+
+	node_info child (std::size_t index) const {
+		return { this->tree (), static_cast <node_index> (this->record ().first + index) };
+	}
+
+	children_range children () const {
+		auto const &record = this->record ();
+		return { iterator (this->tree (), record.first), iterator (this->tree (), record.first + record.count) };
 	}
-	
-private:
-	std::uintmax_t _children_size;
-	std::vector <std::unique_ptr <node_info>> _children;
 };
 
 class fs::link_info: public node_info {
 public:
-	link_info (link_info &&) = default;
-	link_info (link_info const &) = delete;
-	link_info &operator = (link_info const &) = delete;
-
-	link_info (std::filesystem::path &&path, struct stat const &info): node_info (std::move (path), info) {}
-	
-	virtual void load_info (children_policy &) override;
-	
-	virtual bool is_symlink () const override {
-		return true;
-	}
-	
-	virtual std::uintmax_t size () const override {
-		auto result = node_info::size ();
-		if (this->_target) {
-			result += this->_target->size ();
-		}
-		return result;
-	}
+	using node_info::node_info;
 
-private:
-	std::unique_ptr <node_info> _target;
+	void load_info (children_policy const &, node_id_set &visited);
+
+	// Resolves target without loading it; returns invalid node if target is absent or excluded by policy.
+	node_info load_target (children_policy const &, node_id_set &visited, dir_handle const *parent_handle = nullptr);
+
+	node_info target () const {
+		auto const first = this->record ().first;
+		return (first == node_tree::npos) ? node_info () : node_info (this->tree (), first);
+	}
 };
 
+inline fs::dir_info fs::node_info::parent () const {
+	auto const parent = this->record ().parent;
+	if ((parent == node_tree::npos) || ((*this->_tree) [parent].type != node_type::dir)) {
+		return {};
+	}
+	return { *this->_tree, parent };
+}
+
+inline fs::dir_info fs::node_info::as_dir () const {
+	return this->is_dir () ? dir_info (*this->_tree, this->_index) : dir_info ();
+}
+
+inline fs::link_info fs::node_info::as_link () const {
+	return this->is_symlink () ? link_info (*this->_tree, this->_index) : link_info ();
+}
+
 #endif /* node_info_hxx */
@@ -0,0 +1,269 @@
+//
+//  node_tree.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/20/20.
+//
+
+#include "node_tree.hxx"
+
+#include <bit>
+#include <limits>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <functional>
+
+using namespace fs;
+using namespace std;
+
+node_tree::node_tree ():
+	_borrowed (false), _size (), _chunks (new atomic <node_record *> [records_chunks_max] ()), _free_count (),
+	_names (new atomic <char *> [names_chunks_max] ()), _names_count (), _names_shards (),
+	_devices (new ::dev_t [devices_max] ()), _devices_count () {
+	for (auto &shard: this->_names_shards) {
+		shard.used = names_chunk_size;
+	}
+}
+
+node_tree::node_tree (node_record *records, size_t count, char *names, size_t names_size, vector <::dev_t> const &devices):
+	_borrowed (true), _size (count), _chunks (new atomic <node_record *> [records_chunks_max] ()), _free_count (),
+	_names (new atomic <char *> [names_chunks_max] ()), _names_count (), _names_shards (),
+	_devices (new ::dev_t [devices_max] ()), _devices_count () {
+	if ((count > npos) || (names_size > names_chunks_max * names_chunk_size) || (devices.size () > devices_max)) {
+		throw length_error ("node_tree is too large");
+	}
+	for (size_t chunk = 0; (chunk << records_chunk_shift) < count; chunk++) {
+		this->_chunks [chunk].store (records + (chunk << records_chunk_shift), memory_order::relaxed);
+	}
+	for (size_t chunk = 0; chunk * names_chunk_size < names_size; chunk++) {
+		this->_names [chunk].store (names + chunk * names_chunk_size, memory_order::relaxed);
+	}
+	this->_names_count.store ((names_size + names_chunk_size - 1) / names_chunk_size, memory_order::release);
+	copy (devices.begin (), devices.end (), this->_devices.get ());
+	this->_devices_count.store (static_cast <device_index> (devices.size ()), memory_order::release);
+}
+
+node_tree::~node_tree () {
+	if (this->_borrowed) {
+		return;
+	}
+	for (size_t i = 0; i < records_chunks_max; i++) {
+		delete [] this->_chunks [i].load (memory_order::relaxed);
+	}
+	for (size_t i = 0; i < names_chunks_max; i++) {
+		delete [] this->_names [i].load (memory_order::relaxed);
+	}
+}
+
+node_index node_tree::allocate (size_t count) {
+	if (this->_borrowed) {
+		throw logic_error ("node_tree does not own its records");
+	}
+	if (count && (this->_free_count.load (memory_order::acquire) >= count)) {
+		scoped_lock lock (this->_free_lock);
+		if (auto const reused = this->reuse (count); reused != npos) {
+			return reused;
+		}
+	}
+	auto const result = this->_size.fetch_add (count, memory_order::acq_rel);
+	if (result + count > npos) {
+		throw length_error ("node_tree is full");
+	}
+
+	for (auto chunk = result >> records_chunk_shift; count && (chunk <= ((result + count - 1) >> records_chunk_shift)); chunk++) {
+		if (this->_chunks [chunk].load (memory_order::acquire)) {
+			continue;
+		}
+		scoped_lock lock (this->_chunks_lock);
+		if (!this->_chunks [chunk].load (memory_order::relaxed)) {
+			this->_chunks [chunk].store (new node_record [records_chunk_size] (), memory_order::release);
+		}
+	}
+	return static_cast <node_index> (result);
+}
+
+void node_tree::release (node_index first, size_t count) {
+	if (this->_borrowed) {
+		throw logic_error ("node_tree does not own its records");
+	}
+	if (!count) {
+		return;
+	}
+	scoped_lock lock (this->_free_lock);
+	this->add_free_range (first, count);
+}
+
+node_index node_tree::reuse (size_t count) {
+	auto const take = [this, count] (vector <pair <node_index, uint32_t>> &ranges, size_t position) {
+		auto const [first, size] = ranges [position];
+		ranges [position] = ranges.back ();
+		ranges.pop_back ();
+		this->_free_count.fetch_sub (size, memory_order::acq_rel);
+		// What is left of it is released again.
+		if (size > count) {
+			this->add_free_range (static_cast <node_index> (first + count), size - count);
+		}
+		return first;
+	};
+	
+	// Ranges of the same class may or may not fit, so only the latest few of them are looked at.
+	auto const count_class = static_cast <size_t> (bit_width (count) - 1);
+	auto &same_class = this->_free [count_class];
+	for (size_t i = same_class.size (), looked = 0; i && (looked < free_ranges_lookup); i--, looked++) {
+		if (same_class [i - 1].second >= count) {
+			return take (same_class, i - 1);
+		}
+	}
+	// Any range of the classes above fits.
+	for (auto size_class = count_class + 1; size_class < this->_free.size (); size_class++) {
+		if (!this->_free [size_class].empty ()) {
+			return take (this->_free [size_class], this->_free [size_class].size () - 1);
+		}
+	}
+	return npos;
+}
+
+void node_tree::add_free_range (node_index first, size_t count) {
+	this->_free [bit_width (count) - 1].emplace_back (first, static_cast <uint32_t> (count));
+	this->_free_count.fetch_add (count, memory_order::acq_rel);
+}
+
+name_id node_tree::intern (string_view name) {
+	if (this->_borrowed) {
+		throw logic_error ("node_tree does not own its names");
+	}
+	auto const hash = std::hash <string_view> () (name);
+	auto &shard = this->_names_shards [hash >> (sizeof (hash) * CHAR_BIT - names_shards_bits)];
+
+	scoped_lock lock (shard.lock);
+	if (shard.slots.empty ()) {
+		shard.slots.resize (1024);
+	}
+
+	auto const mask = shard.slots.size () - 1;
+	auto slot = hash & mask;
+	for (; shard.slots [slot]; slot = (slot + 1) & mask) {
+		if (this->name (shard.slots [slot] - 1) == name) {
+			return shard.slots [slot] - 1;
+		}
+	}
+
+	auto const result = this->store_name (shard, name);
+	shard.slots [slot] = result + 1;
+	if (++shard.count * 2 > shard.slots.size ()) {
+		this->rehash (shard);
+	}
+	return result;
+}
+
+string_view node_tree::name (name_id id) const {
+	auto const ptr = this->name_ptr (id);
+	uint16_t length;
+	memcpy (&length, ptr, sizeof (length));
+	return string_view (ptr + sizeof (length), length);
+}
+
+device_index node_tree::intern_device (::dev_t device) {
+	auto count = this->_devices_count.load (memory_order::acquire);
+	for (device_index i = 0; i < count; i++) {
+		if (this->_devices [i] == device) {
+			return i;
+		}
+	}
+
+	scoped_lock lock (this->_devices_lock);
+	count = this->_devices_count.load (memory_order::relaxed);
+	for (device_index i = 0; i < count; i++) {
+		if (this->_devices [i] == device) {
+			return i;
+		}
+	}
+	if (count == devices_max) {
+		throw length_error ("too many devices");
+	}
+	this->_devices [count] = device;
+	this->_devices_count.store (count + 1, memory_order::release);
+	return count;
+}
+
+name_id node_tree::append_name (vector <char> &table, string_view name) {
+	if (name.size () > numeric_limits <uint16_t>::max ()) {
+		throw length_error ("name is too long");
+	}
+
+	auto const length = static_cast <uint16_t> (name.size ());
+	auto const offset = table.size ();
+	if (offset / names_alignment > numeric_limits <name_id>::max ()) {
+		throw length_error ("name table is full");
+	}
+	table.resize (offset + ((sizeof (length) + length + names_alignment - 1) & ~(names_alignment - 1)));
+	memcpy (table.data () + offset, &length, sizeof (length));
+	memcpy (table.data () + offset + sizeof (length), name.data (), length);
+	return static_cast <name_id> (offset / names_alignment);
+}
+
+size_t node_tree::memory_usage () const {
+	auto const records_chunks = (this->size () + records_chunk_size - 1) >> records_chunk_shift;
+	size_t result = records_chunks * records_chunk_size * sizeof (node_record);
+	result += this->_names_count.load (memory_order::acquire) * names_chunk_size;
+	for (auto const &shard: this->_names_shards) {
+		result += shard.slots.capacity () * sizeof (name_id);
+	}
+	return result;
+}
+
+bool node_tree::is_within_table (char const *table, size_t size, name_id id) {
+	auto const offset = size_t (id) * names_alignment;
+	uint16_t length;
+	if ((offset > size) || (size - offset < sizeof (length))) {
+		return false;
+	}
+	memcpy (&length, table + offset, sizeof (length));
+	return length <= size - offset - sizeof (length);
+}
+
+char const *node_tree::name_ptr (name_id id) const {
+	auto const offset = size_t (id) * names_alignment;
+	return this->_names [offset / names_chunk_size].load (memory_order::acquire) + offset % names_chunk_size;
+}
+
+name_id node_tree::store_name (names_shard &shard, string_view name) {
+	if (name.size () > numeric_limits <uint16_t>::max ()) {
+		throw length_error ("name is too long");
+	}
+
+	auto const length = static_cast <uint16_t> (name.size ());
+	auto const required = (sizeof (length) + length + names_alignment - 1) & ~(names_alignment - 1);
+	if (shard.used + required > names_chunk_size) {
+		auto const chunk = this->_names_count.fetch_add (1, memory_order::acq_rel);
+		if (chunk >= names_chunks_max) {
+			throw length_error ("name pool is full");
+		}
+		this->_names [chunk].store (new char [names_chunk_size], memory_order::release);
+		shard.chunk = chunk;
+		shard.used = 0;
+	}
+
+	auto const ptr = this->_names [shard.chunk].load (memory_order::relaxed) + shard.used;
+	memcpy (ptr, &length, sizeof (length));
+	memcpy (ptr + sizeof (length), name.data (), length);
+	auto const result = static_cast <name_id> ((shard.chunk * names_chunk_size + shard.used) / names_alignment);
+	shard.used += required;
+	return result;
+}
+
+void node_tree::rehash (names_shard &shard) {
+	vector <name_id> slots (shard.slots.size () * 2);
+	auto const mask = slots.size () - 1;
+	for (auto const stored: shard.slots) {
+		if (!stored) {
+			continue;
+		}
+		auto slot = std::hash <string_view> () (this->name (stored - 1)) & mask;
+		for (; slots [slot]; slot = (slot + 1) & mask);
+		slots [slot] = stored;
+	}
+	shard.slots = std::move (slots);
+}
@@ -0,0 +1,172 @@
+//
+//  node_tree.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/20/20.
+//
+
+#ifndef node_tree_hxx
+#define node_tree_hxx
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <string_view>
+#include <sys/types.h>
+
+namespace fs {
+	typedef std::uint32_t node_index;
+	typedef std::uint32_t name_id;
+	typedef std::uint32_t device_index;
+
+	enum struct node_type: std::uint8_t;
+	enum struct size_metric: std::uint8_t;
+	struct node_record;
+	class node_tree;
+}
+
+enum struct fs::node_type: std::uint8_t {
+	file = 0,
+	dir,
+	link,
+};
+
+enum struct fs::size_metric: std::uint8_t {
+	// Length of file contents, i. e. st_size.
+	apparent = 0,
+	// Space taken on disk, i. e. st_blocks * 512; less than apparent for sparse or compressed files.
+	allocated,
+};
+
+struct fs::node_record {
+	std::uint64_t size;
+	std::uint64_t total_size;
+	std::uint64_t allocated;
+	std::uint64_t total_allocated;
+	std::uint64_t inode;
+	// Nanoseconds since the epoch.
+	std::int64_t mtime;
+	device_index device;
+	node_index parent;
+	node_index first;
+	std::uint32_t count;
+	// Entries other than directories within the subtree.
+	std::uint32_t total_files;
+	name_id name;
+	// Leading children of a directory ordered by sorted_by; the rest are no larger than any of them.
+	std::uint32_t sorted;
+	node_type type;
+	size_metric sorted_by;
+	// Set on a directory while its subtree is being scanned; its totals are partial until then.
+	bool loading;
+};
+
+static_assert (sizeof (fs::node_record) == 80, "node_record should stay compact");
+
+class fs::node_tree {
+public:
+	static node_index constexpr npos = ~node_index (0);
+
+	node_tree ();
+	// Views records and a name table laid out by append_name without copying them; such tree does not own that memory and may not grow.
+	node_tree (node_record *records, std::size_t count, char *names, std::size_t names_size, std::vector <::dev_t> const &devices);
+	node_tree (node_tree const &) = delete;
+	node_tree &operator = (node_tree const &) = delete;
+	~node_tree ();
+
+	std::size_t size () const {
+		return this->_size.load (std::memory_order::acquire);
+	}
+
+	// Reserves count contiguous records, reusing released ones first; safe to call from several threads at once.
+	node_index allocate (std::size_t count);
+	// Returns count records starting at first for allocate to hand out again; nothing may refer to them any longer.
+	void release (node_index first, std::size_t count);
+
+	node_record &operator [] (node_index index) {
+		return this->_chunks [index >> records_chunk_shift].load (std::memory_order::acquire) [index & records_chunk_mask];
+	}
+
+	node_record const &operator [] (node_index index) const {
+		return this->_chunks [index >> records_chunk_shift].load (std::memory_order::acquire) [index & records_chunk_mask];
+	}
+
+	name_id intern (std::string_view name);
+	std::string_view name (name_id id) const;
+
+	device_index intern_device (::dev_t device);
+	::dev_t device (device_index index) const {
+		return this->_devices [index];
+	}
+
+	std::size_t devices_count () const {
+		return this->_devices_count.load (std::memory_order::acquire);
+	}
+
+	// Appends name to a contiguous table laid out like the name pool; returns its id within that table.
+	static name_id append_name (std::vector <char> &table, std::string_view name);
+	// Whether id refers to a name lying whole within such table of size bytes.
+	static bool is_within_table (char const *table, std::size_t size, name_id id);
+
+	// Bytes held by node records, name pool and its index, i. e. everything but the tree object itself.
+	std::size_t memory_usage () const;
+
+private:
+	static std::size_t constexpr records_chunk_shift = 16;
+	static std::size_t constexpr records_chunk_size = std::size_t (1) << records_chunk_shift;
+	static std::size_t constexpr records_chunk_mask = records_chunk_size - 1;
+	static std::size_t constexpr records_chunks_max = (std::size_t (npos) + 1) / records_chunk_size;
+
+	// Released ranges looked at in the size class of a request before taking one of a larger class.
+	static std::size_t constexpr free_ranges_lookup = 16;
+
+	static std::size_t constexpr names_chunk_size = std::size_t (1) << 18;
+	static std::size_t constexpr names_chunks_max = std::size_t (1) << 16;
+	static std::size_t constexpr names_alignment = 4;
+	static std::size_t constexpr names_shards_bits = 5;
+	static std::size_t constexpr names_shards = std::size_t (1) << names_shards_bits;
+
+	static std::size_t constexpr devices_max = 1 << 16;
+
+	struct names_shard {
+		std::mutex lock;
+		std::size_t chunk, used;
+		std::vector <name_id> slots;
+		std::size_t count;
+	};
+
+	// Released ranges of at least 2^i and less than 2^(i + 1) records at index i.
+	typedef std::array <std::vector <std::pair <node_index, std::uint32_t>>, sizeof (node_index) * 8> free_ranges;
+
+	// Takes count records out of a released range large enough, if any; called with _free_lock held.
+	node_index reuse (std::size_t count);
+	void add_free_range (node_index first, std::size_t count);
+
+	char const *name_ptr (name_id id) const;
+	name_id store_name (names_shard &shard, std::string_view name);
+	void rehash (names_shard &shard);
+
+	bool const _borrowed;
+	std::atomic <std::size_t> _size;
+	std::unique_ptr <std::atomic <node_record *> []> const _chunks;
+	std::mutex _chunks_lock;
+
+	free_ranges _free;
+	// Released records not handed out again, so that allocate need not take _free_lock while there are none.
+	std::atomic <std::size_t> _free_count;
+	std::mutex _free_lock;
+
+	std::unique_ptr <std::atomic <char *> []> const _names;
+	std::atomic <std::size_t> _names_count;
+	std::array <names_shard, names_shards> _names_shards;
+
+	std::unique_ptr <::dev_t []> const _devices;
+	std::atomic <device_index> _devices_count;
+	std::mutex _devices_lock;
+};
+
+#endif /* node_tree_hxx */
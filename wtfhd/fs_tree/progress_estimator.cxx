@@ -0,0 +1,100 @@
+//
+//  progress_estimator.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/3/20.
+//
+
+#include "progress_estimator.hxx"
+
+#include <cmath>
+#include <algorithm>
+#include <sys/statvfs.h>
+
+using namespace fs;
+using namespace std;
+using namespace util;
+using namespace chrono;
+using namespace chrono_literals;
+
+// Throughput samples weigh less by e every this long.
+static duration <double> constexpr rate_smoothing = 5s;
+
+void progress_estimator::add_device (::dev_t device, int fd, bool whole) {
+	{
+		scoped_lock lock (this->_devices_lock);
+		if (auto const it = this->_devices.find (device); it != this->_devices.end ()) {
+			it->second.whole |= whole;
+			return;
+		}
+	}
+	struct ::statvfs info;
+	if (::fstatvfs (fd, &info)) {
+		return;
+	}
+	device_usage usage;
+	usage.inodes = (info.f_files > info.f_ffree) ? static_cast <uint64_t> (info.f_files - info.f_ffree) : 0;
+	usage.bytes = (info.f_blocks > info.f_bfree) ? static_cast <uint64_t> (info.f_blocks - info.f_bfree) * info.f_frsize : 0;
+	usage.whole = whole;
+	
+	scoped_lock lock (this->_devices_lock);
+	auto const [it, inserted] = this->_devices.emplace (device, usage);
+	if (!inserted) {
+		it->second.whole |= whole;
+	}
+}
+
+optional <double> progress_estimator::expected_entries (device_usage const &usage, double bytes_per_entry) {
+	if (usage.inodes) {
+		return static_cast <double> (usage.inodes);
+	}
+	if (usage.bytes && (bytes_per_entry > 0.0)) {
+		return static_cast <double> (usage.bytes) / bytes_per_entry;
+	}
+	return nullopt;
+}
+
+progress_t progress_estimator::estimate (scan_stats const &stats, size_t ready_dirs, size_t total_dirs) {
+	auto const found = static_cast <double> (stats.entries);
+	// Directories found but not loaded yet are expected to hold as many entries as loaded ones do on average.
+	auto const pending = static_cast <double> (total_dirs - min (ready_dirs, total_dirs));
+	auto const discovered = found + (ready_dirs ? pending * found / static_cast <double> (ready_dirs) : 0.0);
+	auto const bytes_per_entry = stats.entries ? static_cast <double> (stats.allocated) / found : 0.0;
+	
+	// Devices scanned as a whole hold at least as many entries as they use inodes, hard links aside, and no device holds more.
+	double whole = 0.0, bound = 0.0;
+	auto bounded = true;
+	{
+		scoped_lock lock (this->_devices_lock);
+		for (auto const &[device, usage]: this->_devices) {
+			auto const expected = expected_entries (usage, bytes_per_entry);
+			if (!expected) {
+				bounded = false;
+				continue;
+			}
+			bound += *expected;
+			if (usage.whole && !this->_partial) {
+				whole += *expected;
+			}
+		}
+	}
+	auto expected = max (discovered, whole);
+	if (bounded && (bound > 0.0)) {
+		expected = min (expected, bound);
+	}
+	expected = max (expected, found);
+	
+	if (auto const interval = duration <double> (stats.elapsed - this->_last_elapsed); interval.count () > 0.0) {
+		auto const rate = static_cast <double> (stats.entries - min (stats.entries, this->_last_entries)) / interval.count ();
+		auto const weight = (this->_last_elapsed.count () > 0) ? 1.0 - exp (-interval / rate_smoothing) : 1.0;
+		this->_rate += weight * (rate - this->_rate);
+		this->_last_elapsed = stats.elapsed;
+		this->_last_entries = stats.entries;
+	}
+	
+	optional <seconds> remaining;
+	if (this->_rate > 0.0) {
+		remaining = seconds (llround ((expected - found) / this->_rate));
+	}
+	return progress_t { stats.entries, static_cast <size_t> (llround (expected)), remaining };
+}
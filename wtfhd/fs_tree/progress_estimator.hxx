@@ -0,0 +1,62 @@
+//
+//  progress_estimator.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/3/20.
+//
+
+#ifndef progress_estimator_hxx
+#define progress_estimator_hxx
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <sys/types.h>
+
+#include "misc_types.hxx"
+#include "scan_stats.hxx"
+
+namespace fs {
+	class progress_estimator;
+}
+
+// Guesses how many entries a scan is going to find, and when, from the usage of the devices it covers and from what it found so far.
+// Devices are added by any worker, but only as they are first met; estimates are taken by a single thread, e.g. on every progress update.
+class fs::progress_estimator {
+public:
+	// Takes inode and block usage of the device holding the open directory fd. whole tells that the scan covers all of it,
+	// i.e. the directory is the root of its file system, so its used inodes are the number of entries expected rather than an upper bound.
+	void add_device (::dev_t device, int fd, bool whole);
+	// Entries and the exclusion rules of the scan may leave out some of them, which makes device usage an upper bound as well.
+	void set_partial () {
+		this->_partial = true;
+	}
+
+	// Counts entries found against those expected; ready_dirs of total_dirs found so far are loaded.
+	util::progress_t estimate (scan_stats const &stats, std::size_t ready_dirs, std::size_t total_dirs);
+
+private:
+	struct device_usage {
+		// Zero on file systems not counting inodes, e.g. btrfs, or not counting anything, e.g. procfs.
+		std::uint64_t inodes;
+		std::uint64_t bytes;
+		bool whole;
+	};
+
+	// Entries expected on a device; those of file systems without inode counts are guessed from their used blocks and the bytes per entry found so far.
+	static std::optional <double> expected_entries (device_usage const &usage, double bytes_per_entry);
+
+	std::map <::dev_t, device_usage> _devices;
+	std::mutex _devices_lock;
+	bool _partial = false;
+
+	// Entries per second, weighted towards the latest samples.
+	double _rate = 0.0;
+	std::chrono::nanoseconds _last_elapsed {};
+	std::uint64_t _last_entries = 0;
+};
+
+#endif /* progress_estimator_hxx */
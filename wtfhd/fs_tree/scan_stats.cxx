@@ -0,0 +1,106 @@
+//
+//  scan_stats.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/2/20.
+//
+
+#include "scan_stats.hxx"
+
+#include <bit>
+#include <numeric>
+
+using namespace fs;
+using namespace std;
+using namespace chrono;
+
+// Durations under 256 ns are not told apart.
+static int constexpr latency_shift = 8;
+
+size_t latency_histogram::bucket (nanoseconds duration) {
+	auto const ticks = static_cast <uint64_t> (max <nanoseconds::rep> (duration.count (), 0)) >> latency_shift;
+	return min <size_t> (static_cast <size_t> (bit_width (ticks)), buckets_count - 1);
+}
+
+nanoseconds latency_histogram::bucket_limit (size_t bucket) {
+	return nanoseconds (nanoseconds::rep (1) << (latency_shift + min (bucket, buckets_count - 2)));
+}
+
+nanoseconds latency_histogram::quantile (counts_type const &counts, double ratio) {
+	auto const total = accumulate (counts.begin (), counts.end (), uint64_t (0));
+	if (!total) {
+		return {};
+	}
+	auto const threshold = static_cast <uint64_t> (ratio * static_cast <double> (total));
+	uint64_t count = 0;
+	for (size_t i = 0; i < buckets_count; i++) {
+		if ((count += counts [i]) > threshold) {
+			return bucket_limit (i);
+		}
+	}
+	return bucket_limit (buckets_count - 1);
+}
+
+char const *scan_stats::phase_name (phase phase) {
+	switch (phase) {
+	case phase::open:
+		return "open";
+	case phase::read:
+		return "read";
+	case phase::rules:
+		return "rules";
+	case phase::stat:
+		return "stat";
+	case phase::build:
+		return "build";
+	case phase::order:
+		return "order";
+	case phase::throttle:
+		return "throttle";
+	}
+	return "";
+}
+
+nanoseconds scan_stats::stat_latency (double ratio) const {
+	return latency_histogram::quantile (this->stat_latencies, ratio);
+}
+
+void scan_stats::write_json (ostream &output) const {
+	output << "{\"elapsed_ns\":" << this->elapsed.count ();
+	output << ",\"dirs\":" << this->dirs << ",\"entries\":" << this->entries << ",\"stat_calls\":" << this->stat_calls << ",\"errors\":" << this->errors;
+	output << ",\"bytes\":" << this->bytes << ",\"allocated\":" << this->allocated << ",\"syscalls\":" << this->syscalls << ",\"queued\":" << this->queued;
+	output << ",\"stat_latency_ns\":{\"p50\":" << this->stat_latency (0.5).count () << ",\"p99\":" << this->stat_latency (0.99).count () << ",\"buckets\":[";
+	for (size_t i = 0; i < latency_histogram::buckets_count; i++) {
+		output << (i ? "," : "") << "{\"below_ns\":";
+		if (i + 1 < latency_histogram::buckets_count) {
+			output << latency_histogram::bucket_limit (i).count ();
+		} else {
+			output << "null";
+		}
+		output << ",\"count\":" << this->stat_latencies [i] << "}";
+	}
+	output << "]},\"phases_ns\":{";
+	for (size_t i = 0; i < phases_count; i++) {
+		output << (i ? "," : "") << "\"" << phase_name (static_cast <phase> (i)) << "\":" << this->phases [i].count ();
+	}
+	output << "}}" << endl;
+}
+
+void scan_counters::collect (scan_stats &stats) const {
+	auto const value = [this] (counter counter) {
+		return this->_counters [static_cast <size_t> (counter)].load (memory_order::relaxed);
+	};
+	stats.dirs += value (counter::dirs);
+	stats.entries += value (counter::entries);
+	stats.stat_calls += value (counter::stat_calls);
+	stats.errors += value (counter::errors);
+	stats.bytes += value (counter::bytes);
+	stats.allocated += value (counter::allocated);
+	stats.syscalls += value (counter::syscalls);
+	// Tasks may be popped by other workers than those pushing them, so only the sum over all of them makes sense.
+	stats.queued += value (counter::pushed) - value (counter::popped);
+	for (size_t i = 0; i < scan_stats::phases_count; i++) {
+		stats.phases [i] += nanoseconds (this->_phases [i].load (memory_order::relaxed));
+	}
+	this->_stat_latencies.collect (stats.stat_latencies);
+}
@@ -0,0 +1,155 @@
+//
+//  scan_stats.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/2/20.
+//
+
+#ifndef scan_stats_hxx
+#define scan_stats_hxx
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace fs {
+	class latency_histogram;
+	class scan_counters;
+	struct scan_stats;
+}
+
+// Counts durations in buckets twice as wide as the previous ones, from under 256 ns to over a second.
+// Written by a single thread and read by any, so that neither takes a lock.
+class fs::latency_histogram {
+public:
+	static std::size_t constexpr buckets_count = 24;
+	typedef std::array <std::uint64_t, buckets_count> counts_type;
+
+	void add (std::chrono::nanoseconds duration) {
+		auto &count = this->_counts [bucket (duration)];
+		count.store (count.load (std::memory_order::relaxed) + 1, std::memory_order::relaxed);
+	}
+
+	void collect (counts_type &counts) const {
+		for (std::size_t i = 0; i < buckets_count; i++) {
+			counts [i] += this->_counts [i].load (std::memory_order::relaxed);
+		}
+	}
+
+	static std::size_t bucket (std::chrono::nanoseconds duration);
+	// Upper bound of durations counted in bucket; the last one has none and reports its lower bound.
+	static std::chrono::nanoseconds bucket_limit (std::size_t bucket);
+	// Smallest duration at least ratio of those counted took no longer than, up to the resolution of buckets.
+	static std::chrono::nanoseconds quantile (counts_type const &counts, double ratio);
+
+private:
+	std::array <std::atomic <std::uint64_t>, buckets_count> _counts {};
+};
+
+// Totals of a scan summed up over its workers.
+struct fs::scan_stats {
+	enum struct phase {
+		// Opening directories, along with stat'ing them.
+		open = 0,
+		// Reading entries, i.e. getdents.
+		read,
+		// Matching entry names against include and exclude rules.
+		rules,
+		// Stat'ing entries, or waiting for asynchronous requests to complete.
+		stat,
+		// Making records of entries and following links.
+		build,
+		// Summing up finished subtrees and ordering their largest children.
+		order,
+		// Waiting for rate limits.
+		throttle,
+	};
+	static std::size_t constexpr phases_count = 7;
+
+	static char const *phase_name (phase phase);
+
+	std::chrono::nanoseconds elapsed {};
+	std::uint64_t dirs = 0, entries = 0, stat_calls = 0, errors = 0;
+	// Apparent and allocated size of files stat'ed or reused from baseline so far.
+	std::uint64_t bytes = 0, allocated = 0;
+	// Calls counted against scan_limits::syscalls, whether limited or not.
+	std::uint64_t syscalls = 0;
+	// Directories waiting for workers.
+	std::uint64_t queued = 0;
+	// Time spent by all workers together, so it may exceed elapsed.
+	std::array <std::chrono::nanoseconds, phases_count> phases {};
+	latency_histogram::counts_type stat_latencies {};
+
+	// Smallest duration at least ratio of stat calls took no longer than, up to the histogram resolution.
+	std::chrono::nanoseconds stat_latency (double ratio) const;
+	void write_json (std::ostream &output) const;
+};
+
+// Counters of a single worker; only that worker updates them, while any thread may read them at once. Aligned so that workers do not share cache lines.
+class alignas (64) fs::scan_counters {
+public:
+	enum struct counter {
+		dirs = 0,
+		entries,
+		stat_calls,
+		errors,
+		bytes,
+		allocated,
+		pushed,
+		popped,
+		syscalls,
+	};
+	static std::size_t constexpr counters_count = 9;
+
+	// Charges the time until it is destroyed to phase.
+	class timer {
+	public:
+		timer (scan_counters &counters, scan_stats::phase phase): _counters (counters), _phase (phase), _start (std::chrono::steady_clock::now ()) {}
+		timer (timer const &) = delete;
+		timer &operator = (timer const &) = delete;
+
+		~timer () {
+			this->_counters.add (this->_phase, std::chrono::steady_clock::now () - this->_start);
+		}
+
+	private:
+		scan_counters &_counters;
+		scan_stats::phase const _phase;
+		std::chrono::steady_clock::time_point const _start;
+	};
+
+	scan_counters (scan_counters *next): next (next) {}
+	scan_counters (scan_counters const &) = delete;
+	scan_counters &operator = (scan_counters const &) = delete;
+
+	void add (counter counter, std::uint64_t value = 1) {
+		add (this->_counters [static_cast <std::size_t> (counter)], value);
+	}
+
+	void add (scan_stats::phase phase, std::chrono::nanoseconds duration) {
+		add (this->_phases [static_cast <std::size_t> (phase)], static_cast <std::uint64_t> (duration.count ()));
+	}
+
+	latency_histogram &stat_latencies () {
+		return this->_stat_latencies;
+	}
+
+	// Adds these counters to stats.
+	void collect (scan_stats &stats) const;
+
+	// Counters of the worker started before, so that all of them make a list which is only ever prepended.
+	scan_counters *const next;
+
+private:
+	static void add (std::atomic <std::uint64_t> &target, std::uint64_t value) {
+		target.store (target.load (std::memory_order::relaxed) + value, std::memory_order::relaxed);
+	}
+
+	std::array <std::atomic <std::uint64_t>, counters_count> _counters {};
+	std::array <std::atomic <std::uint64_t>, scan_stats::phases_count> _phases {};
+	latency_histogram _stat_latencies;
+};
+
+#endif /* scan_stats_hxx */
@@ -0,0 +1,117 @@
+//
+//  scan_throttle.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/4/20.
+//
+
+#include "scan_throttle.hxx"
+
+#include <algorithm>
+
+using namespace fs;
+using namespace std;
+using namespace chrono;
+using namespace chrono_literals;
+
+// Calls let through at once after a pause, as time worth of them.
+static steady_clock::duration constexpr burst = 100ms;
+// Backing off never goes below it, so that the scan keeps making progress however slow the device is.
+static double constexpr backoff_min_rate = 64.0;
+
+steady_clock::time_point scan_throttle::bucket::reserve (time_point now, uint64_t count) {
+	if (!this->rate || !count) {
+		return now;
+	}
+	this->full = max (this->full, now) + duration_cast <steady_clock::duration> (duration <double> (static_cast <double> (count) / this->rate));
+	return this->full - burst;
+}
+
+scan_limits scan_throttle::limits () const {
+	scoped_lock lock (this->_lock);
+	return this->_limits;
+}
+
+void scan_throttle::set_limits (scan_limits const &limits) {
+	scoped_lock lock (this->_lock);
+	this->_limits = limits;
+	if (!limits.latency_threshold.count () || (limits.syscalls && (this->_backoff_rate >= limits.syscalls))) {
+		this->_backoff_rate = 0.0;
+	}
+	this->update_rates ();
+}
+
+double scan_throttle::syscalls_rate () const {
+	scoped_lock lock (this->_lock);
+	return this->_syscalls.rate;
+}
+
+void scan_throttle::acquire (uint64_t syscalls, uint64_t dirs) {
+	if (!this->is_limited ()) {
+		return;
+	}
+	unique_lock lock (this->_lock);
+	for (;;) {
+		auto const now = steady_clock::now ();
+		auto const until = max (this->_syscalls.reserve (now, syscalls), this->_dirs.reserve (now, dirs));
+		auto const generation = this->_generation;
+		if (this->_cancelled || (until <= now)) {
+			return;
+		}
+		if (!this->_changed.wait_until (lock, until, [this, generation] { return this->_cancelled || (this->_generation != generation); })) {
+			return;
+		}
+	}
+}
+
+void scan_throttle::cancel () {
+	{
+		scoped_lock lock (this->_lock);
+		this->_cancelled = true;
+		this->_limited.store (false, memory_order::release);
+	}
+	this->_changed.notify_all ();
+}
+
+void scan_throttle::adapt (nanoseconds latency, double observed_rate) {
+	scoped_lock lock (this->_lock);
+	auto const limit = this->_limits.syscalls;
+	if (!this->_limits.latency_threshold.count () || (observed_rate <= 0.0)) {
+		return;
+	}
+	if (latency > this->_limits.latency_threshold) {
+		if (!this->_backoff_rate) {
+			this->_unthrottled_rate = observed_rate;
+		}
+		auto const current = this->_backoff_rate ? min (this->_backoff_rate, observed_rate) : (limit ? min (limit, observed_rate) : observed_rate);
+		this->_backoff_rate = max (current / 2.0, backoff_min_rate);
+	} else if (this->_backoff_rate) {
+		this->_backoff_rate *= 1.25;
+		if (this->_backoff_rate >= (limit ? limit : this->_unthrottled_rate)) {
+			this->_backoff_rate = 0.0;
+		}
+	} else {
+		return;
+	}
+	this->update_rates ();
+}
+
+void scan_throttle::update_rates () {
+	auto const now = steady_clock::now ();
+	auto const syscalls = this->_backoff_rate ? (this->_limits.syscalls ? min (this->_backoff_rate, this->_limits.syscalls) : this->_backoff_rate) : this->_limits.syscalls;
+	auto changed = false;
+	for (auto const &[bucket, rate]: { pair (&this->_syscalls, syscalls), pair (&this->_dirs, this->_limits.dirs) }) {
+		if (bucket->rate != rate) {
+			// Turns reserved so far are dropped, and those still waiting are taken again at the new rate.
+			bucket->rate = rate;
+			bucket->full = now;
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return;
+	}
+	this->_limited.store (!this->_cancelled && (this->_syscalls.rate || this->_dirs.rate), memory_order::release);
+	this->_generation++;
+	this->_changed.notify_all ();
+}
@@ -0,0 +1,82 @@
+//
+//  scan_throttle.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 11/4/20.
+//
+
+#ifndef scan_throttle_hxx
+#define scan_throttle_hxx
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+
+namespace fs {
+	struct scan_limits;
+	class scan_throttle;
+}
+
+struct fs::scan_limits {
+	// System calls per second, counting every stat call and a few more for every directory read; zero leaves them unlimited.
+	double syscalls = 0.0;
+	// Directories read per second; zero leaves them unlimited.
+	double dirs = 0.0;
+	// Backs off syscalls while 90% of stat calls do not complete within it, and speeds up again once they do; zero turns it off.
+	std::chrono::nanoseconds latency_threshold {};
+};
+
+// Paces workers of a scan with a token bucket for each of the limits, refilled continuously and holding up to a tenth of a second worth of calls.
+// Any number of workers may wait at once, each for its own turn, while limits are changed by any thread.
+class fs::scan_throttle {
+public:
+	scan_limits limits () const;
+	void set_limits (scan_limits const &limits);
+	// Syscalls per second allowed now: below limits ().syscalls, or set although those are unlimited, while backing off; zero if unlimited.
+	double syscalls_rate () const;
+
+	// Tells whether acquire () may ever wait, so that callers need not time it otherwise.
+	bool is_limited () const {
+		return this->_limited.load (std::memory_order::acquire);
+	}
+
+	// Waits until syscalls calls, reading dirs directories along with them, fit within the limits; returns at once if cancelled.
+	// Taking more than a bucket holds at once is allowed and delays the next callers instead.
+	void acquire (std::uint64_t syscalls, std::uint64_t dirs);
+	// Lets waiting and later callers through for good, e.g. as the scan is cancelled.
+	void cancel ();
+
+	// Takes stat latency and the rate of syscalls observed over an interval: halves the rate allowed while latency is above the threshold,
+	// and raises it by a quarter after each interval it is not, up to limits ().syscalls or the rate observed before backing off.
+	void adapt (std::chrono::nanoseconds latency, double observed_rate);
+
+private:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	// Generic cell rate algorithm: rather than tokens, keeps the time the bucket is going to be full again.
+	struct bucket {
+		double rate = 0.0;
+		time_point full {};
+
+		// Takes count tokens, returning when they are going to be there.
+		time_point reserve (time_point now, std::uint64_t count);
+	};
+
+	// Applies limits and backoff to buckets, and lets waiting callers take their turns anew if that changes their rates; called with _lock held.
+	void update_rates ();
+
+	mutable std::mutex _lock;
+	std::condition_variable _changed;
+	scan_limits _limits;
+	// Syscalls per second allowed while backing off, and those observed before it started.
+	double _backoff_rate = 0.0, _unthrottled_rate = 0.0;
+	bucket _syscalls, _dirs;
+	// Bumped whenever rates change, so that waiting callers reserve their turns again.
+	std::uint64_t _generation = 0;
+	bool _cancelled = false;
+	std::atomic <bool> _limited {};
+};
+
+#endif /* scan_throttle_hxx */
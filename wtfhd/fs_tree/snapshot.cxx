@@ -0,0 +1,218 @@
+//
+//  snapshot.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/24/20.
+//
+
+#include "snapshot.hxx"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace fs;
+using namespace std;
+using namespace filesystem;
+
+namespace {
+	array <char, 8> constexpr snapshot_magic { 'w', 't', 'f', 'h', 'd', 's', 'n', 'p' };
+	uint32_t constexpr snapshot_version = 4;
+	size_t constexpr records_alignment = 64;
+	size_t constexpr records_block = 4096;
+
+	struct snapshot_header {
+		array <char, 8> magic;
+		uint32_t version;
+		uint32_t record_size;
+		uint64_t records_offset, records_count;
+		uint64_t names_offset, names_size;
+		uint64_t devices_offset, devices_count;
+		uint64_t roots_offset, roots_count;
+	};
+
+	void throw_errno_if (bool condition) {
+		if (condition) {
+			throw system_error (errno, system_category ());
+		}
+	}
+
+	void write_all (int fd, void const *data, size_t size) {
+		for (auto ptr = static_cast <char const *> (data); size; ) {
+			auto const written = ::write (fd, ptr, size);
+			if ((written == -1) && (errno == EINTR)) {
+				continue;
+			}
+			throw_errno_if (written == -1);
+			ptr += written;
+			size -= static_cast <size_t> (written);
+		}
+	}
+
+	void write_padding (int fd, size_t from, size_t to) {
+		static array <char, records_alignment> constexpr zeroes {};
+		write_all (fd, zeroes.data (), to - from);
+	}
+
+	uint64_t align (uint64_t offset, size_t alignment) {
+		return (offset + alignment - 1) & ~uint64_t (alignment - 1);
+	}
+
+	bool is_within (uint64_t offset, uint64_t count, size_t element_size, size_t alignment, size_t file_size) {
+		return !(offset % alignment) && (offset <= file_size) && (count <= (file_size - offset) / element_size);
+	}
+
+	// Only what views dereference is checked: indices of related records, names and devices.
+	bool is_valid (node_record const &record, snapshot_header const &header, char const *names) {
+		auto const records = header.records_count;
+		if (record.first == node_tree::npos) {
+			if (record.count) {
+				return false;
+			}
+		} else if ((record.first > records) || (record.count > records - record.first) || ((record.type == node_type::link) && (record.first == records))) {
+			return false;
+		}
+		return ((record.parent < records) || (record.parent == node_tree::npos)) && (record.sorted <= record.count) && (record.type <= node_type::link) &&
+		       (record.device < header.devices_count) && node_tree::is_within_table (names, header.names_size, record.name);
+	}
+}
+
+void snapshot::write (path const &path, node_tree const &tree, vector <node_info> const &roots) {
+	auto const count = tree.size ();
+	vector <char> names;
+	unordered_map <name_id, name_id> name_ids;
+	for (size_t i = 0; i < count; i++) {
+		auto const name = tree [static_cast <node_index> (i)].name;
+		if (!name_ids.count (name)) {
+			name_ids.emplace (name, node_tree::append_name (names, tree.name (name)));
+		}
+	}
+
+	snapshot_header header {};
+	header.magic = snapshot_magic;
+	header.version = snapshot_version;
+	header.record_size = sizeof (node_record);
+	header.records_offset = align (sizeof (header), records_alignment);
+	header.records_count = count;
+	header.names_offset = header.records_offset + count * sizeof (node_record);
+	header.names_size = names.size ();
+	header.devices_offset = align (header.names_offset + header.names_size, sizeof (uint64_t));
+	header.devices_count = tree.devices_count ();
+	header.roots_offset = header.devices_offset + header.devices_count * sizeof (uint64_t);
+	header.roots_count = roots.size ();
+
+	auto const temp_path = path.native () + ".tmp";
+	int const fd = ::open (temp_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	throw_errno_if (fd == -1);
+	try {
+		write_all (fd, &header, sizeof (header));
+		write_padding (fd, sizeof (header), header.records_offset);
+
+		vector <node_record> block;
+		block.reserve (records_block);
+		for (size_t i = 0; i < count; i += block.size ()) {
+			block.clear ();
+			for (size_t j = i; (j < count) && (block.size () < records_block); j++) {
+				block.push_back (tree [static_cast <node_index> (j)]);
+				block.back ().name = name_ids [block.back ().name];
+			}
+			write_all (fd, block.data (), block.size () * sizeof (node_record));
+		}
+
+		write_all (fd, names.data (), names.size ());
+		write_padding (fd, header.names_offset + header.names_size, header.devices_offset);
+		for (device_index i = 0; i < header.devices_count; i++) {
+			auto const device = static_cast <uint64_t> (tree.device (i));
+			write_all (fd, &device, sizeof (device));
+		}
+		for (auto const &root: roots) {
+			auto const index = root.index ();
+			write_all (fd, &index, sizeof (index));
+		}
+		throw_errno_if (::fsync (fd));
+		throw_errno_if (::close (fd));
+	} catch (...) {
+		::close (fd);
+		::unlink (temp_path.c_str ());
+		throw;
+	}
+	throw_errno_if (::rename (temp_path.c_str (), path.c_str ()));
+}
+
+unique_ptr <snapshot> snapshot::open (path const &path) {
+	int const fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+	throw_errno_if (fd == -1);
+	struct ::stat info;
+	if (::fstat (fd, &info)) {
+		auto const error = errno;
+		::close (fd);
+		throw system_error (error, system_category ());
+	}
+	auto const size = static_cast <size_t> (info.st_size);
+	if (size < sizeof (snapshot_header)) {
+		::close (fd);
+		throw runtime_error ("snapshot is truncated");
+	}
+	// Private writable mapping, so that views may update records without touching the file.
+	auto const mapping = ::mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	auto const error = errno;
+	::close (fd);
+	if (mapping == MAP_FAILED) {
+		throw system_error (error, system_category ());
+	}
+	return unique_ptr <snapshot> (new snapshot (mapping, size));
+}
+
+snapshot::snapshot (void *mapping, size_t size): _mapping (mapping), _size (size) {
+	try {
+		auto const base = static_cast <char *> (mapping);
+		snapshot_header header;
+		memcpy (&header, base, sizeof (header));
+		if ((header.magic != snapshot_magic) || (header.version != snapshot_version) || (header.record_size != sizeof (node_record))) {
+			throw runtime_error ("unsupported snapshot format");
+		}
+		if (!is_within (header.records_offset, header.records_count, sizeof (node_record), records_alignment, size) ||
+		    !is_within (header.names_offset, header.names_size, 1, 1, size) ||
+		    !is_within (header.devices_offset, header.devices_count, sizeof (uint64_t), sizeof (uint64_t), size) ||
+		    !is_within (header.roots_offset, header.roots_count, sizeof (node_index), sizeof (node_index), size)) {
+			throw runtime_error ("snapshot is truncated");
+		}
+
+		vector <::dev_t> devices (header.devices_count);
+		for (size_t i = 0; i < devices.size (); i++) {
+			uint64_t device;
+			memcpy (&device, base + header.devices_offset + i * sizeof (device), sizeof (device));
+			devices [i] = static_cast <::dev_t> (device);
+		}
+		auto const records = reinterpret_cast <node_record *> (base + header.records_offset);
+		for (size_t i = 0; i < header.records_count; i++) {
+			if (!is_valid (records [i], header, base + header.names_offset)) {
+				throw runtime_error ("snapshot is corrupted");
+			}
+		}
+		this->_tree = make_unique <node_tree> (records, header.records_count, base + header.names_offset, header.names_size, devices);
+
+		auto const roots = reinterpret_cast <node_index const *> (base + header.roots_offset);
+		for (size_t i = 0; i < header.roots_count; i++) {
+			if (roots [i] >= header.records_count) {
+				throw runtime_error ("snapshot is corrupted");
+			}
+			this->_roots.emplace_back (*this->_tree, roots [i]);
+		}
+	} catch (...) {
+		::munmap (mapping, size);
+		throw;
+	}
+}
+
+snapshot::~snapshot () {
+	this->_tree.reset ();
+	::munmap (this->_mapping, this->_size);
+}
@@ -0,0 +1,52 @@
+//
+//  snapshot.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/24/20.
+//
+
+#ifndef snapshot_hxx
+#define snapshot_hxx
+
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <filesystem>
+
+#include "node_tree.hxx"
+#include "node_info.hxx"
+
+namespace fs {
+	class snapshot;
+}
+
+// Finished tree saved to a file: fixed-width node records with subtree sizes, a name table, devices and roots.
+// Opening one maps the file and browses records in place; snapshots use host byte order and are not portable.
+class fs::snapshot {
+public:
+	// Writes to a temporary file next to path and renames it over path once complete.
+	static void write (std::filesystem::path const &path, node_tree const &tree, std::vector <node_info> const &roots);
+	static std::unique_ptr <snapshot> open (std::filesystem::path const &path);
+
+	snapshot (snapshot const &) = delete;
+	snapshot &operator = (snapshot const &) = delete;
+	~snapshot ();
+
+	std::vector <node_info> const &roots () const {
+		return this->_roots;
+	}
+
+	node_tree const &tree () const {
+		return *this->_tree;
+	}
+
+private:
+	snapshot (void *mapping, std::size_t size);
+
+	void *const _mapping;
+	std::size_t const _size;
+	std::unique_ptr <node_tree> _tree;
+	std::vector <node_info> _roots;
+};
+
+#endif /* snapshot_hxx */
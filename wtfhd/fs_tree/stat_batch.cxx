@@ -0,0 +1,319 @@
+//
+//  stat_batch.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/18/20.
+//
+
+#include "stat_batch.hxx"
+
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <system_error>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined (__linux__)
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <sys/sysmacros.h>
+#	include <linux/io_uring.h>
+#endif
+
+#include "dir_handle.hxx"
+#include "scan_stats.hxx"
+
+using namespace fs;
+using namespace std;
+using namespace chrono;
+
+namespace fs::impl {
+	class sync_stat_batch: public stat_batch {
+	public:
+		virtual bool is_async () const override {
+			return false;
+		}
+
+		virtual void run () override;
+	};
+
+#if defined (__linux__)
+	class uring_stat_batch: public stat_batch {
+	public:
+		static unique_ptr <uring_stat_batch> make_unique (unsigned queue_depth);
+		virtual ~uring_stat_batch ();
+
+		virtual bool is_async () const override {
+			return this->_supported;
+		}
+
+		virtual void run () override;
+
+	private:
+		uring_stat_batch (int fd, io_uring_params const &params);
+
+		bool map_rings ();
+		unsigned submit (iterator &next, unsigned limit);
+		unsigned reap ();
+
+		int const _fd;
+		io_uring_params const _params;
+		bool _supported;
+
+		void *_sq_ring, *_cq_ring;
+		size_t _sq_ring_size, _cq_ring_size;
+		io_uring_sqe *_sqes;
+
+		unsigned *_sq_tail, *_sq_mask, *_sq_array;
+		unsigned *_cq_head, *_cq_tail, *_cq_mask;
+		io_uring_cqe *_cqes;
+
+		vector <struct ::statx> _results;
+		vector <entry *> _in_flight;
+		// Kept only while latencies are collected.
+		vector <steady_clock::time_point> _submitted;
+		vector <unsigned> _free_slots;
+	};
+#endif
+}
+
+stat_batch::entry::entry (dir_handle const &handle, string_view name, unsigned char type): handle (&handle), name (name), type (type), error (), info {} {
+	if (type == DT_DIR) {
+		this->info.st_mode = S_IFDIR;
+	}
+}
+
+bool stat_batch::entry::needs_stat () const {
+	return this->type != DT_DIR;
+}
+
+unique_ptr <stat_batch> stat_batch::make_unique (size_t queue_depth) {
+#if defined (__linux__)
+	if (queue_depth) {
+		if (auto result = impl::uring_stat_batch::make_unique (static_cast <unsigned> (min (queue_depth, max_queue_depth)))) {
+			return result;
+		}
+	}
+#endif
+	return std::make_unique <impl::sync_stat_batch> ();
+}
+
+void stat_batch::run_sync (entry &entry) {
+	try {
+		entry.handle->stat (entry.name.c_str (), entry.info);
+	} catch (system_error const &e) {
+		entry.error = e.code ().value ();
+	}
+}
+
+void stat_batch::run_sync_timed (entry &entry) {
+	if (!this->_latencies) {
+		return run_sync (entry);
+	}
+	auto const start = steady_clock::now ();
+	run_sync (entry);
+	this->_latencies->add (steady_clock::now () - start);
+}
+
+void impl::sync_stat_batch::run () {
+	for (auto &entry: this->_entries) {
+		if (this->is_cancelled ()) {
+			return;
+		}
+		if (entry.needs_stat ()) {
+			this->run_sync_timed (entry);
+		}
+	}
+}
+
+#if defined (__linux__)
+
+template <typename _Tp>
+static inline _Tp *ring_ptr (void *ring, __u32 offset) {
+	return reinterpret_cast <_Tp *> (static_cast <char *> (ring) + offset);
+}
+
+unique_ptr <impl::uring_stat_batch> impl::uring_stat_batch::make_unique (unsigned queue_depth) {
+	io_uring_params params {};
+	int const fd = static_cast <int> (::syscall (__NR_io_uring_setup, queue_depth, &params));
+	if (fd == -1) {
+		return nullptr;
+	}
+	auto result = unique_ptr <uring_stat_batch> (new uring_stat_batch (fd, params));
+	if (!result->map_rings ()) {
+		return nullptr;
+	}
+	return result;
+}
+
+impl::uring_stat_batch::uring_stat_batch (int fd, io_uring_params const &params):
+	_fd (fd), _params (params), _supported (true), _sq_ring (MAP_FAILED), _cq_ring (MAP_FAILED), _sq_ring_size (), _cq_ring_size (), _sqes (static_cast <io_uring_sqe *> (MAP_FAILED)) {}
+
+impl::uring_stat_batch::~uring_stat_batch () {
+	if (this->_sqes != MAP_FAILED) {
+		::munmap (this->_sqes, this->_params.sq_entries * sizeof (io_uring_sqe));
+	}
+	if ((this->_cq_ring != MAP_FAILED) && (this->_cq_ring != this->_sq_ring)) {
+		::munmap (this->_cq_ring, this->_cq_ring_size);
+	}
+	if (this->_sq_ring != MAP_FAILED) {
+		::munmap (this->_sq_ring, this->_sq_ring_size);
+	}
+	::close (this->_fd);
+}
+
+bool impl::uring_stat_batch::map_rings () {
+	auto const &params = this->_params;
+	this->_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+	this->_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		this->_sq_ring_size = this->_cq_ring_size = max (this->_sq_ring_size, this->_cq_ring_size);
+	}
+
+	this->_sq_ring = ::mmap (nullptr, this->_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->_fd, IORING_OFF_SQ_RING);
+	if (this->_sq_ring == MAP_FAILED) {
+		return false;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		this->_cq_ring = this->_sq_ring;
+	} else {
+		this->_cq_ring = ::mmap (nullptr, this->_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->_fd, IORING_OFF_CQ_RING);
+		if (this->_cq_ring == MAP_FAILED) {
+			return false;
+		}
+	}
+	this->_sqes = static_cast <io_uring_sqe *> (::mmap (nullptr, params.sq_entries * sizeof (io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->_fd, IORING_OFF_SQES));
+	if (this->_sqes == MAP_FAILED) {
+		return false;
+	}
+
+	this->_sq_tail = ring_ptr <unsigned> (this->_sq_ring, params.sq_off.tail);
+	this->_sq_mask = ring_ptr <unsigned> (this->_sq_ring, params.sq_off.ring_mask);
+	this->_sq_array = ring_ptr <unsigned> (this->_sq_ring, params.sq_off.array);
+	this->_cq_head = ring_ptr <unsigned> (this->_cq_ring, params.cq_off.head);
+	this->_cq_tail = ring_ptr <unsigned> (this->_cq_ring, params.cq_off.tail);
+	this->_cq_mask = ring_ptr <unsigned> (this->_cq_ring, params.cq_off.ring_mask);
+	this->_cqes = ring_ptr <io_uring_cqe> (this->_cq_ring, params.cq_off.cqes);
+
+	this->_results.resize (params.sq_entries);
+	this->_in_flight.resize (params.sq_entries);
+	for (unsigned slot = params.sq_entries; slot; slot--) {
+		this->_free_slots.push_back (slot - 1);
+	}
+	return true;
+}
+
+void impl::uring_stat_batch::run () {
+	auto next = this->_entries.begin ();
+	if (!this->_supported) {
+		for (; (next != this->_entries.end ()) && !this->is_cancelled (); next++) {
+			if (next->needs_stat ()) {
+				this->run_sync_timed (*next);
+			}
+		}
+		return;
+	}
+
+	for (unsigned in_flight = 0, unsubmitted = 0; (next != this->_entries.end ()) || in_flight; ) {
+		if (this->is_cancelled ()) {
+			// Requests in flight still point into the entries, so they are waited for.
+			next = this->_entries.end ();
+		}
+		auto const queued = this->submit (next, static_cast <unsigned> (this->_free_slots.size ()));
+		in_flight += queued;
+		unsubmitted += queued;
+		if (!in_flight) {
+			continue;
+		}
+
+		int const rc = static_cast <int> (::syscall (__NR_io_uring_enter, this->_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (rc >= 0) {
+			unsubmitted -= min (static_cast <unsigned> (rc), unsubmitted);
+		} else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+			throw system_error (errno, system_category ());
+		}
+		in_flight -= this->reap ();
+	}
+}
+
+unsigned impl::uring_stat_batch::submit (iterator &next, unsigned limit) {
+	unsigned result = 0;
+	unsigned tail = *this->_sq_tail;
+	auto const now = this->_latencies ? steady_clock::now () : steady_clock::time_point ();
+	if (this->_latencies) {
+		this->_submitted.resize (this->_in_flight.size ());
+	}
+	for (; (next != this->_entries.end ()) && (result < limit); next++) {
+		if (!next->needs_stat ()) {
+			continue;
+		}
+
+		auto const slot = this->_free_slots.back ();
+		this->_free_slots.pop_back ();
+		this->_in_flight [slot] = &*next;
+		if (this->_latencies) {
+			this->_submitted [slot] = now;
+		}
+
+		auto const index = tail & *this->_sq_mask;
+		auto &sqe = this->_sqes [index];
+		sqe = io_uring_sqe {};
+		sqe.opcode = IORING_OP_STATX;
+		sqe.fd = next->handle->fd ();
+		sqe.addr = reinterpret_cast <__u64> (next->name.c_str ());
+		sqe.len = STATX_BASIC_STATS;
+		sqe.off = reinterpret_cast <__u64> (&this->_results [slot]);
+		sqe.statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe.user_data = slot;
+		this->_sq_array [index] = index;
+
+		tail++;
+		result++;
+	}
+	atomic_ref (*this->_sq_tail).store (tail, memory_order::release);
+	return result;
+}
+
+unsigned impl::uring_stat_batch::reap () {
+	unsigned result = 0;
+	unsigned head = *this->_cq_head;
+	auto const now = this->_latencies ? steady_clock::now () : steady_clock::time_point ();
+	for (unsigned const tail = atomic_ref (*this->_cq_tail).load (memory_order::acquire); head != tail; head++, result++) {
+		auto const &cqe = this->_cqes [head & *this->_cq_mask];
+		auto const slot = static_cast <unsigned> (cqe.user_data);
+		auto &entry = *this->_in_flight [slot];
+		if (this->_latencies) {
+			this->_latencies->add (now - this->_submitted [slot]);
+		}
+
+		if ((cqe.res == -EINVAL) || (cqe.res == -EOPNOTSUPP)) {
+			this->_supported = false;
+			run_sync (entry);
+		} else if (cqe.res < 0) {
+			entry.error = -cqe.res;
+		} else {
+			auto const &result = this->_results [slot];
+			entry.info.st_dev = makedev (result.stx_dev_major, result.stx_dev_minor);
+			entry.info.st_ino = result.stx_ino;
+			entry.info.st_mode = result.stx_mode;
+			entry.info.st_nlink = result.stx_nlink;
+			entry.info.st_uid = result.stx_uid;
+			entry.info.st_gid = result.stx_gid;
+			entry.info.st_rdev = makedev (result.stx_rdev_major, result.stx_rdev_minor);
+			entry.info.st_size = static_cast <off_t> (result.stx_size);
+			entry.info.st_blksize = result.stx_blksize;
+			entry.info.st_blocks = static_cast <blkcnt_t> (result.stx_blocks);
+			entry.info.st_atim = { result.stx_atime.tv_sec, result.stx_atime.tv_nsec };
+			entry.info.st_mtim = { result.stx_mtime.tv_sec, result.stx_mtime.tv_nsec };
+			entry.info.st_ctim = { result.stx_ctime.tv_sec, result.stx_ctime.tv_nsec };
+		}
+		this->_free_slots.push_back (slot);
+	}
+	atomic_ref (*this->_cq_head).store (head, memory_order::release);
+	return result;
+}
+
+#endif
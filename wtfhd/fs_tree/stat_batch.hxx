@@ -0,0 +1,100 @@
+//
+//  stat_batch.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/18/20.
+//
+
+#ifndef stat_batch_hxx
+#define stat_batch_hxx
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+
+namespace fs {
+	class dir_handle;
+	class latency_histogram;
+	class stat_batch;
+}
+
+class fs::stat_batch {
+public:
+	struct entry {
+		entry (dir_handle const &handle, std::string_view name, unsigned char type);
+
+		bool needs_stat () const;
+
+		dir_handle const *handle;
+		std::string name;
+		unsigned char type;
+		int error;
+		struct ::stat info;
+	};
+
+	typedef std::vector <entry>::iterator iterator;
+
+	// Largest io_uring ring the kernel sets up (IORING_MAX_ENTRIES); deeper queues are clamped to it.
+	static constexpr std::size_t max_queue_depth = 32768;
+
+	// Uses io_uring when queue_depth is non-zero and the kernel allows it, synchronous fstatat otherwise.
+	static std::unique_ptr <stat_batch> make_unique (std::size_t queue_depth);
+	virtual ~stat_batch () = default;
+
+	virtual bool is_async () const = 0;
+
+	std::size_t size () const {
+		return this->_entries.size ();
+	}
+
+	iterator begin () {
+		return this->_entries.begin ();
+	}
+
+	iterator end () {
+		return this->_entries.end ();
+	}
+
+	void add (dir_handle const &handle, std::string_view name, unsigned char type) {
+		this->_entries.emplace_back (handle, name, type);
+	}
+
+	void erase (iterator begin, iterator end) {
+		this->_entries.erase (begin, end);
+	}
+
+	void clear () {
+		this->_entries.clear ();
+	}
+
+	// Latency of every stat call made by run () is added to histogram, if any; for asynchronous requests it includes their time in the queue.
+	void set_latency_histogram (latency_histogram *histogram) {
+		this->_latencies = histogram;
+	}
+
+	// Once *flag is set, run () starts no more stat calls and returns as soon as those in flight complete; the rest of the entries are left unfilled.
+	void set_cancellation_flag (std::atomic <bool> const *flag) {
+		this->_cancelled = flag;
+	}
+
+	virtual void run () = 0;
+
+protected:
+	stat_batch () = default;
+
+	static void run_sync (entry &);
+	void run_sync_timed (entry &);
+
+	bool is_cancelled () const {
+		return this->_cancelled && this->_cancelled->load (std::memory_order::relaxed);
+	}
+
+	std::vector <entry> _entries;
+	latency_histogram *_latencies = nullptr;
+	std::atomic <bool> const *_cancelled = nullptr;
+};
+
+#endif /* stat_batch_hxx */
@@ -0,0 +1,102 @@
+//
+//  subtree_histogram.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/31/20.
+//
+
+#include "subtree_histogram.hxx"
+
+#include <chrono>
+#include <algorithm>
+
+using namespace fs;
+using namespace std;
+using namespace chrono;
+
+static void accumulate_bucket (subtree_histogram::bucket &target, subtree_histogram::bucket const &value) {
+	target.files += value.files;
+	target.size += value.size;
+	target.allocated += value.allocated;
+}
+
+void subtree_histogram::keyed_buckets::add (bucket const &value) {
+	auto const end = this->_top.begin () + static_cast <ptrdiff_t> (this->_used);
+	if (auto const it = find_if (this->_top.begin (), end, [&value] (bucket const &bucket) { return bucket.key == value.key; }); it != end) {
+		return accumulate_bucket (*it, value);
+	}
+	if (this->_used < keys_max) {
+		this->_top [this->_used++] = value;
+		return;
+	}
+	
+	// Full; the lightest key makes room if the new one outweighs it.
+	auto const lightest = min_element (this->_top.begin (), end, [] (bucket const &lhs, bucket const &rhs) { return lhs.size < rhs.size; });
+	if (lightest->size < value.size) {
+		accumulate_bucket (this->_other, *lightest);
+		*lightest = value;
+	} else {
+		accumulate_bucket (this->_other, value);
+	}
+}
+
+void subtree_histogram::keyed_buckets::merge (keyed_buckets const &other) {
+	for (size_t i = 0; i < other._used; i++) {
+		this->add (other._top [i]);
+	}
+	accumulate_bucket (this->_other, other._other);
+}
+
+vector <subtree_histogram::bucket> subtree_histogram::keyed_buckets::sorted () const {
+	vector <bucket> result (this->_top.begin (), this->_top.begin () + static_cast <ptrdiff_t> (this->_used));
+	sort (result.begin (), result.end (), [] (bucket const &lhs, bucket const &rhs) { return lhs.size > rhs.size; });
+	return result;
+}
+
+void subtree_histogram::add (uint64_t owner, uint64_t group, string_view name, int64_t mtime, uint64_t size, uint64_t allocated) {
+	static int64_t constexpr day_ns = duration_cast <nanoseconds> (24h).count ();
+	static int64_t constexpr limits_days [ages_count - 1] = { 1, 7, 30, 91, 365, 3 * 365 };
+	
+	this->_owners.add ({ owner, 1, size, allocated });
+	this->_groups.add ({ group, 1, size, allocated });
+	this->_extensions.add ({ extension_key (name), 1, size, allocated });
+	
+	auto const age_days = (this->_now - mtime) / day_ns;
+	auto const age = static_cast <size_t> (upper_bound (begin (limits_days), end (limits_days), age_days) - begin (limits_days));
+	accumulate_bucket (this->_ages [age], { age, 1, size, allocated });
+}
+
+void subtree_histogram::merge (subtree_histogram const &other) {
+	this->_owners.merge (other._owners);
+	this->_groups.merge (other._groups);
+	this->_extensions.merge (other._extensions);
+	for (size_t i = 0; i < ages_count; i++) {
+		accumulate_bucket (this->_ages [i], other._ages [i]);
+	}
+}
+
+uint64_t subtree_histogram::extension_key (string_view name) {
+	auto const dot = name.rfind ('.');
+	// Dot files have no extension unless there is another dot.
+	if ((dot == string_view::npos) || !dot || (dot + 1 == name.size ()) || (name.size () - dot - 1 > sizeof (uint64_t))) {
+		return unknown;
+	}
+	uint64_t result = 0;
+	for (auto const c: name.substr (dot + 1)) {
+		result = (result << 8) | static_cast <unsigned char> (c);
+	}
+	return result;
+}
+
+string subtree_histogram::extension_name (uint64_t key) {
+	string result;
+	for (; key && (key != unknown); key >>= 8) {
+		result.insert (result.begin (), static_cast <char> (key & 0xFF));
+	}
+	return result;
+}
+
+char const *subtree_histogram::age_name (size_t age) {
+	static char const *const names [ages_count] = { "day", "week", "month", "quarter", "year", "3 years", "older" };
+	return (age < ages_count) ? names [age] : "";
+}
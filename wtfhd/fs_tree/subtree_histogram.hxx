@@ -0,0 +1,102 @@
+//
+//  subtree_histogram.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/31/20.
+//
+
+#ifndef subtree_histogram_hxx
+#define subtree_histogram_hxx
+
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace fs {
+	class subtree_histogram;
+}
+
+// Bytes of files within a subtree by owner, group, extension and age, gathered from the stat results of a scan and merged bottom-up.
+// Owners, groups and extensions keep a fixed number of the heaviest keys each, so every histogram takes the same few kilobytes;
+// the rest goes to an other bucket, and a key once dropped deep in a subtree stays there in all of its ancestors.
+class fs::subtree_histogram {
+public:
+	// Owner and group of files taken from a baseline tree, which keeps no such info; key of files without an extension.
+	static std::uint64_t constexpr unknown = ~std::uint64_t (0);
+	static std::size_t constexpr keys_max = 16;
+
+	enum age: std::size_t {
+		day = 0,
+		week,
+		month,
+		quarter,
+		year,
+		three_years,
+		older,
+		ages_count,
+	};
+
+	struct bucket {
+		std::uint64_t key;
+		std::uint64_t files;
+		std::uint64_t size, allocated;
+	};
+
+	class keyed_buckets {
+	public:
+		keyed_buckets (): _top (), _used (), _other { unknown, 0, 0, 0 } {}
+
+		void add (bucket const &value);
+		void merge (keyed_buckets const &other);
+
+		// Heaviest by apparent size first.
+		std::vector <bucket> sorted () const;
+
+		bucket const &other () const {
+			return this->_other;
+		}
+
+	private:
+		std::array <bucket, keys_max> _top;
+		std::size_t _used;
+		bucket _other;
+	};
+
+	// Ages are counted back from now, which should be the same for histograms to be merged.
+	explicit subtree_histogram (std::int64_t now_ns): _now (now_ns), _ages () {}
+
+	// Sizes of a single file, mtime in nanoseconds since the epoch.
+	void add (std::uint64_t owner, std::uint64_t group, std::string_view name, std::int64_t mtime, std::uint64_t size, std::uint64_t allocated);
+	void merge (subtree_histogram const &other);
+
+	keyed_buckets const &owners () const {
+		return this->_owners;
+	}
+
+	keyed_buckets const &groups () const {
+		return this->_groups;
+	}
+
+	keyed_buckets const &extensions () const {
+		return this->_extensions;
+	}
+
+	std::array <bucket, ages_count> const &ages () const {
+		return this->_ages;
+	}
+
+	// Extensions up to 8 bytes long are packed into keys, longer ones are not told apart from names without one.
+	static std::uint64_t extension_key (std::string_view name);
+	static std::string extension_name (std::uint64_t key);
+	static char const *age_name (std::size_t age);
+
+private:
+	std::int64_t const _now;
+	keyed_buckets _owners, _groups, _extensions;
+	std::array <bucket, ages_count> _ages;
+};
+
+#endif /* subtree_histogram_hxx */
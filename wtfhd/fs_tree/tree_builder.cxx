@@ -8,95 +8,143 @@
 #include "tree_builder.hxx"
 
 #include <map>
+#include <algorithm>
+#include <unordered_map>
 #include <set>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include <thread>
 #include <cassert>
+#include <condition_variable>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined (__linux__)
+#	include <sched.h>
+#	include <unistd.h>
+#	include <sys/syscall.h>
+#elif defined (__APPLE__)
+#	include <sys/resource.h>
+#endif
 
 #include "misc_types.hxx"
-#include "integral_set.hxx"
+#include "stat_batch.hxx"
+#include "progress_estimator.hxx"
+#include "node_id_set.hxx"
+#include "subtree_histogram.hxx"
 
 using namespace fs;
 using namespace std;
 using namespace util;
 using namespace chrono;
+using namespace filesystem;
 using namespace chrono_literals;
 
 namespace fs::impl {
-	struct node_id_set: public util::integral_set <::dev_t, ::ino_t> {
-	private:
-		typedef util::integral_set <dev_t, ino_t> super;
-		
+	class tree_builder: public ::tree_builder {
 	public:
-		typedef node_info::id node_id_t;
+		tree_builder (unique_ptr <children_policy const> &&policy): _policy (std::move (policy)), _concurrency (default_concurrency ()), _io_queue_depth (), _progressive (), _low_priority (), _discards_subtrees (), _ready (), _total (), _finished (), _elapsed (), _roots_listed (), _focus (node_tree::npos), _counters () {}
 		
-		node_id_set (): super () {}
-		node_id_set (std::initializer_list <node_id_t> const &values): node_id_set (values.begin (), values.end ()) {}
+		virtual bool started () const override {
+			return !!this->_completion_callback;
+		}
+		
+		virtual progress_t progress () const override {
+			scoped_lock lock (this->_progress_lock);
+			return this->_progress.value_or (progress_t { 0, 0 });
+		}
 		
-		~node_id_set () = default;
+		virtual scan_stats stats () const override;
 		
-		bool contains (node_id_t const &value) const {
-			return std::apply (&super::contains, std::tuple_cat (std::make_tuple (this), value.as_tuple ()));
+		virtual bool ready () const override {
+			return this->_result.load (memory_order::acquire).has_value ();
 		}
 		
-		bool insert (node_id_t const &value) {
-			return std::apply (&super::insert, std::tuple_cat (std::make_tuple (this), value.as_tuple ()));
+		virtual bool success () const override {
+			return this->_result.load (memory_order::acquire).value ();
 		}
 		
-		bool remove (node_id_t const &value) {
-			return std::apply (&super::remove, std::tuple_cat (std::make_tuple (this), value.as_tuple ()));
+		virtual std::optional <bool> result () const override {
+			return this->_result.load (memory_order::acquire);
 		}
 		
-	private:
-		template <typename _It>
-		struct node_id_iterator_wrapper {
-		public:
-			node_id_iterator_wrapper (_It const &other): _impl (other) {}
-			
-			auto operator* () {
-				return this->_impl->as_tuple ();
-			}
-			
-			bool operator== (node_id_iterator_wrapper const &other) const {
-				return this->_impl == other._impl;
-			}
-			
-			node_id_iterator_wrapper &operator++ (int) {
-				this->_impl++;
-				return *this;
-			}
-
-		private:
-			_It _impl;
-		};
+		virtual size_t concurrency () const override {
+			return this->_concurrency;
+		}
 		
-		template <typename _It>
-		node_id_set (_It values_begin, _It values_end): super (node_id_iterator_wrapper (values_begin), node_id_iterator_wrapper (values_end)) {}
-	};
-	
-	class tree_builder: public ::tree_builder {
-	public:
-		tree_builder (unique_ptr <children_policy const> &&policy): _policy (std::move (policy)) {
-			
+		virtual void set_concurrency (size_t concurrency) override {
+			assert (!this->started ());
+			this->_concurrency = concurrency ? concurrency : default_concurrency ();
 		}
 		
-		virtual bool started () const override {
-			return !!this->_completion_callback;
+		virtual size_t io_queue_depth () const override {
+			return this->_io_queue_depth;
 		}
 		
-		virtual progress_t progress () const override {
-			return progress_t { this->_ready, this->_total };
+		virtual void set_io_queue_depth (size_t io_queue_depth) override {
+			assert (!this->started ());
+			this->_io_queue_depth = io_queue_depth;
 		}
 		
-		virtual bool ready () const override {
-			return this->_result.load (memory_order::acquire).has_value ();
+		virtual bool progressive () const override {
+			return this->_progressive;
 		}
 		
-		virtual bool success () const override {
-			return this->_result.load (memory_order::acquire).value ();
+		virtual void set_progressive (bool progressive) override {
+			assert (!this->started ());
+			this->_progressive = progressive;
 		}
 		
-		virtual std::optional <bool> result () const override {
-			return this->_result.load (memory_order::acquire);
+		virtual scan_limits limits () const override {
+			return this->_throttle.limits ();
+		}
+		
+		virtual void set_limits (scan_limits const &limits) override {
+			this->_throttle.set_limits (limits);
+		}
+		
+		virtual double syscalls_rate () const override {
+			return this->_throttle.syscalls_rate ();
+		}
+		
+		virtual bool low_priority () const override {
+			return this->_low_priority;
+		}
+		
+		virtual void set_low_priority (bool low_priority) override {
+			assert (!this->started ());
+			this->_low_priority = low_priority;
+		}
+		
+		virtual vector <node_info> const &roots () const override {
+			assert (this->ready () || this->_roots_listed.load (memory_order::acquire));
+			return this->_roots;
+		}
+		
+		virtual node_tree const &tree () const override {
+			return this->_tree;
+		}
+		
+		virtual node_tree &tree () override {
+			assert (this->ready ());
+			return this->_tree;
+		}
+		
+		virtual children_policy const &policy () const override {
+			return *this->_policy;
+		}
+		
+		virtual void set_baseline (shared_ptr <node_tree const> tree, vector <node_info> const &roots) override;
+		virtual void prioritize (dir_info const &dir) override;
+		
+		virtual void lock_tree () override {
+			this->_gate.lock ();
+		}
+		
+		virtual void unlock_tree () override {
+			this->_gate.unlock ();
 		}
 		
 		virtual bool contains (node_id_t const &node_id) const override;
@@ -104,6 +152,23 @@ namespace fs::impl {
 		
 		virtual callback_id_t add_progress_callback (callback_t const &callback) override;
 		virtual void remove_progress_callback (callback_id_t const callback_id) override;
+		virtual void set_subtree_callback (subtree_callback_t const &callback) override;
+		
+		virtual bool discards_subtrees () const override {
+			return this->_discards_subtrees;
+		}
+		
+		virtual void set_discards_subtrees (bool discards_subtrees) override {
+			assert (!this->started ());
+			this->_discards_subtrees = discards_subtrees;
+		}
+		
+		virtual void set_histograms_threshold (uintmax_t min_size) override {
+			assert (!this->started ());
+			this->_histograms_threshold = min_size;
+		}
+		
+		virtual shared_ptr <subtree_histogram const> histogram (dir_info const &dir) const override;
 		
 		virtual void start (callback_t const &callback) override;
 		virtual void cancel () override;
@@ -123,27 +188,242 @@ namespace fs::impl {
 			}
 		};
 		
+		// Workers take it shared while changing records, so that they never wait for each other, and browsing takes it exclusively;
+		// unlike rwlocks preferring readers, it lets no more workers in once browsing asks for it.
+		class tree_gate {
+		public:
+			void lock_shared () {
+				if (this->_waiting.load (memory_order::acquire)) {
+					scoped_lock lock (this->_exclusive);
+				}
+				this->_lock.lock_shared ();
+			}
+			
+			void unlock_shared () {
+				this->_lock.unlock_shared ();
+			}
+			
+			void lock () {
+				this->_exclusive.lock ();
+				this->_waiting.store (true, memory_order::release);
+				this->_lock.lock ();
+			}
+			
+			void unlock () {
+				this->_lock.unlock ();
+				this->_waiting.store (false, memory_order::release);
+				this->_exclusive.unlock ();
+			}
+			
+		private:
+			shared_mutex _lock;
+			mutex _exclusive;
+			atomic <bool> _waiting {};
+		};
+		
+		struct device_pool;
+		
+		struct scan_task {
+			scan_task (dir_info const &dir, shared_ptr <scan_task> const &parent, shared_ptr <dir_handle const> const &parent_handle, node_index baseline, device_pool &pool):
+				dir (dir), parent (parent), parent_handle (parent_handle), baseline (baseline), depth (parent ? parent->depth + 1 : 0),
+				copied (parent && (parent->reused || parent->copied)), pool (&pool), reused (), pending (), changed () {}
+			
+			dir_info dir;
+			shared_ptr <scan_task> const parent;
+			shared_ptr <dir_handle const> parent_handle;
+			// Record of the same directory in baseline tree, if any.
+			node_index const baseline;
+			size_t const depth;
+			// Set when the record was copied from baseline along with its totals by a reused ancestor; partial totals are not added through such.
+			bool const copied;
+			// Pool of the device the directory lies on; that of its parent until it is opened, since entry types tell nothing of mount points.
+			device_pool *pool;
+			// Set when the directory was opened by a worker of another device and handed over.
+			shared_ptr <dir_handle> handle;
+			bool reused;
+			atomic <size_t> pending;
+			// Set by children whose subtree size or order may differ from baseline.
+			atomic <bool> changed;
+			// Files of the directory itself first, then histograms of completed subdirectories.
+			unique_ptr <subtree_histogram> histogram;
+			mutex histogram_lock;
+		};
+		
+		struct work_queue {
+			mutex lock;
+			deque <shared_ptr <scan_task>> tasks;
+		};
+		
+		// Queues and workers of a single device, so that a slow one keeps busy only its own workers.
+		// Workers are started as tasks are queued, up to concurrency () of them.
+		struct device_pool {
+			device_pool (::dev_t device, size_t concurrency): device (device), queues (concurrency), queued (), workers () {}
+			
+			::dev_t const device;
+			vector <work_queue> queues;
+			// Top levels and prioritized subtrees of a progressive scan, taken before the rest and in the order they were found.
+			work_queue front;
+			atomic <size_t> queued;
+			// Changed under _workers_lock only.
+			atomic <size_t> workers;
+			mutex idle_lock;
+			condition_variable idle_condition;
+		};
+		
+		static size_t constexpr batch_dirs_limit = 16;
+		// Levels below roots listed first by a progressive scan.
+		static size_t constexpr progressive_levels = 3;
+		// Syscalls charged for opening, stat'ing and closing a directory, and for reading it, which takes getdents at least twice.
+		static uint64_t constexpr open_syscalls = 3, read_syscalls = 2;
+		// Stat calls an interval needs for its latency to tell anything to the adaptive mode; shorter ones add up to the next.
+		static uint64_t constexpr adaptive_samples_min = 32;
+		
+		static size_t default_concurrency () {
+			return max (thread::hardware_concurrency (), 1U);
+		}
+		
 		void run ();
 		bool run_iteration ();
+		void update_progress ();
+		// Feeds stat latency since the previous time it was fed to the adaptive mode of the throttle.
+		void adapt_limits (scan_stats const &stats);
+		// Lets the estimate count entries of a device the scan reached, e.g. through a mount point, first found at dir.
+		void device_did_appear (dir_info const &dir, dir_handle const &handle);
+		
+		// All devices share a single pool when boundaries are ignored.
+		device_pool &pool_for (::dev_t device);
+		bool is_pool_of (device_pool const &pool, dir_info const &dir) const;
+		// Counters of a thread taking part in the scan; must be called under _workers_lock.
+		scan_counters &add_counters ();
+		void start_worker (device_pool &pool);
+		void run_worker (device_pool &pool, size_t index, scan_counters &counters);
+		// Queues task to the pool it refers to; index is that of the calling worker within its own pool.
+		void push_task (size_t index, shared_ptr <scan_task> &&task, scan_counters &counters);
+		shared_ptr <scan_task> pop_task (device_pool &pool, size_t index, bool steal);
+		// Tells whether task belongs to the front queue of its pool.
+		bool is_urgent (scan_task const &task) const;
+		bool is_focused (scan_task const &task) const;
+		// Lets records be changed while the tree may be browsed; holds nothing unless progressive.
+		shared_lock <tree_gate> lock_records ();
+		// Counts syscalls about to be made, reading dirs directories, and waits for the limits to let them through.
+		void throttle (uint64_t syscalls, uint64_t dirs, scan_counters &counters);
+		void process_tasks (size_t index, vector <shared_ptr <scan_task>> const &tasks, stat_batch &batch, scan_counters &counters);
+		void task_did_load (size_t index, shared_ptr <scan_task> const &task, shared_ptr <dir_handle> const &handle, vector <pair <dir_info, node_index>> const &children, scan_counters &counters);
+		
+		// Adds files among children of a loaded directory, along with stat results of its entries unless they were reused.
+		void add_files (scan_task &task, stat_batch::iterator begin, stat_batch::iterator end) const;
+		// Counts a loaded directory along with its entries and the sizes of its files; returns totals of its children.
+		node_info::delta count_children (scan_task const &task, scan_counters &counters) const;
+		// Adds what a directory loaded to the totals of its ancestors, and to its own unless they are set already, so that they can be browsed before they are complete.
+		void add_partial_totals (scan_task const &task, node_info::delta const &delta, bool including_self);
+		// Merges histogram of a completed directory into its parent and keeps it if the directory is large enough.
+		void histogram_did_complete (scan_task &task);
+		
+		bool is_unchanged (dir_info const &dir, node_index baseline) const;
+		// Pairs loaded directories with their baseline records by name; link targets are paired through their links.
+		vector <pair <dir_info, node_index>> match_baseline (dir_info const &dir, node_index baseline, vector <dir_info> const &children) const;
+		void complete_task (shared_ptr <scan_task> task, scan_counters &counters);
+		// Releases children of a completed directory along with targets of its links; their own subtrees were released as they completed.
+		void discard_children (dir_info const &dir);
+		bool finish (bool success);
 		
 		unique_ptr <children_policy const> const _policy;
+		size_t _concurrency;
+		size_t _io_queue_depth;
+		bool _progressive;
+		bool _low_priority;
 		callback_t _completion_callback;
 		set <callback_t, callback_before> _progress_callbacks;
+		subtree_callback_t _subtree_callback;
+		bool _discards_subtrees;
+		optional <uintmax_t> _histograms_threshold;
+		int64_t _scan_time;
+		steady_clock::time_point _start_time;
 				
-		size_t _ready;
-		size_t _total;
+		// Directories loaded and found so far.
+		atomic <size_t> _ready;
+		atomic <size_t> _total;
+		progress_estimator _estimator;
+		scan_throttle _throttle;
+		// Taken by the thread running progress callbacks when it last adapted limits.
+		scan_stats _adapted_stats;
+		// Updated by the thread running progress callbacks, right before them.
+		optional <progress_t> _progress;
+		mutable mutex _progress_lock;
 		std::atomic <tristate_bool> _result;
-
-		node_id_set _pending, _processed;
+		atomic <bool> _finished;
+		// Set by finish () before the result, so that stats () of a finished scan stop changing.
+		atomic <steady_clock::rep> _elapsed;
+		
+		node_tree _tree;
+		vector <node_info> _roots;
+		atomic <bool> _roots_listed;
+		tree_gate _gate;
+		// Directory prioritized last; it does not move while there are tasks within it.
+		atomic <node_index> _focus;
+		map <::dev_t, unique_ptr <device_pool>> _pools;
+		mutex _pools_lock;
+		vector <thread> _workers;
+		// Set once workers are joined, so that tasks queued after cancellation start no more of them.
+		bool _workers_joined = false;
+		mutex _workers_lock;
+		// Counters of every thread ever started, listed from the newest one; kept until destruction, since stats () may be read at any time.
+		deque <scan_counters> _counters_storage;
+		atomic <scan_counters *> _counters;
+		atomic <size_t> _pending_roots;
+		mutex _idle_lock;
+		condition_variable _idle_condition;
+		
+		node_id_set _pending, _visited;
+		
+		shared_ptr <node_tree const> _baseline;
+		unordered_map <string_view, node_index> _baseline_roots;
+		
+		map <node_id_t::tuple_type, shared_ptr <subtree_histogram const>> _histograms;
+		mutable mutex _histograms_lock;
 	};
 }
 
 unique_ptr <tree_builder> tree_builder::make_unique (unique_ptr <children_policy const> &&policy) {
-	return make_unique <impl::tree_builder> (forward <unique_ptr <children_policy const>> (policy));
+	return std::make_unique <impl::tree_builder> (forward <unique_ptr <children_policy const>> (policy));
+}
+
+void impl::tree_builder::set_baseline (shared_ptr <node_tree const> tree, vector <node_info> const &roots) {
+	assert (!this->started ());
+	this->_baseline = std::move (tree);
+	this->_baseline_roots.clear ();
+	for (auto const &root: roots) {
+		this->_baseline_roots.emplace (root.name (), root.index ());
+	}
+}
+
+void impl::tree_builder::prioritize (dir_info const &dir) {
+	if (!this->_progressive || this->ready ()) {
+		return;
+	}
+	this->_focus.store (dir.index (), memory_order::relaxed);
+	scoped_lock lock (this->_pools_lock);
+	for (auto const &[device, pool]: this->_pools) {
+		for (auto &queue: pool->queues) {
+			deque <shared_ptr <scan_task>> focused;
+			{
+				scoped_lock queue_lock (queue.lock);
+				auto const it = stable_partition (queue.tasks.begin (), queue.tasks.end (), [this] (shared_ptr <scan_task> const &task) {
+					return !this->is_focused (*task);
+				});
+				focused.assign (make_move_iterator (it), make_move_iterator (queue.tasks.end ()));
+				queue.tasks.erase (it, queue.tasks.end ());
+			}
+			if (!focused.empty ()) {
+				scoped_lock front_lock (pool->front.lock);
+				pool->front.tasks.insert (pool->front.tasks.begin (), make_move_iterator (focused.begin ()), make_move_iterator (focused.end ()));
+			}
+		}
+	}
 }
 
 bool impl::tree_builder::contains (node_id_t const &node_id) const {
-	return this->_processed.contains (node_id);
+	return this->_visited.contains (node_id);
 }
 
 void impl::tree_builder::add_node (node_id_t const &node_id) {
@@ -162,30 +442,641 @@ void impl::tree_builder::remove_progress_callback (callback_id_t const callback_
 	this->_progress_callbacks.erase (callback_before::callback (callback_id));
 }
 
+void impl::tree_builder::set_subtree_callback (subtree_callback_t const &callback) {
+	assert (!this->started ());
+	this->_subtree_callback = callback;
+}
+
+shared_ptr <subtree_histogram const> impl::tree_builder::histogram (dir_info const &dir) const {
+	scoped_lock lock (this->_histograms_lock);
+	auto const it = this->_histograms.find (dir.identifier ().as_tuple ());
+	return (it != this->_histograms.end ()) ? it->second : nullptr;
+}
+
+scan_stats impl::tree_builder::stats () const {
+	scan_stats result;
+	for (auto counters = this->_counters.load (memory_order::acquire); counters; counters = counters->next) {
+		counters->collect (result);
+	}
+	// Tasks popped by one worker may be seen before they are seen pushed by another.
+	if (static_cast <int64_t> (result.queued) < 0) {
+		result.queued = 0;
+	}
+	if (this->ready ()) {
+		result.elapsed = nanoseconds (this->_elapsed.load (memory_order::relaxed));
+	} else if (this->_start_time != steady_clock::time_point ()) {
+		result.elapsed = duration_cast <nanoseconds> (steady_clock::now () - this->_start_time);
+	}
+	return result;
+}
+
 void impl::tree_builder::start (callback_t const &callback) {
 	this->_completion_callback = callback;
+	this->_start_time = steady_clock::now ();
+	this->_scan_time = duration_cast <nanoseconds> (system_clock::now ().time_since_epoch ()).count ();
 	thread (&tree_builder::run, this).detach ();
 }
 
 void impl::tree_builder::cancel () {
 	assert (!this->ready ());
-	this->_result.store (false, memory_order::release);
+	this->_throttle.cancel ();
+	this->finish (false);
 }
 
 void impl::tree_builder::run () {
+	vector <shared_ptr <scan_task>> root_tasks;
+	for (auto const &root: this->_policy->roots ()) {
+		node_info node;
+		try {
+			node = node_info::make (this->_tree, path (root), *this->_policy, this->_visited);
+		} catch (system_error const &) {}
+		if (!node) {
+			continue;
+		}
+		
+		auto pending = node;
+		if (node.is_symlink ()) {
+			pending = node.as_link ().load_target (*this->_policy, this->_visited);
+		}
+		if (pending && pending.is_dir ()) {
+			auto baseline = node_tree::npos;
+			if (auto const it = this->_baseline_roots.find (node.name ()); it != this->_baseline_roots.end ()) {
+				auto const &record = (*this->_baseline) [it->second];
+				baseline = (record.type == node_type::link) ? record.first : it->second;
+			}
+			root_tasks.push_back (std::make_shared <scan_task> (pending.as_dir (), nullptr, nullptr, baseline, this->pool_for (pending.identifier ().device)));
+			this->_tree [pending.index ()].loading = true;
+		}
+		this->_roots.push_back (node);
+	}
+	this->_roots_listed.store (true, memory_order::release);
+	
+	if (this->_policy->has_rules ()) {
+		this->_estimator.set_partial ();
+	}
+	this->_total += root_tasks.size ();
+	this->_pending_roots = root_tasks.size ();
+	if (root_tasks.empty ()) {
+		this->finish (true);
+	}
+	auto &counters = [this] () -> scan_counters & {
+		scoped_lock lock (this->_workers_lock);
+		return this->add_counters ();
+	} ();
+	for (size_t i = 0; i < root_tasks.size (); i++) {
+		this->push_task (i, std::move (root_tasks [i]), counters);
+	}
+	
 	while (this->run_iteration ());
+	for (;;) {
+		vector <thread> workers;
+		{
+			scoped_lock lock (this->_workers_lock);
+			if (this->_workers.empty ()) {
+				this->_workers_joined = true;
+				break;
+			}
+			workers.swap (this->_workers);
+		}
+		for (auto &worker: workers) {
+			worker.join ();
+		}
+	}
+	invoke (this->_completion_callback);
 }
 
 bool impl::tree_builder::run_iteration () {
+	this->update_progress ();
 	for (auto const &callback: this->_progress_callbacks) {
 		invoke (callback);
 	}
-	if (this->_result.load (memory_order::acquire).has_value ()) {
-		invoke (this->_completion_callback);
+	
+	unique_lock lock (this->_idle_lock);
+	return !this->_idle_condition.wait_for (lock, this->_progressive ? 200ms : 500ms, [this] { return this->ready (); });
+}
+
+void impl::tree_builder::update_progress () {
+	auto const stats = this->stats ();
+	auto progress = this->_estimator.estimate (stats, this->_ready.load (memory_order::relaxed), this->_total.load (memory_order::relaxed));
+	this->adapt_limits (stats);
+	scoped_lock lock (this->_progress_lock);
+	this->_progress.emplace (progress);
+}
+
+void impl::tree_builder::adapt_limits (scan_stats const &stats) {
+	auto const &last = this->_adapted_stats;
+	latency_histogram::counts_type latencies;
+	uint64_t samples = 0;
+	for (size_t i = 0; i < latency_histogram::buckets_count; i++) {
+		latencies [i] = stats.stat_latencies [i] - min (stats.stat_latencies [i], last.stat_latencies [i]);
+		samples += latencies [i];
+	}
+	auto const elapsed = duration <double> (stats.elapsed - last.elapsed).count ();
+	if ((samples < adaptive_samples_min) || (elapsed <= 0.0)) {
+		return;
+	}
+	this->_throttle.adapt (latency_histogram::quantile (latencies, 0.9), static_cast <double> (stats.syscalls - min (stats.syscalls, last.syscalls)) / elapsed);
+	this->_adapted_stats = stats;
+}
+
+void impl::tree_builder::device_did_appear (dir_info const &dir, dir_handle const &handle) {
+	auto const id = dir.identifier ();
+	struct ::stat parent;
+	// Roots of file systems are mount points, or the root of all, which is its own parent.
+	auto const whole = !::fstatat (handle.fd (), "..", &parent, 0) && ((parent.st_dev != id.device) || (parent.st_ino == id.inode));
+	this->_estimator.add_device (id.device, handle.fd (), whole);
+}
+
+impl::tree_builder::device_pool &impl::tree_builder::pool_for (::dev_t device) {
+	if (this->_policy->fs_boundaries_policy () == boundaries_policy::ignore) {
+		device = 0;
+	}
+	scoped_lock lock (this->_pools_lock);
+	auto &pool = this->_pools [device];
+	if (!pool) {
+		pool = std::make_unique <device_pool> (device, this->_concurrency);
+	}
+	return *pool;
+}
+
+bool impl::tree_builder::is_pool_of (device_pool const &pool, dir_info const &dir) const {
+	return (this->_policy->fs_boundaries_policy () == boundaries_policy::ignore) || (pool.device == dir.identifier ().device);
+}
+
+scan_counters &impl::tree_builder::add_counters () {
+	auto &result = this->_counters_storage.emplace_back (this->_counters.load (memory_order::relaxed));
+	this->_counters.store (&result, memory_order::release);
+	return result;
+}
+
+void impl::tree_builder::start_worker (device_pool &pool) {
+	scoped_lock lock (this->_workers_lock);
+	auto const index = pool.workers.load (memory_order::relaxed);
+	if (this->_workers_joined || (index == pool.queues.size ())) {
+		return;
+	}
+	this->_workers.emplace_back (&tree_builder::run_worker, this, ref (pool), index, ref (this->add_counters ()));
+	pool.workers.store (index + 1, memory_order::relaxed);
+}
+
+// Leaves CPU and disk time to anything else wanting it; either may be refused, e.g. within containers, which leaves the thread as it was.
+static void lower_thread_priority () {
+#if defined (__linux__)
+	struct ::sched_param param {};
+	::pthread_setschedparam (::pthread_self (), SCHED_IDLE, &param);
+	// Neither glibc nor libc headers define I/O priorities; these come from linux/ioprio.h.
+	int constexpr ioprio_who_process = 1, ioprio_class_idle = 3, ioprio_class_shift = 13;
+	::syscall (SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift);
+#elif defined (__APPLE__)
+	::pthread_set_qos_class_self_np (QOS_CLASS_BACKGROUND, 0);
+	::setiopolicy_np (IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+#endif
+}
+
+void impl::tree_builder::run_worker (device_pool &pool, size_t index, scan_counters &counters) {
+	if (this->_low_priority) {
+		lower_thread_priority ();
+	}
+	auto const batch = stat_batch::make_unique (this->_io_queue_depth);
+	auto const batch_limit = batch->is_async () ? batch_dirs_limit : 1;
+	batch->set_latency_histogram (&counters.stat_latencies ());
+	batch->set_cancellation_flag (&this->_finished);
+	
+	vector <shared_ptr <scan_task>> tasks;
+	while (!this->ready ()) {
+		for (shared_ptr <scan_task> task; (tasks.size () < batch_limit) && (task = this->pop_task (pool, index, tasks.empty ())); ) {
+			tasks.push_back (std::move (task));
+		}
+		if (!tasks.empty ()) {
+			counters.add (scan_counters::counter::popped, tasks.size ());
+			this->process_tasks (index, tasks, *batch, counters);
+			tasks.clear ();
+			continue;
+		}
+		
+		unique_lock lock (pool.idle_lock);
+		pool.idle_condition.wait_for (lock, 10ms, [this, &pool] { return pool.queued.load (memory_order::acquire) || this->ready (); });
+	}
+}
+
+void impl::tree_builder::push_task (size_t index, shared_ptr <scan_task> &&task, scan_counters &counters) {
+	counters.add (scan_counters::counter::pushed);
+	auto &pool = *task->pool;
+	auto &queue = this->is_urgent (*task) ? pool.front : pool.queues [index % pool.queues.size ()];
+	{
+		scoped_lock lock (queue.lock);
+		queue.tasks.push_back (std::move (task));
+	}
+	auto const queued = pool.queued.fetch_add (1, memory_order::release) + 1;
+	if (queued == 1) {
+		pool.idle_condition.notify_all ();
+	}
+	// Idle workers are left alone; a device gets more of them only as its tasks pile up.
+	if (queued > pool.workers.load (memory_order::relaxed)) {
+		this->start_worker (pool);
+	}
+}
+
+shared_ptr <impl::tree_builder::scan_task> impl::tree_builder::pop_task (device_pool &pool, size_t index, bool steal) {
+	if (!pool.queued.load (memory_order::acquire)) {
+		return nullptr;
+	}
+	
+	shared_ptr <scan_task> result;
+	if (this->_progressive) {
+		scoped_lock lock (pool.front.lock);
+		if (!pool.front.tasks.empty ()) {
+			result = std::move (pool.front.tasks.front ());
+			pool.front.tasks.pop_front ();
+		}
+	}
+	for (size_t i = 0; !result && (i < (steal ? pool.queues.size () : 1)); i++) {
+		auto &queue = pool.queues [(index + i) % pool.queues.size ()];
+		scoped_lock lock (queue.lock);
+		if (queue.tasks.empty ()) {
+			continue;
+		}
+		if (i) {
+			result = std::move (queue.tasks.front ());
+			queue.tasks.pop_front ();
+		} else {
+			result = std::move (queue.tasks.back ());
+			queue.tasks.pop_back ();
+		}
+	}
+	if (result) {
+		pool.queued.fetch_sub (1, memory_order::relaxed);
+	}
+	return result;
+}
+
+bool impl::tree_builder::is_urgent (scan_task const &task) const {
+	return this->_progressive && ((task.depth < progressive_levels) || this->is_focused (task));
+}
+
+bool impl::tree_builder::is_focused (scan_task const &task) const {
+	auto const focus = this->_focus.load (memory_order::relaxed);
+	if (focus == node_tree::npos) {
 		return false;
 	}
+	for (auto current = &task; current; current = current->parent.get ()) {
+		if (current->dir.index () == focus) {
+			return true;
+		}
+	}
+	return false;
+}
+
+shared_lock <impl::tree_builder::tree_gate> impl::tree_builder::lock_records () {
+	return this->_progressive ? shared_lock (this->_gate) : shared_lock <tree_gate> ();
+}
+
+void impl::tree_builder::throttle (uint64_t syscalls, uint64_t dirs, scan_counters &counters) {
+	counters.add (scan_counters::counter::syscalls, syscalls);
+	if (this->_throttle.is_limited ()) {
+		scan_counters::timer timer (counters, scan_stats::phase::throttle);
+		this->_throttle.acquire (syscalls, dirs);
+	}
+}
+
+void impl::tree_builder::process_tasks (size_t index, vector <shared_ptr <scan_task>> const &tasks, stat_batch &batch, scan_counters &counters) {
+	struct opened_dir {
+		shared_ptr <dir_handle> handle;
+		size_t entries_begin, entries_end;
+		bool loaded;
+		bool handed_over;
+	};
 	
-	this_thread::sleep_for (500ms);
+	vector <opened_dir> dirs;
+	dirs.reserve (tasks.size ());
+	for (auto const &task: tasks) {
+		if (this->_finished.load (memory_order::relaxed)) {
+			return;
+		}
+		auto &dir = dirs.emplace_back (opened_dir { std::make_shared <dir_handle> (), batch.size (), batch.size (), true, false });
+		try {
+			auto enqueue = false;
+			if (!task->handle) {
+				this->throttle (open_syscalls, 0, counters);
+			}
+			{
+				scan_counters::timer timer (counters, scan_stats::phase::open);
+				auto const lock = this->lock_records ();
+				if (task->handle) {
+					dir.handle = std::move (task->handle);
+				} else {
+					*dir.handle = task->dir.open (task->parent_handle.get ());
+					task->parent_handle.reset ();
+				}
+				if (!task->dir.is_within_boundaries (*this->_policy)) {
+					dir.loaded = false;
+				} else if (!this->is_pool_of (*task->pool, task->dir)) {
+					// Mount points are found only once opened; their subtrees are left to workers of their devices.
+					task->pool = &this->pool_for (task->dir.identifier ().device);
+					task->handle = dir.handle;
+					dir.handed_over = true;
+				} else {
+					if (!task->parent || (task->dir.identifier ().device != task->parent->dir.identifier ().device)) {
+						this->device_did_appear (task->dir, *dir.handle);
+					}
+					if (!task->dir.visit (*this->_policy, this->_visited)) {
+						dir.loaded = false;
+					} else if (this->is_unchanged (task->dir, task->baseline)) {
+						task->reused = true;
+					} else {
+						enqueue = true;
+					}
+				}
+			}
+			if (enqueue) {
+				this->throttle (read_syscalls, 1, counters);
+				{
+					scan_counters::timer timer (counters, scan_stats::phase::read);
+					dir_info::enqueue_entries (*dir.handle, batch);
+				}
+				if (this->_policy->has_rules ()) {
+					scan_counters::timer timer (counters, scan_stats::phase::rules);
+					dir_info::exclude_entries (*this->_policy, batch, dir.entries_begin);
+				}
+			}
+		} catch (system_error const &) {
+			dir.loaded = false;
+			counters.add (scan_counters::counter::errors);
+		}
+		dir.entries_end = batch.size ();
+	}
+	
+	auto const stat_calls = static_cast <uint64_t> (count_if (batch.begin (), batch.end (), [] (stat_batch::entry const &entry) {
+		return entry.needs_stat ();
+	}));
+	counters.add (scan_counters::counter::stat_calls, stat_calls);
+	this->throttle (stat_calls, 0, counters);
+	try {
+		scan_counters::timer timer (counters, scan_stats::phase::stat);
+		batch.run ();
+	} catch (system_error const &) {
+		for (auto &dir: dirs) {
+			dir.loaded = false;
+		}
+		counters.add (scan_counters::counter::errors);
+	}
+	// Tasks of a cancelled scan are dropped along with those still queued.
+	if (this->_finished.load (memory_order::relaxed)) {
+		return;
+	}
 	
+	for (size_t i = 0; i < tasks.size (); i++) {
+		auto const &task = tasks [i];
+		auto const &dir = dirs [i];
+		if (dir.handed_over) {
+			this->push_task (index, shared_ptr <scan_task> (task), counters);
+			continue;
+		}
+		vector <pair <dir_info, node_index>> children;
+		{
+			scan_counters::timer timer (counters, scan_stats::phase::build);
+			auto const lock = this->lock_records ();
+			if (task->reused) {
+				auto const size = task->dir.size (), allocated = task->dir.allocated (), files = task->dir.files ();
+				children = task->dir.children_did_reuse (*this->_policy, *this->_baseline, task->baseline, this->_visited);
+				this->add_files (*task, batch.end (), batch.end ());
+				if (this->_progressive) {
+					this->add_partial_totals (*task, {
+						static_cast <intmax_t> (task->dir.size () - size), static_cast <intmax_t> (task->dir.allocated () - allocated), static_cast <intmax_t> (task->dir.files () - files)
+					}, false);
+				}
+			} else if (dir.loaded) {
+				auto const begin = batch.begin () + dir.entries_begin, end = batch.begin () + dir.entries_end;
+				counters.add (scan_counters::counter::errors, static_cast <uint64_t> (count_if (begin, end, [] (stat_batch::entry const &entry) {
+					return !!entry.error;
+				})));
+				auto const loaded = task->dir.children_did_stat (*this->_policy, this->_visited, *dir.handle, begin, end);
+				children = this->match_baseline (task->dir, task->baseline, loaded);
+				this->add_files (*task, begin, end);
+			}
+			if (task->reused || dir.loaded) {
+				auto const totals = this->count_children (*task, counters);
+				if (this->_progressive && !task->reused) {
+					this->add_partial_totals (*task, totals, true);
+				}
+			}
+			for (auto const &[child, baseline]: children) {
+				this->_tree [child.index ()].loading = true;
+			}
+		}
+		this->task_did_load (index, task, dir.handle, children, counters);
+	}
+	batch.clear ();
+}
+
+node_info::delta impl::tree_builder::count_children (scan_task const &task, scan_counters &counters) const {
+	uint64_t bytes = 0, allocated = 0;
+	node_info::delta totals {};
+	for (auto const node: task.dir.children ()) {
+		if (!node.is_dir () && !node.is_symlink ()) {
+			bytes += node.size ();
+			allocated += node.allocated ();
+		}
+		totals.size += static_cast <intmax_t> (node.size ());
+		totals.allocated += static_cast <intmax_t> (node.allocated ());
+		totals.files += static_cast <intmax_t> (node.files ());
+	}
+	counters.add (scan_counters::counter::dirs);
+	counters.add (scan_counters::counter::entries, task.dir.children_count ());
+	counters.add (scan_counters::counter::bytes, bytes);
+	counters.add (scan_counters::counter::allocated, allocated);
+	return totals;
+}
+
+void impl::tree_builder::add_partial_totals (scan_task const &task, node_info::delta const &delta, bool including_self) {
+	if (task.copied) {
+		return;
+	}
+	// Other workers add to the same ancestors at once; children_did_load sums up each directory again once complete.
+	for (auto current = including_self ? &task : task.parent.get (); current; current = current->parent.get ()) {
+		auto &record = this->_tree [current->dir.index ()];
+		atomic_ref (record.total_size).fetch_add (static_cast <uint64_t> (delta.size), memory_order::relaxed);
+		atomic_ref (record.total_allocated).fetch_add (static_cast <uint64_t> (delta.allocated), memory_order::relaxed);
+		atomic_ref (record.total_files).fetch_add (static_cast <uint32_t> (delta.files), memory_order::relaxed);
+	}
+}
+
+void impl::tree_builder::task_did_load (size_t index, shared_ptr <scan_task> const &task, shared_ptr <dir_handle> const &handle, vector <pair <dir_info, node_index>> const &children, scan_counters &counters) {
+	this->_ready.fetch_add (1, memory_order::relaxed);
+	
+	if (children.empty ()) {
+		return this->complete_task (task, counters);
+	}
+	
+	this->_total.fetch_add (children.size (), memory_order::relaxed);
+	task->pending.store (children.size (), memory_order::release);
+	for (auto const &[child, baseline]: children) {
+		// Targets of links are stat'ed when followed, so their devices are known already.
+		auto const is_entry = (child.parent () == task->dir);
+		auto &pool = (is_entry || this->is_pool_of (*task->pool, child)) ? *task->pool : this->pool_for (child.identifier ().device);
+		this->push_task (index, std::make_shared <scan_task> (child, task, is_entry ? handle : nullptr, baseline, pool), counters);
+	}
+}
+
+void impl::tree_builder::add_files (scan_task &task, stat_batch::iterator begin, stat_batch::iterator end) const {
+	if (!this->_histograms_threshold) {
+		return;
+	}
+	
+	// Children were made of entries without errors in the same order and have not been sorted yet.
+	auto it = begin;
+	for (auto const node: task.dir.children ()) {
+		for (; (it != end) && !dir_info::is_child_entry (*this->_policy, *it); it++);
+		auto const info = (it != end) ? &(it++)->info : nullptr;
+		if (node.is_dir ()) {
+			continue;
+		}
+		
+		auto size = node.size (), allocated = node.allocated ();
+		// Directories behind links are loaded as subdirectories and merged later.
+		if (auto const target = node.is_symlink () ? node.as_link ().target () : node_info (); target && target.is_dir ()) {
+			size -= target.size ();
+			allocated -= target.allocated ();
+		}
+		if (!task.histogram) {
+			task.histogram = std::make_unique <subtree_histogram> (this->_scan_time);
+		}
+		auto const mtime = duration_cast <nanoseconds> (node.mtime ().time_since_epoch ()).count ();
+		auto const owner = info ? static_cast <uint64_t> (info->st_uid) : subtree_histogram::unknown;
+		auto const group = info ? static_cast <uint64_t> (info->st_gid) : subtree_histogram::unknown;
+		task.histogram->add (owner, group, node.name (), mtime, size, allocated);
+	}
+}
+
+void impl::tree_builder::histogram_did_complete (scan_task &task) {
+	// Every subdirectory has been merged by now, so the histogram is not touched concurrently anymore.
+	shared_ptr <subtree_histogram> histogram = std::move (task.histogram);
+	if (!histogram) {
+		return;
+	}
+	if (task.parent) {
+		scoped_lock lock (task.parent->histogram_lock);
+		if (task.parent->histogram) {
+			task.parent->histogram->merge (*histogram);
+		} else {
+			task.parent->histogram = std::make_unique <subtree_histogram> (*histogram);
+		}
+	}
+	if (!task.parent || (task.dir.size () >= *this->_histograms_threshold)) {
+		scoped_lock lock (this->_histograms_lock);
+		this->_histograms [task.dir.identifier ().as_tuple ()] = std::move (histogram);
+	}
+}
+
+bool impl::tree_builder::is_unchanged (dir_info const &dir, node_index baseline) const {
+	if (baseline == node_tree::npos) {
+		return false;
+	}
+	auto const &record = (*this->_baseline) [baseline];
+	// Directories reached through another path first were left empty and zero-sized; they have nothing to reuse.
+	if (!record.count && !record.total_size) {
+		return false;
+	}
+	auto const mtime = file_clock::time_point (nanoseconds (record.mtime));
+	auto const id = dir.identifier ();
+	return (record.type == node_type::dir) && (record.inode == id.inode) && (this->_baseline->device (record.device) == id.device) && (dir.mtime () == mtime);
+}
+
+vector <pair <dir_info, node_index>> impl::tree_builder::match_baseline (dir_info const &dir, node_index baseline, vector <dir_info> const &children) const {
+	vector <pair <dir_info, node_index>> result;
+	result.reserve (children.size ());
+	if ((baseline == node_tree::npos) || ((*this->_baseline) [baseline].type != node_type::dir)) {
+		for (auto const &child: children) {
+			result.emplace_back (child, node_tree::npos);
+		}
+		return result;
+	}
+	
+	auto const &tree = *this->_baseline;
+	auto const &record = tree [baseline];
+	unordered_map <string_view, node_index> names;
+	names.reserve (record.count);
+	for (uint32_t i = 0; i < record.count; i++) {
+		names.emplace (tree.name (tree [record.first + i].name), record.first + i);
+	}
+	for (auto const &child: children) {
+		auto const is_target = (child.parent () != dir);
+		auto const it = names.find (is_target ? this->_tree.name (this->_tree [this->_tree [child.index ()].parent].name) : child.name ());
+		auto match = (it != names.end ()) ? it->second : node_tree::npos;
+		if (is_target && (match != node_tree::npos)) {
+			match = (tree [match].type == node_type::link) ? tree [match].first : node_tree::npos;
+		}
+		result.emplace_back (child, match);
+	}
+	return result;
+}
+
+void impl::tree_builder::complete_task (shared_ptr <scan_task> task, scan_counters &counters) {
+	for (; task; task = task->parent) {
+		{
+			auto const lock = this->lock_records ();
+			// Totals and order of a reused directory are still valid unless some subdirectory changed.
+			if (!task->reused || task->changed.load (memory_order::acquire)) {
+				scan_counters::timer timer (counters, scan_stats::phase::order);
+				task->dir.children_did_load ();
+				if (task->parent) {
+					task->parent->changed.store (true, memory_order::release);
+				}
+			}
+			this->_tree [task->dir.index ()].loading = false;
+		}
+		if (this->_histograms_threshold) {
+			this->histogram_did_complete (*task);
+		}
+		// Directories reached through another path first are left empty and zero-sized; they are reported from there.
+		if (this->_subtree_callback && (task->dir.children_count () || task->dir.size ())) {
+			this->_subtree_callback (task->dir, task->depth);
+		}
+		// Before the parent may complete, which could release the record of the directory itself.
+		if (this->_discards_subtrees) {
+			this->discard_children (task->dir);
+		}
+		if (task->parent && (task->parent->pending.fetch_sub (1, memory_order::acq_rel) > 1)) {
+			return;
+		}
+		if (!task->parent && (this->_pending_roots.fetch_sub (1, memory_order::acq_rel) == 1)) {
+			this->finish (true);
+		}
+	}
+}
+
+void impl::tree_builder::discard_children (dir_info const &dir) {
+	auto &record = this->_tree [dir.index ()];
+	if (record.first == node_tree::npos) {
+		return;
+	}
+	for (uint32_t i = 0; i < record.count; i++) {
+		auto const &child = this->_tree [record.first + i];
+		if ((child.type == node_type::link) && (child.first != node_tree::npos)) {
+			this->_tree.release (child.first, 1);
+		}
+	}
+	this->_tree.release (record.first, record.count);
+	record.first = node_tree::npos;
+	record.count = record.sorted = 0;
+}
+
+bool impl::tree_builder::finish (bool success) {
+	if (this->_finished.exchange (true, memory_order::acq_rel)) {
+		return false;
+	}
+	this->_elapsed.store (duration_cast <nanoseconds> (steady_clock::now () - this->_start_time).count (), memory_order::relaxed);
+	this->_result.store (success, memory_order::release);
+	{
+		scoped_lock lock (this->_idle_lock);
+	}
+	this->_idle_condition.notify_all ();
+	scoped_lock lock (this->_pools_lock);
+	for (auto const &[device, pool]: this->_pools) {
+		{
+			scoped_lock pool_lock (pool->idle_lock);
+		}
+		pool->idle_condition.notify_all ();
+	}
 	return true;
 }
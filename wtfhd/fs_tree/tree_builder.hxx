@@ -8,34 +8,97 @@
 #ifndef tree_builder_hxx
 #define tree_builder_hxx
 
+#include <vector>
 #include <memory>
 #include <optional>
+#include <functional>
 #include <sys/types.h>
 
 #include "misc_types.hxx"
 #include "node_info.hxx"
+#include "scan_stats.hxx"
+#include "scan_throttle.hxx"
 
 namespace fs {
 	class children_policy;
+	class subtree_histogram;
 	
 	class tree_builder {
 	public:
 		typedef node_info::id node_id_t;
+		// Receives a directory along with its depth below the root it was reached from.
+		typedef std::function <void (dir_info const &, std::size_t)> subtree_callback_t;
 		
 		static std::unique_ptr <tree_builder> make_unique (std::unique_ptr <children_policy const> &&policy);
 		virtual ~tree_builder () = default;
 		
 		virtual bool started () const = 0;
+		// Entries found against those expected, seeded from inode usage of the devices scanned and refined as directories are found,
+		// along with the time left at the recent rate; updated right before progress callbacks are invoked.
 		virtual util::progress_t progress () const = 0;
+		// Counters of all workers summed up without locking them, so it is cheap enough to be taken on every progress update.
+		virtual scan_stats stats () const = 0;
 		virtual bool ready () const = 0;
 		virtual bool success () const = 0;
 		virtual std::optional <bool> result () const = 0;
 		
+		// Number of workers scanning each device, unless boundaries_policy::ignore makes all of them share one set of workers.
+		virtual std::size_t concurrency () const = 0;
+		virtual void set_concurrency (std::size_t concurrency) = 0;
+		// Number of metadata requests kept in flight by each worker; 0 disables asynchronous I/O.
+		virtual std::size_t io_queue_depth () const = 0;
+		virtual void set_io_queue_depth (std::size_t io_queue_depth) = 0;
+		// Lists the top few levels first and lets subtrees be prioritized, so that the tree can be browsed while it is being scanned;
+		// totals of directories still loading are partial meanwhile, and progress callbacks come more often.
+		virtual bool progressive () const = 0;
+		virtual void set_progressive (bool progressive) = 0;
+		// Rate limits of the scan, e.g. to spare a busy device; unlimited unless set. May be changed while the scan runs.
+		virtual scan_limits limits () const = 0;
+		virtual void set_limits (scan_limits const &limits) = 0;
+		// Syscalls per second allowed now, lowered below limits () while stat latency is above their threshold; zero if unlimited.
+		virtual double syscalls_rate () const = 0;
+		// Runs workers at idle CPU and I/O priority where supported, so that they only take what nothing else asks for. Best effort, since it may be refused.
+		virtual bool low_priority () const = 0;
+		virtual void set_low_priority (bool low_priority) = 0;
+		
+		// Available once ready, or by the first progress callback in progressive mode.
+		virtual std::vector <node_info> const &roots () const = 0;
+		// Storage behind roots () and their descendants.
+		virtual node_tree const &tree () const = 0;
+		// Lets a finished tree be updated in place, e.g. by tree_watcher; must not be used while building.
+		virtual node_tree &tree () = 0;
+		virtual children_policy const &policy () const = 0;
+		
+		// Tree built earlier for the same roots, e.g. from a snapshot; directories whose inode and mtime did not change since are not read again,
+		// only their subdirectories are checked. Entry sizes within such directories are taken from the baseline as well.
+		virtual void set_baseline (std::shared_ptr <node_tree const> tree, std::vector <node_info> const &roots) = 0;
+		
+		// Moves directories queued within the subtree of dir ahead of the rest in progressive mode, e.g. as it is browsed into.
+		virtual void prioritize (dir_info const &dir) = 0;
+		// Keeps workers of a progressive scan from changing the tree until unlock_tree (), so that it can be looked at meanwhile; meant to be held briefly.
+		// Records of directories move as their parents complete, so views of them taken before must be found again.
+		virtual void lock_tree () = 0;
+		virtual void unlock_tree () = 0;
+		
 		virtual bool contains (node_id_t const &node_id) const = 0;
 		virtual void add_node (node_id_t const &node_id) = 0;
 		
 		virtual util::callback_id_t add_progress_callback (util::callback_t const &callback) = 0;
 		virtual void remove_progress_callback (util::callback_id_t const callback_id) = 0;
+		// Invoked on worker threads, possibly at once, for every directory as soon as its whole subtree is loaded,
+		// so that each one comes after all of its subdirectories; the directory record does not move until the callback returns.
+		virtual void set_subtree_callback (subtree_callback_t const &callback) = 0;
+		// Gives records of children of every directory back to the tree once the subtree callback returns for it, leaving the directory with its totals only,
+		// so that records are taken by directories in progress rather than the whole tree. Only records are bounded: names stay interned, a copy of each
+		// distinct one, and keep growing with the tree. Meant for reports; not for progressive scans or trees saved afterwards.
+		virtual bool discards_subtrees () const = 0;
+		virtual void set_discards_subtrees (bool discards_subtrees) = 0;
+		
+		// Collects subtree_histogram of files while scanning, keeping ones of roots and of directories at least min_size large by apparent size;
+		// those of smaller directories are dropped once merged into their parents. Off unless set.
+		virtual void set_histograms_threshold (std::uintmax_t min_size) = 0;
+		// Histogram of a directory, if one was kept; available to subtree callbacks as well. Not updated by tree_watcher.
+		virtual std::shared_ptr <subtree_histogram const> histogram (dir_info const &dir) const = 0;
 
 		virtual void start (util::callback_t const &callback) = 0;
 		virtual void cancel () = 0;
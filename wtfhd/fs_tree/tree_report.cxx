@@ -0,0 +1,193 @@
+//
+//  tree_report.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/30/20.
+//
+
+#include "tree_report.hxx"
+#include "subtree_histogram.hxx"
+
+#include <mutex>
+#include <string>
+#include <cstdio>
+#include <string_view>
+
+using namespace fs;
+using namespace std;
+
+namespace fs::impl {
+	class tree_report: public ::tree_report {
+	public:
+		tree_report (format format, ostream &output): _format (format), _output (output), _max_depth (numeric_limits <size_t>::max ()), _min_size (), _metric (size_metric::apparent) {
+			if (format == format::csv) {
+				this->_output << "path,size,allocated,files,entries,depth\n";
+			}
+		}
+		
+		virtual void set_max_depth (size_t max_depth) override {
+			this->_max_depth = max_depth;
+		}
+		
+		virtual void set_min_size (uintmax_t min_size) override {
+			this->_min_size = min_size;
+		}
+		
+		virtual void set_metric (size_metric metric) override {
+			this->_metric = metric;
+		}
+		
+		virtual void add_node (node_info const &node, size_t depth, subtree_histogram const *histogram) override;
+		
+		virtual void flush () override {
+			scoped_lock lock (this->_lock);
+			this->_output.flush ();
+		}
+		
+	private:
+		static void append_json_string (string &line, string_view value);
+		static void append_json_histogram (string &line, subtree_histogram const &histogram);
+		static void append_csv_field (string &line, string_view value);
+		
+		format const _format;
+		ostream &_output;
+		size_t _max_depth;
+		uintmax_t _min_size;
+		size_metric _metric;
+		mutex _lock;
+	};
+}
+
+unique_ptr <tree_report> tree_report::make_unique (format format, ostream &output) {
+	return std::make_unique <impl::tree_report> (format, output);
+}
+
+void impl::tree_report::add_node (node_info const &node, size_t depth, subtree_histogram const *histogram) {
+	auto const size = node.size (this->_metric);
+	if ((depth > this->_max_depth) || (size < this->_min_size)) {
+		return;
+	}
+	
+	auto const apparent = to_string (node.size ()), allocated = to_string (node.allocated ()), files = to_string (node.files ());	
+	auto const path = node.path ().native ();
+	auto const dir = node.as_dir ();
+	auto const entries = to_string (dir ? dir.children_count () : 0);
+	string line;
+	line.reserve (path.size () + 64);
+	switch (this->_format) {
+	case format::ndjson:
+		line += "{\"path\":";
+		append_json_string (line, path);
+		line += ",\"size\":" + apparent + ",\"allocated\":" + allocated + ",\"files\":" + files + ",\"entries\":" + entries + ",\"depth\":" + to_string (depth);
+		if (histogram) {
+			line += ",\"histogram\":";
+			append_json_histogram (line, *histogram);
+		}
+		line += "}\n";
+		break;
+	case format::csv:
+		append_csv_field (line, path);
+		line += ',' + apparent + ',' + allocated + ',' + files + ',' + entries + ',' + to_string (depth) + '\n';
+		break;
+	case format::du:
+		line += to_string (size) + '\t' + path + '\n';
+		break;
+	}
+	
+	scoped_lock lock (this->_lock);
+	this->_output.write (line.data (), static_cast <streamsize> (line.size ()));
+}
+
+void impl::tree_report::append_json_string (string &line, string_view value) {
+	line += '"';
+	for (auto const c: value) {
+		switch (c) {
+		case '"':
+			line += "\\\"";
+			break;
+		case '\\':
+			line += "\\\\";
+			break;
+		case '\n':
+			line += "\\n";
+			break;
+		case '\t':
+			line += "\\t";
+			break;
+		default:
+			if (static_cast <unsigned char> (c) < 0x20) {
+				char escaped [8];
+				snprintf (escaped, sizeof (escaped), "\\u%04x", static_cast <unsigned> (c));
+				line += escaped;
+			} else {
+				// Names are passed through as is; paths which are not valid UTF-8 stay invalid.
+				line += c;
+			}
+		}
+	}
+	line += '"';
+}
+
+void impl::tree_report::append_json_histogram (string &line, subtree_histogram const &histogram) {
+	auto const append_bucket = [&line] (subtree_histogram::bucket const &bucket, auto const &append_key) {
+		line += '{';
+		append_key ();
+		line += ",\"files\":" + to_string (bucket.files) + ",\"size\":" + to_string (bucket.size) + ",\"allocated\":" + to_string (bucket.allocated) + '}';
+	};
+	auto const append_buckets = [&line, &append_bucket] (char const *name, subtree_histogram::keyed_buckets const &buckets, bool extensions) {
+		line += '"';
+		line += name;
+		line += "\":[";
+		for (auto const &bucket: buckets.sorted ()) {
+			append_bucket (bucket, [&] {
+				line += extensions ? "\"ext\":" : "\"id\":";
+				if (bucket.key == subtree_histogram::unknown) {
+					line += "null";
+				} else if (extensions) {
+					append_json_string (line, subtree_histogram::extension_name (bucket.key));
+				} else {
+					line += to_string (bucket.key);
+				}
+			});
+			line += ',';
+		}
+		if (buckets.other ().files) {
+			append_bucket (buckets.other (), [&] { line += extensions ? "\"ext\":\"*\"" : "\"id\":\"*\""; });
+			line += ',';
+		}
+		if (line.back () == ',') {
+			line.pop_back ();
+		}
+		line += ']';
+	};
+	
+	line += '{';
+	append_buckets ("owners", histogram.owners (), false);
+	line += ',';
+	append_buckets ("groups", histogram.groups (), false);
+	line += ',';
+	append_buckets ("extensions", histogram.extensions (), true);
+	line += ",\"ages\":[";
+	for (size_t i = 0; i < subtree_histogram::ages_count; i++) {
+		append_bucket (histogram.ages () [i], [&] {
+			line += "\"age\":";
+			append_json_string (line, subtree_histogram::age_name (i));
+		});
+		line += (i + 1 < subtree_histogram::ages_count) ? "," : "]}";
+	}
+}
+
+void impl::tree_report::append_csv_field (string &line, string_view value) {
+	if (value.find_first_of (",\"\r\n") == string_view::npos) {
+		line += value;
+		return;
+	}
+	line += '"';
+	for (auto const c: value) {
+		if (c == '"') {
+			line += '"';
+		}
+		line += c;
+	}
+	line += '"';
+}
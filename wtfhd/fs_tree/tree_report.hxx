@@ -0,0 +1,51 @@
+//
+//  tree_report.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/30/20.
+//
+
+#ifndef tree_report_hxx
+#define tree_report_hxx
+
+#include <memory>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+#include "node_info.hxx"
+
+namespace fs {
+	class tree_report;
+	class subtree_histogram;
+}
+
+// Writes one line per node as nodes are added, keeping nothing but the line being written;
+// meant to be fed by tree_builder::set_subtree_callback, which reports directories in post-order.
+class fs::tree_report {
+public:
+	enum struct format {
+		// JSON object per line: path, apparent and allocated size, files and entries count, depth, and histogram if given,
+		// where keys dropped into other buckets are shown as "*" and unknown ones as null.
+		ndjson,
+		// Header line followed by columns of the same fields.
+		csv,
+		// Size by metric in bytes and path separated by a tab, like du -b or du -B1.
+		du,
+	};
+
+	static std::unique_ptr <tree_report> make_unique (format format, std::ostream &output);
+	virtual ~tree_report () = default;
+
+	// Nodes deeper than max_depth below their root or smaller than min_size by metric are skipped.
+	virtual void set_max_depth (std::size_t max_depth) = 0;
+	virtual void set_min_size (std::uintmax_t min_size) = 0;
+	virtual void set_metric (size_metric metric) = 0;
+
+	// Safe to call from several threads at once.
+	virtual void add_node (node_info const &node, std::size_t depth, subtree_histogram const *histogram = nullptr) = 0;
+	virtual void flush () = 0;
+};
+
+#endif /* tree_report_hxx */
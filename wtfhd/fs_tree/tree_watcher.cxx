@@ -0,0 +1,891 @@
+//
+//  tree_watcher.cxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/27/20.
+//
+
+#include "tree_watcher.hxx"
+
+#include <bit>
+#include <array>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <system_error>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined (__linux__)
+#	include <poll.h>
+#	include <sys/inotify.h>
+#	include <sys/fanotify.h>
+#endif
+
+#include "dir_handle.hxx"
+#include "stat_batch.hxx"
+#include "node_id_set.hxx"
+#include "children_policy.hxx"
+
+using namespace fs;
+using namespace std;
+using namespace util;
+
+namespace fs::impl {
+	// Device and inode, of directories and of hard-linked files alike.
+	typedef pair <::dev_t, ::ino_t> dir_key;
+	
+	// Entries of added directories read by a single callback on the owner thread.
+	size_t constexpr loaded_entries_max = 4096;
+	
+	struct dir_key_hash {
+		size_t operator () (dir_key const &key) const {
+			return std::hash <uint64_t> () ((static_cast <uint64_t> (key.first) * 0x9E3779B97F4A7C15ULL) ^ static_cast <uint64_t> (key.second));
+		}
+	};
+	
+	// Entry named name within a directory, given either by inotify watch descriptor or by id; forget drops the watch.
+	struct watch_event {
+		int watch;
+		dir_key dir;
+		string name;
+		bool forget;
+	};
+	
+	// Everything but the reader thread, which only turns notifications into watch_events; lives on the tree owner thread.
+	class watch_state {
+	public:
+		watch_state (node_tree &tree, vector <node_info> const &roots, unique_ptr <children_policy const> &&policy):
+			tree (tree), roots (roots), policy (std::move (policy)), notify_fd (-1), uses_fanotify (), stopped (), loads_scheduled () {}
+		~watch_state ();
+		
+		void register_dirs ();
+		void apply (vector <watch_event> const &events);
+		// Reads entries of directories added since, oldest first, until about entries_max of them are read; returns whether any are left.
+		bool load_dirs (size_t entries_max);
+		
+		bool has_unloaded_dirs () const {
+			return !this->_unloaded.empty ();
+		}
+		
+		node_tree &tree;
+		vector <node_info> const roots;
+		unique_ptr <children_policy const> const policy;
+		node_id_set visited;
+		
+		int notify_fd;
+		bool uses_fanotify;
+		vector <int> mount_fds;
+		atomic <bool> stopped;
+		bool loads_scheduled;
+		
+	private:
+		void apply (watch_event const &event);
+		void add_child (dir_info const &dir, string const &name, struct ::stat const &info);
+		void remove_child (dir_info const &dir, node_index child);
+		// Queues an added directory to have its entries read by load_dirs, unless another path reached it first.
+		void defer_loading (dir_info const &dir);
+		size_t load_dir (dir_info const &dir);
+		// Gives records of the subtree below index back to the tree, along with spare ones of its children ranges.
+		void release_subtree (node_index index);
+		uint32_t capacity_of (node_record const &record) const;
+		// Moves a sibling record, following it by parent references of its children and the directory map.
+		void move_record (node_index from, node_index to);
+		// Adds every loaded directory of the subtree to the directory map and watches it, or does the opposite.
+		void register_subtree (node_index index, bool add);
+		// Remembers paths of hard links below index left empty because another path of the same file is counted.
+		void note_uncounted_links (node_index index);
+		void note_uncounted_link (node_index index);
+		// Counts files at another path of theirs once the counted one was removed.
+		void count_orphaned_links ();
+		// Adds delta to totals of dir and its ancestors; dir no longer keeps its children ordered, ancestors only as far as the change breaks their order.
+		void propagate (node_index dir, node_info::delta const &delta);
+		// Shrinks the ordered children of dir to those still in order once child, one of them or of the rest, changed its size by delta.
+		void keep_ordered (node_index dir, node_index child, intmax_t delta);
+		// Index of a registered directory, followed after ordering children on demand moved its record.
+		node_index find_dir (dir_key const &key);
+		// Looks name up by the index of children of dir, building it anew when missing or out of date, e.g. after children were ordered.
+		node_index find_child (dir_info const &dir, string_view name);
+		bool is_dir_at (node_index index, dir_key const &key) const;
+		
+		unordered_map <dir_key, node_index, dir_key_hash> _dirs;
+		// Added directories not read yet; events within them are left to reading them. Keys of those removed meanwhile stay queued until reached.
+		unordered_set <dir_key, dir_key_hash> _unloaded;
+		deque <dir_key> _unloaded_order;
+		// Children by name of directories which had entries changed; names point into the name pool of the tree, which never moves them.
+		unordered_map <dir_key, unordered_map <string_view, node_index>, dir_key_hash> _children;
+		// Records held by children ranges grown with spare room for further entries, by the first of them; others hold just their children.
+		unordered_map <node_index, uint32_t> _capacities;
+		// Paths of uncounted hard links as their directories and names, by file; only for attribution to the first path.
+		unordered_map <dir_key, vector <pair <dir_key, name_id>>, dir_key_hash> _uncounted_links;
+		// Files having uncounted links whose counted path was removed by the event being applied.
+		vector <dir_key> _orphaned_links;
+		unique_ptr <stat_batch> const _batch = stat_batch::make_unique (0);
+		unordered_map <int, dir_key> _watches;
+		unordered_map <dir_key, int, dir_key_hash> _watch_of;
+		bool _watches_exhausted = false;
+	};
+	
+	class tree_watcher: public ::tree_watcher {
+	public:
+		tree_watcher (node_tree &tree, vector <node_info> const &roots, unique_ptr <children_policy const> &&policy):
+			_state (std::make_shared <watch_state> (tree, roots, std::move (policy))), _backend (), _wakeup { -1, -1 } {}
+		virtual ~tree_watcher () {
+			this->stop ();
+		}
+		
+		virtual char const *backend () const override {
+			return this->_backend;
+		}
+		
+		virtual bool start (dispatcher_t const &dispatch, callback_t const &did_update) override;
+		virtual void stop () override;
+		
+	private:
+		bool init_fanotify ();
+		bool init_inotify ();
+		
+		static void run (shared_ptr <watch_state> state, int wakeup_fd, dispatcher_t dispatch, callback_t did_update);
+		// Reads added directories a bounded number of entries per callback, so that input is handled in between on the owner thread.
+		static void schedule_loads (shared_ptr <watch_state> const &state, dispatcher_t const &dispatch, callback_t const &did_update);
+		static void read_inotify (watch_state const &state, vector <watch_event> &events);
+		static void read_fanotify (watch_state const &state, vector <watch_event> &events);
+		
+		shared_ptr <watch_state> const _state;
+		char const *_backend;
+		int _wakeup [2];
+		thread _reader;
+	};
+}
+
+unique_ptr <tree_watcher> tree_watcher::make_unique (node_tree &tree, vector <node_info> const &roots, unique_ptr <children_policy const> &&policy) {
+	return std::make_unique <impl::tree_watcher> (tree, roots, std::move (policy));
+}
+
+#if defined (__linux__)
+
+bool impl::tree_watcher::start (dispatcher_t const &dispatch, callback_t const &did_update) {
+	if (this->_reader.joinable ()) {
+		return true;
+	}
+	if (!this->init_fanotify () && !this->init_inotify ()) {
+		return false;
+	}
+	if (::pipe2 (this->_wakeup, O_CLOEXEC)) {
+		return false;
+	}
+	this->_state->register_dirs ();
+	this->_reader = thread (&tree_watcher::run, this->_state, this->_wakeup [0], dispatch, did_update);
+	return true;
+}
+
+void impl::tree_watcher::stop () {
+	this->_state->stopped.store (true, memory_order::release);
+	if (this->_reader.joinable ()) {
+		char const byte = 0;
+		while ((::write (this->_wakeup [1], &byte, 1) == -1) && (errno == EINTR));
+		this->_reader.join ();
+	}
+	for (auto &fd: this->_wakeup) {
+		if (fd != -1) {
+			::close (fd);
+			fd = -1;
+		}
+	}
+}
+
+bool impl::tree_watcher::init_fanotify () {
+#if defined (FAN_REPORT_DFID_NAME)
+	int const fd = ::fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	uint64_t constexpr mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+	auto &state = *this->_state;
+	for (auto const &root: state.roots) {
+		auto const path = root.path ();
+		if (::fanotify_mark (fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, path.c_str ())) {
+			break;
+		}
+		// Directory handles are resolved relative to any open file of the same filesystem; O_PATH ones do not qualify.
+		auto const mount_fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+		if (mount_fd == -1) {
+			break;
+		}
+		state.mount_fds.push_back (mount_fd);
+	}
+	if (state.mount_fds.size () != state.roots.size ()) {
+		for (auto const mount_fd: state.mount_fds) {
+			::close (mount_fd);
+		}
+		state.mount_fds.clear ();
+		::close (fd);
+		return false;
+	}
+	state.notify_fd = fd;
+	state.uses_fanotify = true;
+	this->_backend = "fanotify";
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool impl::tree_watcher::init_inotify () {
+	int const fd = ::inotify_init1 (IN_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	this->_state->notify_fd = fd;
+	this->_state->uses_fanotify = false;
+	this->_backend = "inotify";
+	return true;
+}
+
+void impl::tree_watcher::run (shared_ptr <watch_state> state, int wakeup_fd, dispatcher_t dispatch, callback_t did_update) {
+	array <pollfd, 2> fds { pollfd { state->notify_fd, POLLIN, 0 }, pollfd { wakeup_fd, POLLIN, 0 } };
+	while (!state->stopped.load (memory_order::acquire)) {
+		if (::poll (fds.data (), fds.size (), -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds [1].revents) {
+			break;
+		}
+		
+		vector <watch_event> events;
+		if (state->uses_fanotify) {
+			read_fanotify (*state, events);
+		} else {
+			read_inotify (*state, events);
+		}
+		if (events.empty ()) {
+			continue;
+		}
+		dispatch ([state, events = std::move (events), dispatch, did_update] {
+			if (state->stopped.load (memory_order::acquire)) {
+				return;
+			}
+			state->apply (events);
+			did_update ();
+			schedule_loads (state, dispatch, did_update);
+		});
+	}
+}
+
+void impl::tree_watcher::schedule_loads (shared_ptr <watch_state> const &state, dispatcher_t const &dispatch, callback_t const &did_update) {
+	if (state->loads_scheduled || !state->has_unloaded_dirs ()) {
+		return;
+	}
+	state->loads_scheduled = true;
+	dispatch ([state, dispatch, did_update] {
+		state->loads_scheduled = false;
+		if (state->stopped.load (memory_order::acquire)) {
+			return;
+		}
+		state->load_dirs (loaded_entries_max);
+		did_update ();
+		schedule_loads (state, dispatch, did_update);
+	});
+}
+
+void impl::tree_watcher::read_inotify (watch_state const &state, vector <watch_event> &events) {
+	alignas (inotify_event) static thread_local array <char, 64 * 1024> buffer;
+	auto const length = ::read (state.notify_fd, buffer.data (), buffer.size ());
+	for (ssize_t offset = 0; offset < length; ) {
+		auto const event = reinterpret_cast <inotify_event const *> (buffer.data () + offset);
+		offset += sizeof (inotify_event) + event->len;
+		
+		if (event->mask & IN_IGNORED) {
+			events.push_back ({ event->wd, {}, {}, true });
+			continue;
+		}
+		if (!event->len) {
+			continue;
+		}
+		string name (event->name);
+		// Writes come in bursts of IN_MODIFY for the same entry; each event re-stats it anyway.
+		if (!events.empty () && (events.back ().watch == event->wd) && (events.back ().name == name)) {
+			continue;
+		}
+		events.push_back ({ event->wd, {}, std::move (name), false });
+	}
+}
+
+void impl::tree_watcher::read_fanotify (watch_state const &state, vector <watch_event> &events) {
+#if defined (FAN_REPORT_DFID_NAME)
+	alignas (fanotify_event_metadata) static thread_local array <char, 64 * 1024> buffer;
+	auto length = ::read (state.notify_fd, buffer.data (), buffer.size ());
+	for (auto metadata = reinterpret_cast <fanotify_event_metadata const *> (buffer.data ()); FAN_EVENT_OK (metadata, length); metadata = FAN_EVENT_NEXT (metadata, length)) {
+		if ((metadata->vers != FANOTIFY_METADATA_VERSION) || (metadata->mask & FAN_Q_OVERFLOW)) {
+			continue;
+		}
+		auto const info = reinterpret_cast <fanotify_event_info_fid const *> (metadata + 1);
+		if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+			continue;
+		}
+		auto const handle = reinterpret_cast <file_handle *> (const_cast <unsigned char *> (info->handle));
+		string name (reinterpret_cast <char const *> (handle->f_handle + handle->handle_bytes));
+		if (name == ".") {
+			continue;
+		}
+		
+		struct ::stat dir_info;
+		int dir_fd = -1;
+		for (auto const mount_fd: state.mount_fds) {
+			if ((dir_fd = ::open_by_handle_at (mount_fd, handle, O_PATH | O_CLOEXEC)) != -1) {
+				break;
+			}
+		}
+		if (dir_fd == -1) {
+			continue;
+		}
+		auto const stat_failed = ::fstat (dir_fd, &dir_info);
+		::close (dir_fd);
+		if (stat_failed) {
+			continue;
+		}
+		
+		dir_key const dir { dir_info.st_dev, dir_info.st_ino };
+		if (!events.empty () && (events.back ().dir == dir) && (events.back ().name == name)) {
+			continue;
+		}
+		events.push_back ({ -1, dir, std::move (name), false });
+	}
+#endif
+}
+
+impl::watch_state::~watch_state () {
+	if (this->notify_fd != -1) {
+		::close (this->notify_fd);
+	}
+	for (auto const fd: this->mount_fds) {
+		::close (fd);
+	}
+}
+
+void impl::watch_state::register_dirs () {
+	for (auto const &root: this->roots) {
+		this->register_subtree (root.index (), true);
+	}
+	// Counted files are known only once every directory is registered.
+	this->_uncounted_links.clear ();
+	for (auto const &root: this->roots) {
+		this->note_uncounted_links (root.index ());
+	}
+}
+
+void impl::watch_state::apply (vector <watch_event> const &events) {
+	for (auto const &event: events) {
+		try {
+			this->apply (event);
+			this->count_orphaned_links ();
+		} catch (system_error const &) {
+			this->_orphaned_links.clear ();
+		}
+	}
+}
+
+void impl::watch_state::apply (watch_event const &event) {
+	auto key = event.dir;
+	if (event.watch != -1) {
+		auto const it = this->_watches.find (event.watch);
+		if (it == this->_watches.end ()) {
+			return;
+		}
+		key = it->second;
+		if (event.forget) {
+			this->_watch_of.erase (key);
+			this->_watches.erase (it);
+			return;
+		}
+	}
+	if (this->_unloaded.count (key)) {
+		return;
+	}
+	auto const index = this->find_dir (key);
+	if (index == node_tree::npos) {
+		return;
+	}
+	
+	auto const dir = dir_info (this->tree, index);
+	auto const child = this->find_child (dir, event.name);
+	struct ::stat info;
+	if (::fstatat (AT_FDCWD, (dir.path () / event.name).c_str (), &info, AT_SYMLINK_NOFOLLOW)) {
+		if (child != node_tree::npos) {
+			this->remove_child (dir, child);
+		}
+		return;
+	}
+	
+	if (child == node_tree::npos) {
+		if (!this->policy->accepts (event.name, S_ISDIR (info.st_mode) ? DT_DIR : DT_REG)) {
+			return;
+		}
+		return this->add_child (dir, event.name, info);
+	}
+	auto const node = node_info (this->tree, child);
+	if ((node.identifier ().inode != info.st_ino) || (node.is_dir () != S_ISDIR (info.st_mode)) || (node.is_symlink () != S_ISLNK (info.st_mode))) {
+		// Entry was replaced, e.g. by rename over it.
+		this->remove_child (dir, child);
+		return this->add_child (dir, event.name, info);
+	}
+	if (!node.is_dir ()) {
+		this->propagate (dir.index (), node.refresh (info, *this->policy));
+	}
+}
+
+void impl::watch_state::add_child (dir_info const &dir, string const &name, struct ::stat const &info) {
+	auto &record = this->tree [dir.index ()];
+	auto const count = record.count;
+	if (auto const capacity = this->capacity_of (record); count == capacity) {
+		// Doubles, so that entries created one by one move their siblings a constant number of times each on average,
+		// and released ranges fit the next directory growing to the same size.
+		auto const old_first = record.first, grown = max (bit_ceil (count + 1), uint32_t (4));
+		auto const first = this->tree.allocate (grown);
+		for (uint32_t i = 0; i < count; i++) {
+			this->move_record (old_first + i, first + i);
+		}
+		if (capacity) {
+			this->tree.release (old_first, capacity);
+			this->_capacities.erase (old_first);
+		}
+		this->_capacities [first] = grown;
+		record.first = first;
+		if (auto const it = this->_children.find ({ this->tree.device (record.device), record.inode }); it != this->_children.end ()) {
+			for (auto &[child_name, index]: it->second) {
+				index = first + (index - old_first);
+			}
+		}
+	}
+	auto const first = record.first;
+	record.count = count + 1;
+	
+	// Only name and info of the entry are used, so it needs no open handle.
+	static dir_handle const no_handle;
+	auto entry = stat_batch::entry (no_handle, name, DT_UNKNOWN);
+	entry.info = info;
+	auto const child = node_info::make (dir, entry, first + count, *this->policy, this->visited);
+	if (info.st_nlink > 1) {
+		this->note_uncounted_link (child.index ());
+	}
+	auto pending = child;
+	if (child.is_symlink ()) {
+		pending = child.as_link ().load_target (*this->policy, this->visited);
+	}
+	if (pending && pending.is_dir ()) {
+		this->defer_loading (pending.as_dir ());
+	}
+	this->register_subtree (child.index (), true);
+	if (auto const it = this->_children.find ({ this->tree.device (record.device), record.inode }); it != this->_children.end ()) {
+		it->second [child.name ()] = child.index ();
+	}
+	this->propagate (dir.index (), { static_cast <intmax_t> (child.size ()), static_cast <intmax_t> (child.allocated ()), static_cast <intmax_t> (child.files ()) });
+}
+
+void impl::watch_state::defer_loading (dir_info const &dir) {
+	if (!dir.is_within_boundaries (*this->policy) || !dir.visit (*this->policy, this->visited)) {
+		return;
+	}
+	auto const &record = this->tree [dir.index ()];
+	dir_key const key { this->tree.device (record.device), record.inode };
+	if (this->_unloaded.insert (key).second) {
+		this->_unloaded_order.push_back (key);
+	}
+}
+
+bool impl::watch_state::load_dirs (size_t entries_max) {
+	for (size_t entries = 0; (entries < entries_max) && !this->_unloaded_order.empty (); ) {
+		auto const key = this->_unloaded_order.front ();
+		this->_unloaded_order.pop_front ();
+		if (!this->_unloaded.erase (key)) {
+			continue;
+		}
+		if (auto const index = this->find_dir (key); index != node_tree::npos) {
+			entries += this->load_dir (dir_info (this->tree, index)) + 1;
+		}
+	}
+	return this->has_unloaded_dirs ();
+}
+
+size_t impl::watch_state::load_dir (dir_info const &dir) {
+	try {
+		auto const handle = dir_handle (dir.path ().c_str ());
+		// Watched since added, so entries created meanwhile are read here or reported later.
+		auto &batch = *this->_batch;
+		batch.clear ();
+		dir.enqueue_children (*this->policy, handle, batch);
+		batch.run ();
+		auto const subdirs = dir_info (dir).children_did_stat (*this->policy, this->visited, handle, batch.begin (), batch.end ());
+		auto child = this->tree [dir.index ()].first;
+		for (auto const &entry: batch) {
+			if (!dir_info::is_child_entry (*this->policy, entry)) {
+				continue;
+			}
+			if (!S_ISDIR (entry.info.st_mode) && (entry.info.st_nlink > 1)) {
+				this->note_uncounted_link (child);
+			}
+			child++;
+		}
+		for (auto subdir: subdirs) {
+			try {
+				// Entries typed as directories come without info of their own.
+				subdir.open ((subdir.parent () == dir) ? &handle : nullptr);
+			} catch (system_error const &) {
+				continue;
+			}
+			this->defer_loading (subdir);
+		}
+	} catch (system_error const &) {
+		return 0;
+	}
+	
+	node_info::delta delta {};
+	for (auto const child: dir.children ()) {
+		delta.size += static_cast <intmax_t> (child.size ());
+		delta.allocated += static_cast <intmax_t> (child.allocated ());
+		delta.files += static_cast <intmax_t> (child.files ());
+		this->register_subtree (child.index (), true);
+	}
+	this->propagate (dir.index (), delta);
+	return this->tree [dir.index ()].count;
+}
+
+void impl::watch_state::remove_child (dir_info const &dir, node_index child) {
+	auto const node = node_info (this->tree, child);
+	auto const delta = node_info::delta { -static_cast <intmax_t> (node.size ()), -static_cast <intmax_t> (node.allocated ()), -static_cast <intmax_t> (node.files ()) };
+	this->register_subtree (child, false);
+	this->release_subtree (child);
+	
+	auto &record = this->tree [dir.index ()];
+	auto const it = this->_children.find ({ this->tree.device (record.device), record.inode });
+	if (it != this->_children.end ()) {
+		it->second.erase (node.name ());
+	}
+	auto const capacity = this->capacity_of (record), last = record.first + record.count - 1;
+	if (child != last) {
+		this->move_record (last, child);
+		if (it != this->_children.end ()) {
+			it->second [node_info (this->tree, child).name ()] = child;
+		}
+	}
+	if (!--record.count) {
+		this->tree.release (record.first, capacity);
+		this->_capacities.erase (record.first);
+		record.first = node_tree::npos;
+	}
+	this->propagate (dir.index (), delta);
+}
+
+void impl::watch_state::release_subtree (node_index index) {
+	auto const &record = this->tree [index];
+	if (record.first == node_tree::npos) {
+		return;
+	}
+	switch (record.type) {
+	case node_type::dir:
+		for (uint32_t i = 0; i < record.count; i++) {
+			this->release_subtree (record.first + i);
+		}
+		this->tree.release (record.first, this->capacity_of (record));
+		this->_capacities.erase (record.first);
+		break;
+	case node_type::link:
+		this->release_subtree (record.first);
+		this->tree.release (record.first, 1);
+		break;
+	case node_type::file:
+		break;
+	}
+}
+
+uint32_t impl::watch_state::capacity_of (node_record const &record) const {
+	if (record.first == node_tree::npos) {
+		return 0;
+	}
+	auto const it = this->_capacities.find (record.first);
+	return (it != this->_capacities.end ()) ? it->second : record.count;
+}
+
+void impl::watch_state::move_record (node_index from, node_index to) {
+	auto &record = (this->tree [to] = this->tree [from]);
+	switch (record.type) {
+	case node_type::dir:
+		for (uint32_t i = 0; i < record.count; i++) {
+			this->tree [record.first + i].parent = to;
+		}
+		// Entries left behind by ordering children on demand are caught up as well.
+		if (auto const it = this->_dirs.find ({ this->tree.device (record.device), record.inode }); (it != this->_dirs.end ()) && ((it->second == from) || !this->is_dir_at (it->second, it->first))) {
+			it->second = to;
+		}
+		break;
+	case node_type::link:
+		if (record.first != node_tree::npos) {
+			this->tree [record.first].parent = to;
+		}
+		break;
+	case node_type::file:
+		break;
+	}
+}
+
+void impl::watch_state::register_subtree (node_index index, bool add) {
+	auto const node = node_info (this->tree, index);
+	auto const &record = this->tree [index];
+	if (record.type == node_type::link) {
+		if (record.first != node_tree::npos) {
+			this->register_subtree (record.first, add);
+		}
+		return;
+	}
+	// Entries reached through another path first are left empty; the loaded one stands for them.
+	if (!record.count && !record.total_size && ((record.type != node_type::dir) || !this->_unloaded.count ({ this->tree.device (record.device), record.inode }))) {
+		return;
+	}
+	if (add) {
+		// Further hard links to counted inodes are attributed the same way the builder did.
+		this->visited.insert (node.identifier ());
+	} else {
+		// Lets the same inode be counted again once it shows up elsewhere, e.g. after a rename.
+		this->visited.remove (node.identifier ());
+		if (dir_key const key { this->tree.device (record.device), record.inode }; (record.type == node_type::file) && this->_uncounted_links.count (key)) {
+			this->_orphaned_links.push_back (key);
+		}
+	}
+	if (record.type != node_type::dir) {
+		return;
+	}
+	
+	dir_key const key { this->tree.device (record.device), record.inode };
+	if (add) {
+		this->_dirs.insert_or_assign (key, index);
+		if (!this->uses_fanotify && !this->_watches_exhausted && !this->_watch_of.count (key)) {
+			uint32_t constexpr mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+			auto const watch = ::inotify_add_watch (this->notify_fd, node.path ().c_str (), mask);
+			if (watch != -1) {
+				this->_watches [watch] = key;
+				this->_watch_of [key] = watch;
+			} else if (errno == ENOSPC) {
+				// Out of fs.inotify.max_user_watches; the rest of the tree stays as scanned.
+				this->_watches_exhausted = true;
+			}
+		}
+	} else {
+		this->_dirs.erase (key);
+		this->_children.erase (key);
+		this->_unloaded.erase (key);
+		if (auto const it = this->_watch_of.find (key); it != this->_watch_of.end ()) {
+			::inotify_rm_watch (this->notify_fd, it->second);
+			this->_watches.erase (it->second);
+			this->_watch_of.erase (it);
+		}
+	}
+	for (uint32_t i = 0; i < record.count; i++) {
+		this->register_subtree (record.first + i, add);
+	}
+}
+
+void impl::watch_state::note_uncounted_links (node_index index) {
+	if (this->policy->hardlinks_policy () != attribution_policy::first_path) {
+		return;
+	}
+	auto const &record = this->tree [index];
+	switch (record.type) {
+	case node_type::dir:
+		for (uint32_t i = 0; i < record.count; i++) {
+			this->note_uncounted_links (record.first + i);
+		}
+		break;
+	case node_type::link:
+		if (record.first != node_tree::npos) {
+			this->note_uncounted_links (record.first);
+		}
+		break;
+	case node_type::file:
+		// Left empty by the scan either way; those of files counted elsewhere are the links.
+		if (!record.size && !record.allocated && this->visited.contains (node_info (this->tree, index).identifier ())) {
+			this->note_uncounted_link (index);
+		}
+		break;
+	}
+}
+
+void impl::watch_state::note_uncounted_link (node_index index) {
+	auto const &record = this->tree [index];
+	if ((this->policy->hardlinks_policy () != attribution_policy::first_path) || (record.type != node_type::file) || record.size || record.allocated) {
+		return;
+	}
+	// Targets of links are reached through those instead of by name.
+	if ((record.parent == node_tree::npos) || (this->tree [record.parent].type != node_type::dir)) {
+		return;
+	}
+	auto const &parent = this->tree [record.parent];
+	this->_uncounted_links [{ this->tree.device (record.device), record.inode }].emplace_back (dir_key { this->tree.device (parent.device), parent.inode }, record.name);
+}
+
+void impl::watch_state::count_orphaned_links () {
+	while (!this->_orphaned_links.empty ()) {
+		auto const key = this->_orphaned_links.back ();
+		this->_orphaned_links.pop_back ();
+		// Counted again meanwhile, e.g. when renamed.
+		while (!this->visited.contains (node_info::id (key.first, key.second))) {
+			auto const it = this->_uncounted_links.find (key);
+			if (it == this->_uncounted_links.end ()) {
+				break;
+			}
+			if (it->second.empty ()) {
+				this->_uncounted_links.erase (it);
+				break;
+			}
+			auto const [parent, name_index] = it->second.back ();
+			it->second.pop_back ();
+			
+			// Paths are checked only now, as links may have been removed or replaced since.
+			auto const index = this->find_dir (parent);
+			if ((index == node_tree::npos) || this->_unloaded.count (parent)) {
+				continue;
+			}
+			auto const dir = dir_info (this->tree, index);
+			auto const name = string (this->tree.name (name_index));
+			auto const child = this->find_child (dir, name);
+			if ((child == node_tree::npos) || node_info (this->tree, child).is_dir ()) {
+				continue;
+			}
+			struct ::stat info;
+			if (::fstatat (AT_FDCWD, (dir.path () / name).c_str (), &info, AT_SYMLINK_NOFOLLOW) || (info.st_dev != key.first) || (info.st_ino != key.second)) {
+				continue;
+			}
+			// Added anew, the entry is the first path to the file and so counted in full.
+			this->remove_child (dir, child);
+			this->add_child (dir, name, info);
+		}
+	}
+}
+
+void impl::watch_state::propagate (node_index dir, node_info::delta const &delta) {
+	this->tree [dir].sorted = 0;
+	for (auto index = dir, child = node_tree::npos; index != node_tree::npos; child = index, index = this->tree [index].parent) {
+		auto &record = this->tree [index];
+		if (record.type == node_type::dir) {
+			record.total_size += static_cast <uint64_t> (delta.size);
+			record.total_allocated += static_cast <uint64_t> (delta.allocated);
+			record.total_files += static_cast <uint32_t> (delta.files);
+			if (child != node_tree::npos) {
+				this->keep_ordered (index, child, (record.sorted_by == size_metric::allocated) ? delta.allocated : delta.size);
+			}
+		}
+	}
+}
+
+void impl::watch_state::keep_ordered (node_index dir, node_index child, intmax_t delta) {
+	auto &record = this->tree [dir];
+	auto const position = child - record.first;
+	if (!delta || (position >= record.count)) {
+		return;
+	}
+	auto const size_at = [this, &record] (uint32_t position) {
+		return node_info (this->tree, record.first + position).size (record.sorted_by);
+	};
+	if (delta < 0) {
+		// Ordered children past it may be larger now, as may any of the rest when it was the last ordered one.
+		if ((position < record.sorted) && ((position + 1 == record.sorted) || (size_at (position + 1) > size_at (position)))) {
+			record.sorted = position;
+		}
+		return;
+	}
+	// Only ordered children before it that are now smaller stop being ordered.
+	auto const limit = min (position, record.sorted);
+	auto const size = size_at (position);
+	auto ordered = limit;
+	while (ordered && (size_at (ordered - 1) < size)) {
+		ordered--;
+	}
+	if (ordered < limit) {
+		record.sorted = ordered;
+	}
+}
+
+node_index impl::watch_state::find_dir (dir_key const &key) {
+	auto const it = this->_dirs.find (key);
+	if (it == this->_dirs.end ()) {
+		return node_tree::npos;
+	}
+	if (this->is_dir_at (it->second, key)) {
+		return it->second;
+	}
+	
+	// Ordering children on demand moves them only within the range of their parent, so the stale index still points into it.
+	if (it->second < this->tree.size ()) {
+		if (auto const parent = this->tree [it->second].parent; (parent != node_tree::npos) && (this->tree [parent].type == node_type::dir)) {
+			auto const &record = this->tree [parent];
+			for (auto index = record.first; index - record.first < record.count; index++) {
+				auto const &child = this->tree [index];
+				if (child.type != node_type::dir) {
+					continue;
+				}
+				// Siblings were moved along with it; entries found elsewhere belong to other paths to the same directory.
+				if (auto const sibling = this->_dirs.find ({ this->tree.device (child.device), child.inode }); (sibling != this->_dirs.end ()) && (sibling->second - record.first < record.count)) {
+					sibling->second = index;
+				}
+			}
+		}
+		if (this->is_dir_at (it->second, key)) {
+			return it->second;
+		}
+	}
+	
+	// Not expected to happen; finding every directory anew is slow but always right.
+	this->_dirs.clear ();
+	this->register_dirs ();
+	auto const found = this->_dirs.find (key);
+	return (found != this->_dirs.end ()) ? found->second : node_tree::npos;
+}
+
+bool impl::watch_state::is_dir_at (node_index index, dir_key const &key) const {
+	if (index >= this->tree.size ()) {
+		return false;
+	}
+	auto const &record = this->tree [index];
+	return (record.type == node_type::dir) && (dir_key { this->tree.device (record.device), record.inode } == key);
+}
+
+node_index impl::watch_state::find_child (dir_info const &dir, string_view name) {
+	auto const &record = this->tree [dir.index ()];
+	auto &children = this->_children [{ this->tree.device (record.device), record.inode }];
+	auto const is_child = [this, &record, &dir, name] (node_index index) {
+		return (index >= record.first) && (index - record.first < record.count) && (this->tree [index].parent == dir.index ()) && (node_info (this->tree, index).name () == name);
+	};
+	auto it = children.find (name);
+	if ((children.size () == record.count) && ((it == children.end ()) || is_child (it->second))) {
+		return (it != children.end ()) ? it->second : node_tree::npos;
+	}
+	
+	children.clear ();
+	for (auto const child: dir.children ()) {
+		children [child.name ()] = child.index ();
+	}
+	it = children.find (name);
+	return (it != children.end ()) ? it->second : node_tree::npos;
+}
+
+#else
+
+bool impl::tree_watcher::start (dispatcher_t const &, callback_t const &) {
+	return false;
+}
+
+void impl::tree_watcher::stop () {}
+
+impl::watch_state::~watch_state () {}
+
+#endif
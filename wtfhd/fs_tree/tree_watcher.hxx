@@ -0,0 +1,42 @@
+//
+//  tree_watcher.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/27/20.
+//
+
+#ifndef tree_watcher_hxx
+#define tree_watcher_hxx
+
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include "misc_types.hxx"
+#include "node_info.hxx"
+
+namespace fs {
+	class children_policy;
+	
+	// Keeps a finished tree up to date with filesystem changes: creates, deletes and size changes of its entries.
+	// Uses fanotify reporting directory handles and names where permitted, per-directory inotify watches otherwise.
+	class tree_watcher {
+	public:
+		// Runs a callback on the thread owning the tree, e.g. through run_loop::add_pending_callback_invocation.
+		typedef std::function <void (util::callback_t const &)> dispatcher_t;
+		
+		static std::unique_ptr <tree_watcher> make_unique (node_tree &tree, std::vector <node_info> const &roots, std::unique_ptr <children_policy const> &&policy);
+		virtual ~tree_watcher () = default;
+		
+		// Name of the notification mechanism in use, or nullptr before start or if none is available.
+		virtual char const *backend () const = 0;
+		
+		// Changes are applied to the tree only from callbacks passed to dispatch, each one followed by did_update.
+		// Directories created or moved in are read a bounded number of entries per callback, so their totals grow over several updates.
+		// Totals of ancestors of changed entries are kept exact; children of changed directories, and of ancestors whose order a change breaks, are left to be ordered again on demand.
+		virtual bool start (dispatcher_t const &dispatch, util::callback_t const &did_update) = 0;
+		virtual void stop () = 0;
+	};
+}
+
+#endif /* tree_watcher_hxx */
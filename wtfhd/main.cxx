@@ -5,9 +5,20 @@
 //  Created by Kirill Bystrov on 7/19/20.
 //
 
+#include <tuple>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <fstream>
+#include <cinttypes>
+#include <optional>
 #include <iostream>
+#include <unistd.h>
 
 #include "node_info.hxx"
+#include "snapshot.hxx"
+#include "tree_builder.hxx"
+#include "tree_report.hxx"
 #include "children_policy.hxx"
 
 #include "main_window.hxx"
@@ -17,22 +28,341 @@ using namespace fs;
 using namespace ui;
 using namespace std;
 
-int main (int argc, const char *argv []) {
-	vector <filesystem::path> roots (argv + 1, argv + argc);
-	if (roots.empty ()) {
-		roots.emplace_back (filesystem::current_path ());
+static void print_usage (char const *argv0) {
+	cerr << "Usage: " << argv0 << " [-j jobs] [-q io_queue_depth] [-a first|split] [-b ignore|cross|stay] [-H min_size] [-x|-X|-i pattern ...] [-u snapshot] [-w snapshot] [-S stats] [-l syscalls[:dirs]] [-L latency_ms] [-n] [-m] [-p] [path ...]" << endl;
+	cerr << "       " << argv0 << " -o ndjson|csv|du [-k apparent|allocated] [-d max_depth] [-s min_size[K|M|G|T]] [-H min_size] [-x|-X|-i pattern ...] [-j jobs] [-q io_queue_depth] [-a first|split] [-b ignore|cross|stay] [-u snapshot] [-w snapshot] [-S stats] [-l syscalls[:dirs]] [-L latency_ms] [-n] [path ...]" << endl;
+	cerr << "       " << argv0 << " -r snapshot" << endl;
+	cerr << "-a split charges every hard link an equal share of the file, counting links outside the scanned paths too; -a first charges the first path met with all of it." << endl;
+	cerr << "Every device crossed into gets its own jobs unless -b ignore is given; -b stay does not cross mount points." << endl;
+	cerr << "Patterns match entry names: -x excludes entries, -X excludes directories, -i includes entries; the first matching one applies." << endl;
+	cerr << "-p shows directories while they are scanned, largest first so far, and scans those browsed into first." << endl;
+	cerr << "-l limits syscalls and directories read per second, 0 meaning no limit; -L slows syscalls down while stat calls take longer than latency_ms." << endl;
+	cerr << "-n runs the scan at idle CPU and I/O priority. In the progress window, - halves limits, + doubles them and 0 lifts them." << endl;
+	cerr << "-S writes counters, stat latencies and time spent in every phase of the scan to stats as JSON once done." << endl;
+}
+
+static optional <uintmax_t> parse_size (char const *str) {
+	char *end;
+	errno = 0;
+	auto result = strtoumax (str, &end, 10);
+	if (errno || (end == str)) {
+		return nullopt;
+	}
+	if (!*end) {
+		return result;
+	}
+	auto const unit = "KMGT"sv.find (*end);
+	if ((unit == string_view::npos) || end [1]) {
+		return nullopt;
+	}
+	return result << (10 * (unit + 1));
+}
+
+static optional <size_t> parse_count (char const *str) {
+	char *end;
+	errno = 0;
+	auto const result = strtoul (str, &end, 10);
+	if (errno || (end == str) || *end || (*str == '-')) {
+		return nullopt;
+	}
+	return result;
+}
+
+static optional <double> parse_rate (char const *str) {
+	char *end;
+	errno = 0;
+	auto const result = strtod (str, &end);
+	if (errno || (end == str) || *end || !(result >= 0.0)) {
+		return nullopt;
 	}
+	return result;
+}
+
+// Takes syscalls[:dirs], either of them possibly 0.
+static optional <pair <double, double>> parse_limits (string const &str) {
+	auto const separator = str.find (':');
+	auto const syscalls = parse_rate (str.substr (0, separator).c_str ());
+	auto const dirs = (separator != string::npos) ? parse_rate (str.substr (separator + 1).c_str ()) : 0.0;
+	if (!syscalls || !dirs) {
+		return nullopt;
+	}
+	return pair (*syscalls, *dirs);
+}
+
+static bool write_stats (tree_builder const &builder, filesystem::path const &stats_path) {
+	ofstream output (stats_path);
+	builder.stats ().write_json (output);
+	if (!output) {
+		cerr << stats_path.native () << ": cannot write scan stats" << endl;
+		return false;
+	}
+	return true;
+}
+
+// Scans without the UI, writing every directory to standard output once its subtree is complete.
+static int run_report (tree_builder &builder, tree_report &report, filesystem::path const &write_path, filesystem::path const &stats_path) {
+	builder.set_subtree_callback ([&builder, &report] (dir_info const &dir, size_t depth) {
+		report.add_node (dir, depth, builder.histogram (dir).get ());
+	});
+	// Directories are not looked at again once reported, unless the whole tree is saved.
+	builder.set_discards_subtrees (write_path.empty ());
+	promise <void> done;
+	builder.start ([&done] { done.set_value (); });
+	done.get_future ().wait ();
 	
-	auto policy = children_policy::make_unique ();
-	policy->set_fs_boundaries_policy (boundaries_policy::transparent);
-	for (auto &path: roots) {
-		policy->add_root (path);
+	// Directories were reported while loading, which leaves roots which are files.
+	for (auto const &root: builder.roots ()) {
+		auto const target = root.is_symlink () ? root.as_link ().target () : root;
+		if (!(target && target.is_dir ())) {
+			report.add_node (root, 0);
+		}
+	}
+	report.flush ();
+	if (!stats_path.empty () && !write_stats (builder, stats_path)) {
+		return EXIT_FAILURE;
+	}
+	if (!builder.success ()) {
+		cerr << "Scan failed" << endl;
+		return EXIT_FAILURE;
+	}
+	if (!write_path.empty ()) {
+		try {
+			snapshot::write (write_path, builder.tree (), builder.roots ());
+		} catch (system_error const &e) {
+			cerr << write_path.native () << ": " << e.code ().message () << endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+static shared_ptr <snapshot> open_snapshot (filesystem::path const &path) {
+	try {
+		return snapshot::open (path);
+	} catch (system_error const &e) {
+		cerr << path.native () << ": " << e.code ().message () << endl;
+	} catch (exception const &e) {
+		cerr << path.native () << ": " << e.what () << endl;
+	}
+	return nullptr;
+}
+
+int main (int argc, char *const argv []) {
+	size_t concurrency = 0, io_queue_depth = 0;
+	auto hardlinks_policy = attribution_policy::first_path;
+	optional <boundaries_policy> fs_boundaries_policy;
+	filesystem::path read_path, write_path, stats_path;
+	bool browse_snapshot = false, watch = false, progressive = false, low_priority = false;
+	scan_limits limits;
+	optional <tree_report::format> report_format;
+	optional <size_t> max_depth;
+	uintmax_t min_size = 0;
+	optional <uintmax_t> histograms_threshold;
+	vector <pair <entry_rule, string>> rules;
+	auto metric = size_metric::apparent;
+	for (int option; (option = ::getopt (argc, argv, "j:q:a:b:r:u:w:S:l:L:nmpo:k:d:s:H:x:X:i:")) != -1; ) {
+		switch (option) {
+		case 'j':
+			if (auto const count = parse_count (optarg); count && *count) {
+				concurrency = *count;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			if (auto const count = parse_count (optarg)) {
+				io_queue_depth = min (*count, stat_batch::max_queue_depth);
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			if (optarg == "first"sv) {
+				hardlinks_policy = attribution_policy::first_path;
+			} else if (optarg == "split"sv) {
+				hardlinks_policy = attribution_policy::split;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			if (optarg == "ignore"sv) {
+				fs_boundaries_policy = boundaries_policy::ignore;
+			} else if (optarg == "cross"sv) {
+				fs_boundaries_policy = boundaries_policy::transparent;
+			} else if (optarg == "stay"sv) {
+				fs_boundaries_policy = boundaries_policy::stay_within;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+		case 'u':
+			read_path = optarg;
+			browse_snapshot = (option == 'r');
+			break;
+		case 'w':
+			write_path = optarg;
+			break;
+		case 'S':
+			stats_path = optarg;
+			break;
+		case 'l':
+			if (auto const parsed = parse_limits (optarg)) {
+				tie (limits.syscalls, limits.dirs) = *parsed;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'L':
+			if (auto const milliseconds = parse_rate (optarg)) {
+				limits.latency_threshold = chrono::duration_cast <chrono::nanoseconds> (chrono::duration <double, milli> (*milliseconds));
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			low_priority = true;
+			break;
+		case 'm':
+			watch = true;
+			break;
+		case 'p':
+			progressive = true;
+			break;
+		case 'o':
+			if (optarg == "ndjson"sv) {
+				report_format = tree_report::format::ndjson;
+			} else if (optarg == "csv"sv) {
+				report_format = tree_report::format::csv;
+			} else if (optarg == "du"sv) {
+				report_format = tree_report::format::du;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'k':
+			if (optarg == "apparent"sv) {
+				metric = size_metric::apparent;
+			} else if (optarg == "allocated"sv) {
+				metric = size_metric::allocated;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (!(max_depth = parse_count (optarg))) {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (auto const size = parse_size (optarg)) {
+				min_size = *size;
+			} else {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'x':
+			rules.emplace_back (entry_rule::exclude, optarg);
+			break;
+		case 'X':
+			rules.emplace_back (entry_rule::exclude_dir, optarg);
+			break;
+		case 'i':
+			rules.emplace_back (entry_rule::include, optarg);
+			break;
+		case 'H':
+			if (!(histograms_threshold = parse_size (optarg))) {
+				print_usage (argv [0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			print_usage (argv [0]);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	shared_ptr <snapshot> loaded;
+	if (!read_path.empty () && !(loaded = open_snapshot (read_path))) {
+		return EXIT_FAILURE;
 	}
 	
-	ui::screen::shared ()->make_root <main_window> (policy->copy ());
+	if ((report_format && (browse_snapshot || watch || progressive)) || (!report_format && (max_depth || min_size || (metric != size_metric::apparent)))) {
+		print_usage (argv [0]);
+		return EXIT_FAILURE;
+	}
+	
+	shared_ptr <tree_builder> builder;
+	if (browse_snapshot) {
+		if ((optind != argc) || !write_path.empty () || !stats_path.empty () || watch || progressive || low_priority || limits.syscalls || limits.dirs || limits.latency_threshold.count () || histograms_threshold || fs_boundaries_policy || !rules.empty ()) {
+			print_usage (argv [0]);
+			return EXIT_FAILURE;
+		}
+		ui::screen::shared ()->make_root <main_window> (loaded);
+	} else {
+		vector <filesystem::path> roots (argv + optind, argv + argc);
+		if (roots.empty () && loaded) {
+			for (auto const &root: loaded->roots ()) {
+				roots.emplace_back (root.name ());
+			}
+		}
+		if (roots.empty ()) {
+			roots.emplace_back (filesystem::current_path ());
+		}
+		
+		auto policy = children_policy::make_unique ();
+		policy->set_fs_boundaries_policy (fs_boundaries_policy.value_or (boundaries_policy::transparent));
+		policy->set_hardlinks_policy (hardlinks_policy);
+		for (auto &path: roots) {
+			policy->add_root (path);
+		}
+		for (auto const &[rule, pattern]: rules) {
+			policy->add_rule (rule, pattern);
+		}
+		
+		builder = tree_builder::make_unique (policy->copy ());
+		builder->set_concurrency (concurrency);
+		builder->set_io_queue_depth (io_queue_depth);
+		builder->set_progressive (progressive);
+		builder->set_limits (limits);
+		builder->set_low_priority (low_priority);
+		if (histograms_threshold) {
+			builder->set_histograms_threshold (*histograms_threshold);
+		}
+		if (loaded) {
+			builder->set_baseline (shared_ptr <node_tree const> (loaded, &loaded->tree ()), loaded->roots ());
+		}
+		if (report_format) {
+			ios::sync_with_stdio (false);
+			auto const report = tree_report::make_unique (*report_format, cout);
+			if (max_depth) {
+				report->set_max_depth (*max_depth);
+			}
+			report->set_min_size (min_size);
+			report->set_metric (metric);
+			return run_report (*builder, *report, write_path, stats_path);
+		}
+		ui::screen::shared ()->make_root <main_window> (builder, write_path, watch);
+	}
 
 	try {
-		return ui::main ();
+		auto const rc = ui::main ();
+		// Scans cancelled by quitting are written as far as they went.
+		if (builder && builder->started () && !stats_path.empty () && !write_stats (*builder, stats_path)) {
+			return EXIT_FAILURE;
+		}
+		return rc;
 	} catch (system_error const &e) {
 		auto const &code = e.code ();
 		cerr << "Unhandled " << code.category ().name () << " error: " << code.message () << " (" << code.value () << ")" << endl;
@@ -8,6 +8,7 @@
 #include "event_source.hxx"
 
 #include <algorithm>
+#include <unistd.h>
 #include <ncurses.h>
 
 using namespace ui;
@@ -96,7 +97,11 @@ void mouse::process_event (time_point const &now) {
 }
 
 mouse::duration mouse::next_event_interval (const time_point &now) const {
-	return milliseconds (mouseinterval (-1));
+	return duration::max ();
+}
+
+int mouse::descriptor () const {
+	return STDIN_FILENO;
 }
 
 bool keyboard::has_event (time_point const &now) const {
@@ -121,7 +126,11 @@ void keyboard::process_event (time_point const &now) {
 }
 
 keyboard::duration keyboard::next_event_interval (const time_point &now) const {
-	return 50ms;
+	return duration::max ();
+}
+
+int keyboard::descriptor () const {
+	return STDIN_FILENO;
 }
 
 bool run_loop_idle::has_event (time_point const &now) const {
@@ -134,5 +143,5 @@ void run_loop_idle::process_event (time_point const &now) {
 }
 
 run_loop_idle::duration run_loop_idle::next_event_interval (const time_point &now) const {
-	return duration::zero ();
+	return duration::max ();
 }
@@ -206,6 +206,7 @@ public:
 	virtual bool has_event (time_point const &now) const override;
 	virtual void process_event (time_point const &now) override;
 	virtual duration next_event_interval (time_point const &now) const override;
+	virtual int descriptor () const override;
 	
 protected:
 	virtual void activate () override;
@@ -222,8 +223,10 @@ public:
 	virtual bool has_event (time_point const &now) const override;
 	virtual void process_event (time_point const &now) override;
 	virtual duration next_event_interval (time_point const &now) const override;
+	virtual int descriptor () const override;
 };
 
+// Invoked once on every wake-up of the run loop, after other sources; does not wake it by itself.
 class ui::run_loop_idle: public event_source::impl <ui::run_loop_idle> {
 public:
 	typedef std::function <void (void)> handler_type;
@@ -7,7 +7,15 @@
 
 #include "main_window.hxx"
 
+#include <algorithm>
+#include <ncurses.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include "snapshot.hxx"
 #include "tree_builder.hxx"
+#include "tree_watcher.hxx"
+#include "subtree_histogram.hxx"
 #include "progress_window.hxx"
 
 using namespace fs;
@@ -16,17 +24,417 @@ using namespace std;
 using namespace chrono;
 using namespace chrono_literals;
 
-main_window::main_window (unique_ptr <children_policy const> &&policy):
-	window (), _builder { tree_builder::make_unique (forward <unique_ptr <children_policy const>> (policy)) } {}
+static string format_size (uintmax_t size) {
+	static char const *const units [] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB" };
+	auto value = static_cast <double> (size);
+	size_t unit = 0;
+	for (; (value >= 1024.0) && (unit + 1 < extent_v <decltype (units)>); unit++) {
+		value /= 1024.0;
+	}
+	char buffer [16];
+	if (unit) {
+		snprintf (buffer, sizeof (buffer), "%7.1f %-3s", value, units [unit]);
+	} else {
+		snprintf (buffer, sizeof (buffer), "%7ju %-3s", size, units [unit]);
+	}
+	return buffer;
+}
+
+static vector <string> describe_histogram (subtree_histogram const &histogram, size_metric metric) {
+	auto const size_of = [metric] (subtree_histogram::bucket const &bucket) {
+		return (metric == size_metric::allocated) ? bucket.allocated : bucket.size;
+	};
+	auto const line = [&size_of] (subtree_histogram::bucket const &bucket, string const &name) {
+		return "  " + format_size (size_of (bucket)) + "  " + name + " (" + to_string (bucket.files) + " files)";
+	};
+	auto const describe_keys = [&line] (vector <string> &lines, subtree_histogram::keyed_buckets const &buckets, auto const &name_of) {
+		for (auto const &bucket: buckets.sorted ()) {
+			lines.push_back (line (bucket, (bucket.key == subtree_histogram::unknown) ? string ("unknown") : name_of (bucket.key)));
+		}
+		if (buckets.other ().files) {
+			lines.push_back (line (buckets.other (), "others"));
+		}
+	};
+	
+	vector <string> lines { "Owners" };
+	describe_keys (lines, histogram.owners (), [] (uint64_t key) {
+		auto const user = ::getpwuid (static_cast <uid_t> (key));
+		return user ? string (user->pw_name) : to_string (key);
+	});
+	lines.push_back ("Groups");
+	describe_keys (lines, histogram.groups (), [] (uint64_t key) {
+		auto const group = ::getgrgid (static_cast <gid_t> (key));
+		return group ? string (group->gr_name) : to_string (key);
+	});
+	lines.push_back ("Extensions");
+	describe_keys (lines, histogram.extensions (), [] (uint64_t key) {
+		return "." + subtree_histogram::extension_name (key);
+	});
+	lines.push_back ("Modified within");
+	for (size_t i = 0; i < subtree_histogram::ages_count; i++) {
+		lines.push_back (line (histogram.ages () [i], subtree_histogram::age_name (i)));
+	}
+	return lines;
+}
+
+namespace {
+	// Holds off workers of a progressive scan while the tree is looked at.
+	class tree_guard {
+	public:
+		tree_guard (shared_ptr <tree_builder> const &builder): _builder ((builder && builder->progressive ()) ? builder.get () : nullptr) {
+			if (this->_builder) {
+				this->_builder->lock_tree ();
+			}
+		}
+		
+		tree_guard (tree_guard const &) = delete;
+		tree_guard &operator = (tree_guard const &) = delete;
+		
+		~tree_guard () {
+			if (this->_builder) {
+				this->_builder->unlock_tree ();
+			}
+		}
+		
+	private:
+		tree_builder *const _builder;
+	};
+}
+
+main_window::main_window (shared_ptr <tree_builder> builder, filesystem::path snapshot_path, bool watch): window (), _builder (builder), _snapshot_path (std::move (snapshot_path)), _watch (watch), _metric (size_metric::apparent), _show_histogram (), _quitting () {}
+
+main_window::main_window (shared_ptr <fs::snapshot> snapshot): window (), _snapshot (snapshot), _watch (), _metric (size_metric::apparent), _show_histogram (), _quitting () {}
+
+main_window::~main_window () = default;
 
 void main_window::window_did_appear () {
 	window::window_did_appear ();
 	
-	if (this->_builder->ready ()) {
-		this->println (this->_builder->success () ? "Builder finished" : "Builder failed");
-		this->refresh ();
-		this->add_timer (1s, std::bind (ui::exit, 0));
+	if (!this->_locations.empty ()) {
+		tree_guard guard (this->_builder);
+		if (this->is_scanning ()) {
+			this->relocate ();
+		}
+		this->redraw ();
+	} else if (this->_snapshot) {
+		this->start_browsing ("Snapshot loaded");
+	} else if (this->_builder->progressive ()) {
+		if (!this->_builder->started ()) {
+			this->start_scanning ();
+		}
+	} else if (this->_builder->ready ()) {
+		if (!this->_builder->success ()) {
+			this->println ("Builder failed");
+			this->refresh ();
+			this->add_timer (1s, std::bind (ui::exit, 0));
+			return;
+		}
+		
+		this->start_browsing (this->builder_did_finish ());
+		if (this->_watch) {
+			this->start_watching ();
+		}
 	} else {
 		this->push <progress_window> (this->_builder);
 	}
 }
+
+string main_window::builder_did_finish () {
+	if (this->_snapshot_path.empty ()) {
+		return "Builder finished";
+	}
+	try {
+		snapshot::write (this->_snapshot_path, this->_builder->tree (), this->_builder->roots ());
+		return "Snapshot saved to " + this->_snapshot_path.native ();
+	} catch (system_error const &e) {
+		return "Snapshot not saved: " + e.code ().message ();
+	}
+}
+
+void main_window::start_scanning () {
+	this->_builder->add_progress_callback ([this] {
+		this->invoke_coalesced_callback (reinterpret_cast <util::callback_id_t> (this), &main_window::scan_did_progress, this);
+	});
+	this->_builder->start ([this] {
+		this->invoke_callback (&main_window::scan_did_finish, this);
+	});
+	this->println ("Listing roots");
+	this->refresh ();
+}
+
+void main_window::scan_did_progress () {
+	if (this->_builder->ready ()) {
+		return;
+	}
+	auto const progress = this->_builder->progress ();
+	auto const remaining = progress.remaining_time ();
+	auto status = "Scanning: " + progress.percents () + (remaining.empty () ? string () : ", about " + remaining + " left");
+	
+	tree_guard guard (this->_builder);
+	if (this->_locations.empty ()) {
+		this->clear ();
+		return this->start_browsing (std::move (status));
+	}
+	this->_status = std::move (status);
+	this->relocate ();
+	this->redraw ();
+}
+
+void main_window::scan_did_finish () {
+	if (this->_quitting) {
+		return ui::exit (0);
+	}
+	auto status = this->_builder->success () ? this->builder_did_finish () : string ("Builder failed");
+	if (this->_locations.empty ()) {
+		this->clear ();
+		this->start_browsing (std::move (status));
+	} else {
+		this->_status = std::move (status);
+		this->relocate ();
+		this->redraw ();
+	}
+	if (this->_watch && this->_builder->success ()) {
+		this->start_watching ();
+	}
+}
+
+bool main_window::is_scanning () const {
+	return this->_builder && this->_builder->progressive () && !this->_builder->ready ();
+}
+
+vector <node_info> const &main_window::roots () const {
+	return this->_snapshot ? this->_snapshot->roots () : this->_builder->roots ();
+}
+
+size_t main_window::entries_count () const {
+	auto const &dir = this->_locations.back ().dir;
+	return dir ? dir.children_count () : this->roots ().size ();
+}
+
+node_info main_window::entry (size_t index) const {
+	auto const &dir = this->_locations.back ().dir;
+	if (dir && (index < this->_order.size ())) {
+		return dir.child (this->_order [index]);
+	}
+	return dir ? dir.child (index) : this->roots () [index];
+}
+
+void main_window::start_browsing (string status) {
+	this->_status = std::move (status);
+	this->_locations.push_back ({ {}, {}, 0, 0 });
+	if (this->roots ().size () == 1) {
+		this->enter_selected ();
+	}
+	
+	auto const handler = [this] (auto const &action) {
+		return [this, action] (int) {
+			tree_guard guard (this->_builder);
+			// Directories shown may have moved since the last progress update.
+			if (this->is_scanning ()) {
+				this->relocate ();
+			}
+			action ();
+			this->redraw ();
+		};
+	};
+	this->add_key_handler ('q', [this] (int) {
+		// Workers must stop before the tree goes away.
+		if (this->is_scanning ()) {
+			this->_quitting = true;
+			this->_status = "Stopping";
+			this->redraw ();
+			return this->_builder->cancel ();
+		}
+		ui::exit (0);
+	});
+	this->add_key_handler ('a', handler ([this] {
+		this->_metric = (this->_metric == size_metric::apparent) ? size_metric::allocated : size_metric::apparent;
+	}));
+	this->add_key_handler ('h', handler ([this] { this->_show_histogram = !this->_show_histogram; }));
+	this->add_key_handler (KEY_UP, handler ([this] { this->move_selection (-1); }));
+	this->add_key_handler (KEY_DOWN, handler ([this] { this->move_selection (1); }));
+	this->add_key_handler (KEY_PPAGE, handler ([this] { this->move_selection (-max (this->frame ().height - 4, 1)); }));
+	this->add_key_handler (KEY_NPAGE, handler ([this] { this->move_selection (max (this->frame ().height - 4, 1)); }));
+	this->add_key_handler (KEY_HOME, handler ([this] { this->move_selection (-static_cast <ptrdiff_t> (this->entries_count ())); }));
+	this->add_key_handler (KEY_END, handler ([this] { this->move_selection (static_cast <ptrdiff_t> (this->entries_count ())); }));
+	for (auto const key: { KEY_RIGHT, KEY_ENTER, int ('\r'), int ('\n') }) {
+		this->add_key_handler (key, handler ([this] { this->enter_selected (); }));
+	}
+	for (auto const key: { KEY_LEFT, KEY_BACKSPACE, 127 }) {
+		this->add_key_handler (key, handler ([this] { this->leave_dir (); }));
+	}
+	this->add_key_handler (KEY_RESIZE, handler ([this] { this->resize_to_screen (); }));
+	this->redraw ();
+}
+
+void main_window::start_watching () {
+	this->_watcher = tree_watcher::make_unique (this->_builder->tree (), this->_builder->roots (), this->_builder->policy ().copy ());
+	auto const dispatch = [this] (util::callback_t const &callback) {
+		this->invoke_callback (callback);
+	};
+	auto const did_update = [this] {
+		this->relocate ();
+		this->redraw ();
+	};
+	
+	if (this->_watcher->start (dispatch, did_update)) {
+		this->_status = string ("Watching changes with ") + this->_watcher->backend ();
+	} else {
+		this->_watcher.reset ();
+		this->_status = "Watching changes is not supported";
+	}
+	this->redraw ();
+}
+
+void main_window::redraw () {
+	auto const height = this->frame ().height - 2;
+	auto const rows = max (height - 2, 0);
+	auto &current = this->_locations.back ();
+	auto const count = this->entries_count ();
+	if (current.selected < current.offset) {
+		current.offset = current.selected;
+	} else if (rows && (current.selected >= current.offset + static_cast <size_t> (rows))) {
+		current.offset = current.selected - static_cast <size_t> (rows) + 1;
+	}
+	if (current.dir && current.dir.is_loading ()) {
+		// Records of a directory still loading must stay where workers put them, so only the positions of its largest children are ordered.
+		auto const limit = min (current.offset + static_cast <size_t> (rows), count);
+		order_key const key { current.dir.index (), count, current.dir.files (), limit, current.dir.size (this->_metric), this->_metric };
+		// Sizes of children add up to the totals of the directory, so the order holds while they stay the same.
+		if (this->_ordered_for != key) {
+			vector <pair <uintmax_t, size_t>> sizes;
+			sizes.reserve (count);
+			for (size_t i = 0; i < count; i++) {
+				sizes.emplace_back (current.dir.child (i).size (this->_metric), i);
+			}
+			auto const larger = [] (pair <uintmax_t, size_t> const &lhs, pair <uintmax_t, size_t> const &rhs) {
+				return (lhs.first > rhs.first) || ((lhs.first == rhs.first) && (lhs.second < rhs.second));
+			};
+			partial_sort (sizes.begin (), sizes.begin () + static_cast <ptrdiff_t> (limit), sizes.end (), larger);
+			this->_order.clear ();
+			for (size_t i = 0; i < limit; i++) {
+				this->_order.push_back (sizes [i].second);
+			}
+			this->_ordered_for = key;
+		}
+	} else {
+		this->_order.clear ();
+		this->_ordered_for.reset ();
+		// Children are kept ordered only as far as they have been looked at.
+		if (current.dir) {
+			current.dir.order_children (current.offset + static_cast <size_t> (rows), this->_metric);
+		}
+	}
+	
+	uintmax_t total = 0;
+	size_t files = 0;
+	if (current.dir) {
+		total = current.dir.size (this->_metric);
+		files = current.dir.files ();
+	} else {
+		for (auto const &root: this->roots ()) {
+			total += root.size (this->_metric);
+			files += root.files ();
+		}
+	}
+	auto const metric = (this->_metric == size_metric::allocated) ? "allocated" : "apparent";
+	auto const counting = current.dir ? current.dir.is_loading () : this->is_scanning ();
+	this->draw_row (0, format_size (total) + "  " + (current.dir ? current.dir.path ().native () : string ("Roots")) + "  (" + to_string (files) + " files, " + metric + " size" + (counting ? ", still counting)" : ")"));
+	if (auto const histogram = (this->_show_histogram && current.dir && this->_builder) ? this->_builder->histogram (current.dir) : nullptr) {
+		auto const lines = describe_histogram (*histogram, this->_metric);
+		for (int row = 0; row < rows; row++) {
+			this->draw_row (row + 1, (static_cast <size_t> (row) < lines.size ()) ? lines [static_cast <size_t> (row)] : string ());
+		}
+		this->draw_row (height - 1, this->_status + " | h: back to list, a: apparent/allocated, q: quit");
+		return this->refresh ();
+	}
+	for (int row = 0; row < rows; row++) {
+		auto const index = current.offset + static_cast <size_t> (row);
+		if (index >= count) {
+			this->draw_row (row + 1, {});
+			continue;
+		}
+		auto const node = this->entry (index);
+		auto text = format_size (node.size (this->_metric)) + "  " + string (node.name ());
+		auto const target = node.is_symlink () ? node.as_link ().target () : node;
+		if (node.is_dir ()) {
+			text += '/';
+		} else if (node.is_symlink ()) {
+			text += '@';
+		}
+		if (target && target.is_dir () && target.as_dir ().is_loading ()) {
+			text += "  (still counting)";
+		}
+		this->draw_row (row + 1, text, index == current.selected);
+	}
+	this->draw_row (height - 1, this->_status + " | arrows: move, enter: open, backspace: up, a: apparent/allocated, h: histogram, q: quit");
+	this->refresh ();
+}
+
+void main_window::move_selection (ptrdiff_t delta) {
+	auto &current = this->_locations.back ();
+	auto const count = static_cast <ptrdiff_t> (this->entries_count ());
+	if (!count) {
+		return;
+	}
+	current.selected = static_cast <size_t> (clamp (static_cast <ptrdiff_t> (current.selected) + delta, ptrdiff_t (0), count - 1));
+}
+
+void main_window::enter_selected () {
+	auto const &current = this->_locations.back ();
+	if (current.selected >= this->entries_count ()) {
+		return;
+	}
+	auto const node = this->entry (current.selected);
+	auto target = node;
+	if (node.is_symlink ()) {
+		target = node.as_link ().target ();
+	}
+	if (target && target.is_dir ()) {
+		if (this->is_scanning () && target.as_dir ().is_loading ()) {
+			this->_builder->prioritize (target.as_dir ());
+		}
+		this->_locations.push_back ({ target.as_dir (), string (node.name ()), 0, 0 });
+		this->_order.clear ();
+		this->_ordered_for.reset ();
+	}
+}
+
+void main_window::leave_dir () {
+	if (this->_locations.size () > 1) {
+		this->_locations.pop_back ();
+		this->_order.clear ();
+		this->_ordered_for.reset ();
+	}
+}
+
+void main_window::relocate () {
+	for (size_t i = 1; i < this->_locations.size (); i++) {
+		auto const &parent = this->_locations [i - 1];
+		auto const count = parent.dir ? parent.dir.children_count () : this->roots ().size ();
+		dir_info found;
+		for (size_t j = 0; j < count; j++) {
+			auto node = parent.dir ? parent.dir.child (j) : this->roots () [j];
+			if (node.name () != this->_locations [i].name) {
+				continue;
+			}
+			if (node.is_symlink ()) {
+				node = node.as_link ().target ();
+			}
+			if (node && node.is_dir ()) {
+				found = node.as_dir ();
+			}
+			break;
+		}
+		if (!found) {
+			this->_locations.resize (i);
+			break;
+		}
+		this->_locations [i].dir = found;
+	}
+	
+	auto &current = this->_locations.back ();
+	auto const count = this->entries_count ();
+	current.selected = count ? min (current.selected, count - 1) : 0;
+	current.offset = min (current.offset, current.selected);
+}
@@ -8,25 +8,91 @@
 #ifndef main_window_hxx
 #define main_window_hxx
 
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstddef>
+#include <filesystem>
+
 #include "window.hxx"
+#include "node_info.hxx"
 
 namespace fs {
-	class children_policy;
 	class tree_builder;
+	class snapshot;
+	class tree_watcher;
 }
 
 namespace ui {
 	class main_window;
 }
 
+// Browses the tree one directory at a time; only rows on screen are looked at, so moving around costs the same in directories of any size.
 class ui::main_window: public ui::window {
 public:
-	main_window (std::unique_ptr <fs::children_policy const> &&policy);
+	// Saves a snapshot of the finished tree to snapshot_path unless it is empty; keeps it up to date with filesystem changes until quit if asked to watch.
+	main_window (std::shared_ptr <fs::tree_builder> builder, std::filesystem::path snapshot_path = {}, bool watch = false);
+	main_window (std::shared_ptr <fs::snapshot> snapshot);
+	~main_window ();
 	
 private:
 	void window_did_appear () override;
 	
+	// Directory shown along with its scroll state; the one listing roots has no directory.
+	struct location {
+		fs::dir_info dir;
+		std::string name;
+		std::size_t selected, offset;
+	};
+	
+	std::vector <fs::node_info> const &roots () const;
+	std::size_t entries_count () const;
+	fs::node_info entry (std::size_t index) const;
+	
+	void start_browsing (std::string status);
+	// Browses a progressive scan as it goes, starting once its roots are listed.
+	void start_scanning ();
+	void scan_did_progress ();
+	void scan_did_finish ();
+	// Saves the snapshot if asked to; returns the status to show.
+	std::string builder_did_finish ();
+	void start_watching ();
+	// Tells whether a progressive scan may still change the tree, so that it must be locked while looked at and shown directories relocated.
+	bool is_scanning () const;
+	void redraw ();
+	void move_selection (std::ptrdiff_t delta);
+	void enter_selected ();
+	void leave_dir ();
+	// Finds shown directories again by name, as tree updates may move their records.
+	void relocate ();
+	
 	std::shared_ptr <fs::tree_builder> _builder;
+	std::shared_ptr <fs::snapshot> _snapshot;
+	std::filesystem::path _snapshot_path;
+	bool _watch;
+	// Sizes shown and ordered by; switched with the a key.
+	fs::size_metric _metric;
+	// Shows the histogram of the current directory, if the builder kept one, instead of its children.
+	bool _show_histogram;
+	std::vector <location> _locations;
+	// What _order was made for; redraws keep it until any of these change.
+	struct order_key {
+		fs::node_index dir;
+		std::size_t count, files, limit;
+		std::uintmax_t size;
+		fs::size_metric metric;
+		
+		bool operator == (order_key const &) const = default;
+	};
+	
+	// Positions of the leading children of the shown directory by size while it is still loading; its records may not be reordered until then.
+	std::vector <std::size_t> _order;
+	std::optional <order_key> _ordered_for;
+	// Set once quitting waits for a cancelled scan to stop.
+	bool _quitting;
+	std::string _status;
+	// Declared last so that watching stops before anything it reports to goes away.
+	std::unique_ptr <fs::tree_watcher> _watcher;
 };
 
 #endif /* main_window_hxx */
@@ -7,12 +7,50 @@
 
 #include "progress_window.hxx"
 
+#include <string>
+#include <cstdio>
+#include <numeric>
+
 using namespace ui;
+using namespace fs;
+using namespace std;
+using namespace chrono;
+
+static string format_size (uintmax_t size) {
+	static char const *const units [] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB" };
+	auto value = static_cast <double> (size);
+	size_t unit = 0;
+	for (; (value >= 1024.0) && (unit + 1 < extent_v <decltype (units)>); unit++) {
+		value /= 1024.0;
+	}
+	char buffer [16];
+	snprintf (buffer, sizeof (buffer), unit ? "%.1f %s" : "%.0f %s", value, units [unit]);
+	return buffer;
+}
+
+static string format_duration (nanoseconds value) {
+	char buffer [16];
+	if (value < 1ms) {
+		snprintf (buffer, sizeof (buffer), "%.1f us", duration <double, micro> (value).count ());
+	} else {
+		snprintf (buffer, sizeof (buffer), "%.1f ms", duration <double, milli> (value).count ());
+	}
+	return buffer;
+}
+
+static double rate (uint64_t count, uint64_t last_count, nanoseconds elapsed) {
+	return (elapsed.count () > 0) ? static_cast <double> (count - min (count, last_count)) / duration <double> (elapsed).count () : 0.0;
+}
 
 void progress_window::window_did_load () {
 	window::window_did_load ();
 	
 	this->add_key_handler ('q', std::bind (&progress_window::abort_builder, this));
+	this->add_key_handler ('-', std::bind (&progress_window::scale_limits, this, 0.5));
+	for (auto const key: { '+', '=' }) {
+		this->add_key_handler (key, std::bind (&progress_window::scale_limits, this, 2.0));
+	}
+	this->add_key_handler ('0', std::bind (&progress_window::scale_limits, this, 0.0));
 	this->_builder->add_progress_callback (std::bind (&progress_window::builder_progress_did_update, this));
 }
 
@@ -25,7 +63,55 @@ void progress_window::window_did_appear () {
 }
 
 void progress_window::builder_progress_did_update () {
-	this->invoke_callback (&progress_window::println, this, this->_builder->progress ().ratio ());
+	this->invoke_coalesced_callback (reinterpret_cast <util::callback_id_t> (this), &progress_window::draw_stats, this, this->_builder->progress (), this->_builder->stats ());
+}
+
+void progress_window::draw_stats (util::progress_t const &progress, scan_stats const &stats) {
+	auto const &last = this->_last_stats;
+	auto const elapsed = stats.elapsed - last.elapsed;
+	char buffer [128];
+	int row = 0;
+	
+	auto const remaining = progress.remaining_time ();
+	this->draw_row (row++, "Scanning: " + progress.percents () + " (" + progress.ratio () + " entries)" + (remaining.empty () ? string () : ", about " + remaining + " left"));
+	snprintf (buffer, sizeof (buffer), "%.0f dirs/s, %.0f entries/s, %.1f s elapsed", rate (stats.dirs, last.dirs, elapsed), rate (stats.entries, last.entries, elapsed), duration <double> (stats.elapsed).count ());
+	this->draw_row (row++, buffer);
+	this->draw_row (row++, format_size (stats.bytes) + " found in " + to_string (stats.entries) + " entries, " + to_string (stats.queued) + " directories queued");
+	this->draw_row (row++, "stat: p50 " + format_duration (stats.stat_latency (0.5)) + ", p99 " + format_duration (stats.stat_latency (0.99)) + ", " + to_string (stats.stat_calls) + " calls, " + to_string (stats.errors) + " errors");
+	
+	// Workers overlap, so phases are shown as shares of their total time rather than of elapsed time.
+	auto const total = accumulate (stats.phases.begin (), stats.phases.end (), nanoseconds ());
+	string phases = "time:";
+	for (size_t i = 0; i < scan_stats::phases_count; i++) {
+		auto const share = (total.count () > 0) ? 100.0 * static_cast <double> (stats.phases [i].count ()) / static_cast <double> (total.count ()) : 0.0;
+		snprintf (buffer, sizeof (buffer), " %s %.0f%%", scan_stats::phase_name (static_cast <scan_stats::phase> (i)), share);
+		phases += buffer;
+	}
+	this->draw_row (row++, phases);
+	
+	auto const limits = this->_builder->limits ();
+	string line = "limits:";
+	if (limits.syscalls) {
+		snprintf (buffer, sizeof (buffer), " %.0f syscalls/s", limits.syscalls);
+		line += buffer;
+	}
+	if (limits.dirs) {
+		snprintf (buffer, sizeof (buffer), " %.0f dirs/s", limits.dirs);
+		line += buffer;
+	}
+	if (limits.latency_threshold.count ()) {
+		line += " backing off above " + format_duration (limits.latency_threshold);
+		if (auto const allowed = this->_builder->syscalls_rate (); allowed && (!limits.syscalls || (allowed < limits.syscalls))) {
+			snprintf (buffer, sizeof (buffer), ", now %.0f syscalls/s", allowed);
+			line += buffer;
+		}
+	} else if (!limits.syscalls && !limits.dirs) {
+		line += " none";
+	}
+	this->draw_row (row++, line + " | -: halve, +: double, 0: lift, q: cancel");
+	this->refresh ();
+	
+	this->_last_stats = stats;
 }
 
 void progress_window::builder_did_finish () {
@@ -35,3 +121,17 @@ void progress_window::builder_did_finish () {
 void progress_window::abort_builder () {
 	this->_builder->cancel ();
 }
+
+void progress_window::scale_limits (double factor) {
+	auto limits = this->_builder->limits ();
+	if (!factor) {
+		limits.syscalls = limits.dirs = 0.0;
+	} else if (limits.syscalls || limits.dirs) {
+		limits.syscalls *= factor;
+		limits.dirs *= factor;
+	} else if (factor < 1.0) {
+		auto const stats = this->_builder->stats ();
+		limits.syscalls = max (rate (stats.syscalls, 0, stats.elapsed) * factor, 1.0);
+	}
+	this->_builder->set_limits (limits);
+}
@@ -8,6 +8,7 @@
 #ifndef progress_window_hxx
 #define progress_window_hxx
 
+#include <chrono>
 #include <memory>
 
 #include "window.hxx"
@@ -24,10 +25,15 @@ namespace ui {
 		void window_did_appear () override;
 
 		void builder_progress_did_update ();
+		// Draws counters of the scan, with rates taken since the previous time it was called.
+		void draw_stats (util::progress_t const &progress, fs::scan_stats const &stats);
 		void builder_did_finish ();
 		void abort_builder ();
+		// Scales rate limits by factor, or lifts them if it is 0; limiting an unlimited scan starts from its average rate so far.
+		void scale_limits (double factor);
 		
 		std::shared_ptr <fs::tree_builder> _builder;
+		fs::scan_stats _last_stats;
 	};
 }
 
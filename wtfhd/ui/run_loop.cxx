@@ -8,17 +8,38 @@
 #include "run_loop.hxx"
 
 #include <map>
+#include <array>
+#include <chrono>
 #include <mutex>
+#include <atomic>
 #include <memory>
 #include <thread>
 #include <vector>
+#include <cerrno>
+#include <climits>
 #include <compare>
 #include <optional>
 #include <algorithm>
+#include <queue>
 #include <functional>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined (__linux__)
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#	include <sys/timerfd.h>
+#else
+#	include <poll.h>
+#endif
 
 #include "misc_types.hxx"
+#include "mpsc_queue.hxx"
+#include "small_callback.hxx"
 #include "event_source.hxx"
 
 using namespace ui;
@@ -26,52 +47,45 @@ using namespace std;
 using namespace util;
 
 namespace ui::impl {
-	struct compare_source_ptr_base {
-	public:
-		typedef function <bool (run_loop::event_source const *, run_loop::event_source const *)> comparator;
-
-		static bool impl (weak_ptr <run_loop::event_source> const &lhs_ptr, weak_ptr <run_loop::event_source> const &rhs_ptr, comparator const &impl) {
-			if (!(lhs_ptr.use_count () && rhs_ptr.use_count ())) {
-				
-			}
-			if (lhs_ptr.expired ()) {
-				return false;
-			} else if (rhs_ptr.expired ()) {
-				return true;
-			}
-			auto const &lhs = lhs_ptr.lock (), &rhs = rhs_ptr.lock ();
-			return impl (lhs.get (), rhs.get ());
-		}
-	};
-	
-	template <typename ..._Args>
-	struct compare_source_ptr: private compare_source_ptr_base {
+	// Sleeps until one of the registered descriptors is readable, the deadline passes or wake () is called from any thread.
+	// Uses epoll with eventfd and a single timerfd for deadlines where available, poll and a pipe otherwise.
+	class poller {
 	public:
-		compare_source_ptr (_Args &&...args): _impl (forward <_Args> (args)...) {}
-		~compare_source_ptr () = default;
+		poller ();
+		poller (poller const &) = delete;
+		~poller ();
 		
-		bool operator () (weak_ptr <run_loop::event_source> const &lhs, weak_ptr <run_loop::event_source> const &rhs) const {
-			return compare_source_ptr::impl (lhs, rhs, this->_impl);
-		}
+		// Several sources may share a descriptor, e.g. keyboard and mouse both read stdin.
+		void add (int descriptor);
+		void remove (int descriptor);
+		
+		// Fills ready with registered descriptors which became readable.
+		void wait (run_loop::time_point const &deadline, vector <int> &ready);
+		void wake ();
 		
 	private:
-		comparator const _impl;
-	};
-	
-	template <>
-	struct compare_source_ptr <>: private compare_source_ptr_base {
-	public:
-		compare_source_ptr () {}
-		~compare_source_ptr () = default;
+		static void throw_errno_if (bool condition);
 		
-		bool operator () (weak_ptr <run_loop::event_source> const &lhs, weak_ptr <run_loop::event_source> const &rhs) const {
-			return compare_source_ptr::impl (lhs, rhs, &run_loop::run_loop::event_source::compare);
-		}
+		void drain_wakeups ();
+		// Signals may leave input for sources without making their descriptors readable, e.g. ncurses turns SIGWINCH into KEY_RESIZE.
+		void interrupted (vector <int> &ready) const;
+		
+		unordered_map <int, size_t> _descriptors;
+#if defined (__linux__)
+		int _epoll_fd;
+		int _event_fd;
+		int _timer_fd;
+		run_loop::time_point _armed_deadline;
+#else
+		static int timeout (run_loop::time_point const &deadline);
+		
+		int _wakeup [2];
+#endif
 	};
 	
 	class run_loop: public ui::run_loop {
 	public:
-		run_loop (): ui::run_loop () {}
+		run_loop (): ui::run_loop (), _exiting (), _next_generation (), _has_overflow (), _wake_pending () {}
 		~run_loop () = default;
 		
 		virtual bool is_main_thread () const override;
@@ -79,26 +93,85 @@ namespace ui::impl {
 		virtual int run (void) override;
 		virtual void exit (int) override;
 
-		virtual void add_pending_callback_invocation (callback_t const &) override;
+		virtual void add_pending_callback_invocation (small_callback &&) override;
+		virtual void add_coalesced_callback_invocation (callback_id_t key, small_callback &&) override;
 		virtual void add_event_source (weak_ptr <event_source> const &) override;
 		virtual void remove_event_source (weak_ptr <event_source> const &) override;
 
 	private:
-		typedef map <weak_ptr <event_source> const, bool, compare_source_ptr <>> pending_sources_t;
+		typedef owner_less <weak_ptr <event_source>> source_less;
+		// Sources to be activated (true) or deactivated (false) before the next dispatch.
+		typedef map <weak_ptr <event_source>, bool, source_less> pending_sources_t;
+		
+		// Descriptor is remembered for the poller, as the source may be gone by the time it is unregistered.
+		struct registration {
+			int descriptor;
+			uint64_t generation;
+		};
+		
+		// Deadline of a source with finite next_event_interval (); outdated once the source is scheduled again or removed.
+		struct deadline_entry {
+			time_point deadline;
+			uint64_t generation;
+			weak_ptr <event_source> source;
+			
+			bool operator < (deadline_entry const &other) const {
+				return this->deadline > other.deadline;
+			}
+		};
+		
+		typedef map <weak_ptr <event_source>, registration, source_less> sources_t;
+		
+		// Latest invocation posted under key, run by a single marker queued when the slot becomes busy.
+		// Keys hashing to a busy slot of another key are posted without coalescing.
+		struct alignas (64) coalesced_slot {
+			mutex lock;
+			callback_id_t key;
+			bool queued;
+			small_callback latest;
+		};
+		
+		static size_t constexpr callback_queue_capacity = 1024;
+		static size_t constexpr coalesced_slots_bits = 6;
 		
 		run_loop::time_point next_iteration (time_point const &now);
 		
+		void post (small_callback &&callback);
+		void invoke_pending_callbacks ();
+		
 		void handle_emitted_events (time_point const &now);
 		void process_pending_sources (pending_sources_t &pending);
-		time_point idle_deadline (time_point const &now) const;
+		void register_source (weak_ptr <event_source> const &source_ptr, time_point const &now);
+		void unregister_source (sources_t::iterator it);
+		void schedule (weak_ptr <event_source> const &source_ptr, event_source const &source, registration &entry, time_point const &now);
+		bool is_current (deadline_entry const &entry) const;
+		time_point idle_deadline ();
 		
 		int _rc;
 		thread::id _main_thread_id;
-		timed_mutex _exit_mutex;
+		atomic <bool> _exiting;
+		poller _poller;
+		vector <int> _ready_descriptors;
+		
+		sources_t _sources;
+		// Earliest deadline on top; checking a source is due costs O(1) and rescheduling it O(log n).
+		priority_queue <deadline_entry> _deadlines;
+		unordered_multimap <int, weak_ptr <event_source>> _descriptor_sources;
+		// Sources which have neither a descriptor nor a deadline are checked on every wake-up.
+		vector <weak_ptr <event_source>> _idle_sources;
+		uint64_t _next_generation;
 		
-		vector <weak_ptr <event_source>> _sources;
 		threadsafe <pending_sources_t> _pending;
-		threadsafe <vector <callback_t>> _callback_invocations;
+		
+		mpsc_queue <small_callback, callback_queue_capacity> _callback_invocations;
+		// Invocations which did not fit the queue; while there are any, later ones go here too. They run only once the queue has no position
+		// claimed, as an earlier invocation of the same producer may still be in it, e.g. behind a slot another producer has yet to publish.
+		mutex _overflow_lock;
+		vector <small_callback> _overflow;
+		atomic <bool> _has_overflow;
+		// Set by the first post since the loop last drained invocations, so that bursts of them cost a single wake-up.
+		atomic <bool> _wake_pending;
+		array <coalesced_slot, size_t (1) << coalesced_slots_bits> _coalesced;
 	};
 };
 
@@ -113,24 +186,97 @@ bool impl::run_loop::is_main_thread () const {
 int impl::run_loop::run () {
 	this->_main_thread_id = this_thread::get_id ();
 	
-	this->_exit_mutex.lock ();
+	this->_exiting.store (false, memory_order::relaxed);
 	for (;;) {
-		auto const now = clock_type::now ();
-		this->next_iteration (now);
-		if (this->_exit_mutex.try_lock_until (this->idle_deadline (now))) {
+		auto const deadline = this->next_iteration (clock_type::now ());
+		if (this->_exiting.load (memory_order::acquire)) {
 			break;
 		}
+		this->_ready_descriptors.clear ();
+		this->_poller.wait (deadline, this->_ready_descriptors);
 	}
 	return this->_rc;
 }
 
 void impl::run_loop::exit (int rc) {
 	this->_rc = rc;
-	this->_exit_mutex.unlock ();
+	this->_exiting.store (true, memory_order::release);
+	this->_poller.wake ();
+}
+
+void impl::run_loop::add_pending_callback_invocation (small_callback &&callback) {
+	this->post (std::move (callback));
+}
+
+void impl::run_loop::add_coalesced_callback_invocation (callback_id_t key, small_callback &&callback) {
+	auto &slot = this->_coalesced [(static_cast <uint64_t> (key) * 0x9E3779B97F4A7C15ULL) >> (64 - coalesced_slots_bits)];
+	{
+		scoped_lock lock (slot.lock);
+		if (slot.queued && (slot.key != key)) {
+			return this->post (std::move (callback));
+		}
+		slot.latest = std::move (callback);
+		if (slot.queued) {
+			return;
+		}
+		slot.key = key;
+		slot.queued = true;
+	}
+	this->post ([&slot] {
+		small_callback latest;
+		{
+			scoped_lock lock (slot.lock);
+			latest = std::move (slot.latest);
+			slot.queued = false;
+		}
+		if (latest) {
+			latest ();
+		}
+	});
 }
 
-void impl::run_loop::add_pending_callback_invocation (callback_t const &callback) {
-	this->_callback_invocations.with_value ([&callback] (vector <callback_t> &callbacks) { callbacks.push_back (callback); });
+void impl::run_loop::post (small_callback &&callback) {
+	if (this->_has_overflow.load (memory_order::acquire) || !this->_callback_invocations.try_push (callback)) {
+		scoped_lock lock (this->_overflow_lock);
+		this->_overflow.push_back (std::move (callback));
+		this->_has_overflow.store (true, memory_order::release);
+	}
+	if (!this->_wake_pending.exchange (true, memory_order::acq_rel)) {
+		this->_poller.wake ();
+	}
+}
+
+void impl::run_loop::invoke_pending_callbacks () {
+	this->_wake_pending.exchange (false, memory_order::acq_rel);
+	// At most a queue worth of invocations per iteration, so that callbacks posting more of them cannot hold up the loop.
+	size_t count = 0;
+	while (auto callback = this->_callback_invocations.try_pop ()) {
+		(*callback) ();
+		if (++count == callback_queue_capacity) {
+			this->_wake_pending.store (true, memory_order::release);
+			this->_poller.wake ();
+			return;
+		}
+	}
+	if (!this->_has_overflow.load (memory_order::acquire)) {
+		return;
+	}
+	
+	vector <small_callback> overflow;
+	{
+		// Checked under the lock, so that whatever was posted before an invocation found here has been claimed a position by now.
+		scoped_lock lock (this->_overflow_lock);
+		if (!this->_callback_invocations.empty ()) {
+			this->_wake_pending.store (true, memory_order::release);
+			this->_poller.wake ();
+			return;
+		}
+		overflow.swap (this->_overflow);
+		this->_has_overflow.store (false, memory_order::release);
+	}
+	for (auto &callback: overflow) {
+		callback ();
+	}
 }
 
 void impl::run_loop::add_event_source (weak_ptr <event_source> const &source) {
@@ -138,89 +284,316 @@ void impl::run_loop::add_event_source (weak_ptr <event_source> const &source) {
 }
 
 void impl::run_loop::remove_event_source (weak_ptr <event_source> const &source) {
-	this->_pending.with_value ([&source] (pending_sources_t &pending) { pending.erase (source); });
+	this->_pending.with_value ([&source] (pending_sources_t &pending) { pending.insert_or_assign (source, false); });
 }
 
 run_loop::time_point impl::run_loop::next_iteration (time_point const &now) {
-	this->_callback_invocations.with_value ([] (vector <callback_t> &callbacks) {
-		for (auto callback: callbacks) {
-			invoke (callback);
-		}
-		callbacks.clear ();
-	});
+	this->invoke_pending_callbacks ();
 	
+	this->_pending.with_value ([this] (pending_sources_t &pending) {
+		this->process_pending_sources (pending);
+	});
 	this->handle_emitted_events (now);
 	
-	return this->_pending.with_value ([this, &now] (pending_sources_t &pending) {
+	// Sources may be added or removed by event handlers as well.
+	this->_pending.with_value ([this] (pending_sources_t &pending) {
 		this->process_pending_sources (pending);
-		return this->idle_deadline (now);
 	});
+	return this->idle_deadline ();
 }
 
 void impl::run_loop::handle_emitted_events (time_point const &now) {
-	vector <shared_ptr <event_source>> fired_sources;
-	for (auto const &source_ptr: this->_sources) {
-		if (source_ptr.expired ()) {
-			continue;
+	vector <pair <weak_ptr <event_source>, shared_ptr <event_source>>> candidates;
+	unordered_set <event_source const *> seen;
+	vector <weak_ptr <event_source>> expired;
+	auto const add_candidate = [&] (weak_ptr <event_source> const &source_ptr) {
+		auto source = source_ptr.lock ();
+		if (!source) {
+			expired.push_back (source_ptr);
+		} else if (seen.insert (source.get ()).second) {
+			candidates.emplace_back (source_ptr, std::move (source));
 		}
-		auto const &source = source_ptr.lock ();
-		if (source->has_event (now)) {
-			fired_sources.push_back (source);
+	};
+	
+	while (!this->_deadlines.empty () && (this->_deadlines.top ().deadline <= now)) {
+		if (this->is_current (this->_deadlines.top ())) {
+			add_candidate (this->_deadlines.top ().source);
+		}
+		this->_deadlines.pop ();
+	}
+	for (auto const descriptor: this->_ready_descriptors) {
+		auto const [begin, end] = this->_descriptor_sources.equal_range (descriptor);
+		for_each (begin, end, [&] (auto const &item) { add_candidate (item.second); });
+	}
+	for_each (this->_idle_sources.begin (), this->_idle_sources.end (), add_candidate);
+	this->_ready_descriptors.clear ();
+	
+	// Sources which went away without being removed are forgotten once they would fire.
+	for (auto const &source_ptr: expired) {
+		if (auto const it = this->_sources.find (source_ptr); it != this->_sources.end ()) {
+			this->unregister_source (it);
 		}
 	}
 	
-	for (auto const &source: fired_sources) {
-		do {
+	// Same priority order as before: timers, then mouse, then keyboard, then idle handlers.
+	stable_sort (candidates.begin (), candidates.end (), [] (auto const &lhs, auto const &rhs) {
+		return lhs.second->compare (rhs.second.get ());
+	});
+	for (auto const &[source_ptr, source]: candidates) {
+		while (source->is_active () && source->has_event (now)) {
 			source->process_event (now);
-		} while (source->has_event (now));
+		}
+		if (auto const it = this->_sources.find (source_ptr); it != this->_sources.end ()) {
+			this->schedule (source_ptr, *source, it->second, now);
+		}
 	}
 }
 
 void impl::run_loop::process_pending_sources (pending_sources_t &pending) {
-	erase_if (this->_sources, [&] (auto const &source_ptr) {
-		if (source_ptr.expired ()) {
-			return true;
-		}
-		auto const &source = source_ptr.lock ();
-		auto const &it = pending.find (source);
-		if (it != pending.end () && !it->second) {
-			source->deactivate ();
-			pending.erase (it);
-			return true;
-		}
-		return false;
-	});
-	
 	if (pending.empty ()) {
 		return;
 	}
-	
-	erase_if (pending, [&] (auto const &source) {
-		if (!source.second || source.first.expired ()) {
-			return true;
+	auto const now = clock_type::now ();
+	for (auto const &[source_ptr, should_add]: pending) {
+		auto const it = this->_sources.find (source_ptr);
+		if (should_add && (it == this->_sources.end ())) {
+			this->register_source (source_ptr, now);
+		} else if (!should_add && (it != this->_sources.end ())) {
+			if (auto const source = source_ptr.lock ()) {
+				source->deactivate ();
+			}
+			this->unregister_source (it);
 		}
-		if (binary_search (this->_sources.begin (), this->_sources.end (), source.first, compare_source_ptr ())) {
-			return true;
+	}
+	pending.clear ();
+}
+
+void impl::run_loop::register_source (weak_ptr <event_source> const &source_ptr, time_point const &now) {
+	auto const source = source_ptr.lock ();
+	if (!source) {
+		return;
+	}
+	source->activate ();
+	auto &entry = this->_sources.emplace (source_ptr, registration { source->descriptor (), 0 }).first->second;
+	if (entry.descriptor != -1) {
+		this->_poller.add (entry.descriptor);
+		this->_descriptor_sources.emplace (entry.descriptor, source_ptr);
+	}
+	this->schedule (source_ptr, *source, entry, now);
+}
+
+void impl::run_loop::unregister_source (sources_t::iterator it) {
+	auto const &source_ptr = it->first;
+	if (auto const descriptor = it->second.descriptor; descriptor != -1) {
+		auto const [begin, end] = this->_descriptor_sources.equal_range (descriptor);
+		for (auto item = begin; item != end; item++) {
+			if (!source_less () (item->second, source_ptr) && !source_less () (source_ptr, item->second)) {
+				this->_descriptor_sources.erase (item);
+				break;
+			}
 		}
-		return false;
+		this->_poller.remove (descriptor);
+	}
+	erase_if (this->_idle_sources, [&source_ptr] (auto const &idle) {
+		return !source_less () (idle, source_ptr) && !source_less () (source_ptr, idle);
 	});
-	
-	this->_sources.reserve (this->_sources.size () + pending.size ());
-	auto const &sorted_count = this->_sources.size ();
-	for (auto source: pending) {
-		this->_sources.emplace_back (move (source.first)).lock ()->activate ();
+	// Entries left in the deadline queue become outdated along with the registration.
+	this->_sources.erase (it);
+}
+
+void impl::run_loop::schedule (weak_ptr <event_source> const &source_ptr, event_source const &source, registration &entry, time_point const &now) {
+	auto const registered = !entry.generation;
+	entry.generation = ++this->_next_generation;
+	auto const interval = source.next_event_interval (now);
+	if ((interval < duration::max ()) && (interval < time_point::max () - now)) {
+		this->_deadlines.push ({ now + interval, entry.generation, source_ptr });
+	} else if (registered && (entry.descriptor == -1) && (interval == duration::max ())) {
+		this->_idle_sources.push_back (source_ptr);
 	}
-	pending.clear ();
-	inplace_merge (this->_sources.begin (), this->_sources.begin () + sorted_count, this->_sources.end (), compare_source_ptr ());
 }
 
-run_loop::time_point impl::run_loop::idle_deadline (time_point const &now) const {
-	auto const it_min = min_element (this->_sources.begin (), this->_sources.end (), compare_source_ptr ([&now] (auto const &lhs, auto const &rhs) {
-		return lhs->next_event_interval (now) < rhs->next_event_interval (now);
-	}));
-	if (it_min != this->_sources.end ()) {
-		return now + it_min->lock ()->next_event_interval (now);
-	} else {
+bool impl::run_loop::is_current (deadline_entry const &entry) const {
+	auto const it = this->_sources.find (entry.source);
+	return (it != this->_sources.end ()) && (it->second.generation == entry.generation);
+}
+
+run_loop::time_point impl::run_loop::idle_deadline () {
+	while (!this->_deadlines.empty () && !this->is_current (this->_deadlines.top ())) {
+		this->_deadlines.pop ();
+	}
+	if (this->_deadlines.empty ()) {
 		return time_point::max ();
 	}
+	auto const &top = this->_deadlines.top ();
+	// Sources which went away without being removed are dropped once due.
+	if (top.source.expired ()) {
+		return clock_type::now ();
+	}
+	return top.deadline;
+}
+
+#if defined (__linux__)
+
+// Both steady_clock and timerfd use CLOCK_MONOTONIC here, so deadlines are passed as is.
+impl::poller::poller (): _epoll_fd (::epoll_create1 (EPOLL_CLOEXEC)), _event_fd (::eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)),
+	_timer_fd (::timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)), _armed_deadline (run_loop::time_point::max ()) {
+	poller::throw_errno_if ((this->_epoll_fd == -1) || (this->_event_fd == -1) || (this->_timer_fd == -1));
+	for (auto const fd: { this->_event_fd, this->_timer_fd }) {
+		epoll_event event { .events = EPOLLIN, .data = { .fd = fd } };
+		poller::throw_errno_if (::epoll_ctl (this->_epoll_fd, EPOLL_CTL_ADD, fd, &event));
+	}
+}
+
+impl::poller::~poller () {
+	::close (this->_timer_fd);
+	::close (this->_event_fd);
+	::close (this->_epoll_fd);
+}
+
+void impl::poller::add (int descriptor) {
+	if ((descriptor == -1) || this->_descriptors [descriptor]++) {
+		return;
+	}
+	epoll_event event { .events = EPOLLIN, .data = { .fd = descriptor } };
+	::epoll_ctl (this->_epoll_fd, EPOLL_CTL_ADD, descriptor, &event);
+}
+
+void impl::poller::remove (int descriptor) {
+	auto const it = this->_descriptors.find (descriptor);
+	if ((it == this->_descriptors.end ()) || --it->second) {
+		return;
+	}
+	this->_descriptors.erase (it);
+	// Fails harmlessly if the descriptor is closed already, which unregisters it as well.
+	::epoll_ctl (this->_epoll_fd, EPOLL_CTL_DEL, descriptor, nullptr);
+}
+
+void impl::poller::wait (run_loop::time_point const &deadline, vector <int> &ready) {
+	// Re-arming also discards an expiration which has not been read yet.
+	if (deadline != this->_armed_deadline) {
+		itimerspec value {};
+		if (deadline < run_loop::time_point::max ()) {
+			auto const since_epoch = max (deadline.time_since_epoch (), run_loop::duration (1));
+			auto const seconds = chrono::duration_cast <chrono::seconds> (since_epoch);
+			value.it_value.tv_sec = static_cast <time_t> (seconds.count ());
+			value.it_value.tv_nsec = static_cast <long> (chrono::duration_cast <chrono::nanoseconds> (since_epoch - seconds).count ());
+		}
+		::timerfd_settime (this->_timer_fd, TFD_TIMER_ABSTIME, &value, nullptr);
+		this->_armed_deadline = deadline;
+	}
+	
+	array <epoll_event, 16> events;
+	auto const count = ::epoll_wait (this->_epoll_fd, events.data (), static_cast <int> (events.size ()), -1);
+	if ((count == -1) && (errno == EINTR)) {
+		return this->interrupted (ready);
+	}
+	for (int i = 0; i < count; i++) {
+		auto const fd = events [i].data.fd;
+		if (fd == this->_event_fd) {
+			this->drain_wakeups ();
+		} else if (fd == this->_timer_fd) {
+			uint64_t expirations;
+			while ((::read (this->_timer_fd, &expirations, sizeof (expirations)) == -1) && (errno == EINTR));
+			this->_armed_deadline = run_loop::time_point::max ();
+		} else {
+			ready.push_back (fd);
+		}
+	}
+}
+
+void impl::poller::wake () {
+	uint64_t const value = 1;
+	while ((::write (this->_event_fd, &value, sizeof (value)) == -1) && (errno == EINTR));
+}
+
+void impl::poller::drain_wakeups () {
+	uint64_t value;
+	while ((::read (this->_event_fd, &value, sizeof (value)) == -1) && (errno == EINTR));
+}
+
+#else
+
+impl::poller::poller () {
+	poller::throw_errno_if (::pipe (this->_wakeup));
+	for (auto const fd: this->_wakeup) {
+		::fcntl (fd, F_SETFL, ::fcntl (fd, F_GETFL) | O_NONBLOCK);
+		::fcntl (fd, F_SETFD, FD_CLOEXEC);
+	}
+}
+
+impl::poller::~poller () {
+	::close (this->_wakeup [0]);
+	::close (this->_wakeup [1]);
+}
+
+void impl::poller::add (int descriptor) {
+	if (descriptor != -1) {
+		this->_descriptors [descriptor]++;
+	}
+}
+
+void impl::poller::remove (int descriptor) {
+	auto const it = this->_descriptors.find (descriptor);
+	if ((it != this->_descriptors.end ()) && !--it->second) {
+		this->_descriptors.erase (it);
+	}
+}
+
+void impl::poller::wait (run_loop::time_point const &deadline, vector <int> &ready) {
+	vector <pollfd> fds { pollfd { this->_wakeup [0], POLLIN, 0 } };
+	for (auto const &descriptor: this->_descriptors) {
+		fds.push_back ({ descriptor.first, POLLIN, 0 });
+	}
+	auto const count = ::poll (fds.data (), static_cast <nfds_t> (fds.size ()), poller::timeout (deadline));
+	if ((count == -1) && (errno == EINTR)) {
+		return this->interrupted (ready);
+	}
+	if (count <= 0) {
+		return;
+	}
+	if (fds.front ().revents) {
+		this->drain_wakeups ();
+	}
+	for (auto it = fds.begin () + 1; it != fds.end (); it++) {
+		if (it->revents) {
+			ready.push_back (it->fd);
+		}
+	}
+}
+
+void impl::poller::wake () {
+	char const byte = 0;
+	while ((::write (this->_wakeup [1], &byte, 1) == -1) && (errno == EINTR));
+}
+
+void impl::poller::drain_wakeups () {
+	char buffer [64];
+	while ((::read (this->_wakeup [0], buffer, sizeof (buffer)) > 0) || (errno == EINTR));
+}
+
+int impl::poller::timeout (run_loop::time_point const &deadline) {
+	if (deadline == run_loop::time_point::max ()) {
+		return -1;
+	}
+	auto const now = run_loop::clock_type::now ();
+	if (deadline <= now) {
+		return 0;
+	}
+	// Rounded up, so that the loop does not wake just before the deadline and spin until it passes.
+	auto const milliseconds = chrono::ceil <chrono::milliseconds> (deadline - now).count ();
+	return static_cast <int> (min <decltype (milliseconds)> (milliseconds, INT_MAX));
+}
+
+#endif
+
+void impl::poller::interrupted (vector <int> &ready) const {
+	for (auto const &descriptor: this->_descriptors) {
+		ready.push_back (descriptor.first);
+	}
+}
+
+void impl::poller::throw_errno_if (bool condition) {
+	if (condition) {
+		throw system_error (errno, system_category ());
+	}
 }
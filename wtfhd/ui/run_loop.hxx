@@ -12,6 +12,7 @@
 #include <memory>
 
 #include "misc_types.hxx"
+#include "small_callback.hxx"
 
 namespace ui {
 	class event_source;
@@ -49,7 +50,13 @@ public:
 		virtual bool has_event (time_point const &now) const = 0;
 		virtual void process_event (time_point const &now) = 0;
 		
+		// How long the loop may sleep before checking this source again; duration::max () if only descriptor () readiness matters.
 		virtual duration next_event_interval (time_point const &now) const = 0;
+		
+		// File descriptor whose readability wakes the loop to check this source, or -1; it must stay the same while the source is active.
+		virtual int descriptor () const {
+			return -1;
+		}
 
 		virtual void activate () {
 			this->_is_active = true;
@@ -71,7 +78,10 @@ public:
 	virtual int run (void) = 0;
 	virtual void exit (int) = 0;
 
-	virtual void add_pending_callback_invocation (util::callback_t const &) = 0;
+	// Safe to call from any thread; wakes the loop if it is idle. Callables which fit util::small_callback are posted without allocating.
+	virtual void add_pending_callback_invocation (util::small_callback &&) = 0;
+	// Same, but invocations posted under the same key before the loop gets to them collapse into the last one, e.g. repeated progress updates.
+	virtual void add_coalesced_callback_invocation (util::callback_id_t key, util::small_callback &&) = 0;
 	virtual void add_event_source (std::weak_ptr <event_source> const &) = 0;
 	virtual void remove_event_source (std::weak_ptr <event_source> const &) = 0;
 };
@@ -9,6 +9,7 @@
 
 #include <cctype>
 #include <string>
+#include <algorithm>
 #include <panel.h>
 #include <ncurses.h>
 
@@ -76,6 +77,73 @@ void window::print (string const &str, bool append_newline) const noexcept {
 	}
 }
 
+void window::clear () const noexcept {
+	werase (this->impl ());
+	box (this->impl (), 0, 0);
+	wmove (this->impl (), 1, 1);
+	this->_drawn_rows.clear ();
+}
+
+void window::draw_row (int row, string_view str, bool highlighted) const noexcept {
+	auto const area = this->frame ().inset (1, 1);
+	if ((row < 0) || (row >= area.height) || (area.width <= 0)) {
+		return;
+	}
+	
+	// Cells are counted as code points, which is exact for text without wide characters.
+	auto const is_continuation = [] (char c) { return (static_cast <unsigned char> (c) & 0xC0) == 0x80; };
+	string text;
+	int cells = 0;
+	for (size_t i = 0; (i < str.size ()) && !((cells == area.width) && !is_continuation (str [i])); i++) {
+		if (!is_continuation (str [i])) {
+			cells++;
+		}
+		text.push_back (str [i]);
+	}
+	text.append (static_cast <size_t> (area.width - cells), ' ');
+	
+	if (this->_drawn_rows.size () < static_cast <size_t> (area.height)) {
+		this->_drawn_rows.resize (static_cast <size_t> (area.height));
+	}
+	auto &[drawn, drawn_highlighted] = this->_drawn_rows [static_cast <size_t> (row)];
+	size_t begin = 0, end = text.size ();
+	if (!drawn.empty () && (drawn_highlighted == highlighted)) {
+		if (drawn == text) {
+			return;
+		}
+		begin = static_cast <size_t> (mismatch (text.begin (), text.end (), drawn.begin (), drawn.end ()).first - text.begin ());
+		if (drawn.size () == text.size ()) {
+			while ((end > begin) && (text [end - 1] == drawn [end - 1])) {
+				end--;
+			}
+		}
+		while ((begin > 0) && is_continuation (text [begin])) {
+			begin--;
+		}
+		while ((end < text.size ()) && is_continuation (text [end])) {
+			end++;
+		}
+	}
+	
+	auto const column = count_if (text.begin (), text.begin () + static_cast <ptrdiff_t> (begin), [&] (char c) { return !is_continuation (c); });
+	if (highlighted) {
+		wattron (this->impl (), A_REVERSE);
+	}
+	mvwaddnstr (this->impl (), row + 1, static_cast <int> (column) + 1, text.data () + begin, static_cast <int> (end - begin));
+	if (highlighted) {
+		wattroff (this->impl (), A_REVERSE);
+	}
+	drawn = std::move (text);
+	drawn_highlighted = highlighted;
+}
+
+void window::resize_to_screen () noexcept {
+	auto const bounds = this->screen ().bounds ();
+	wresize (this->impl (), bounds.height, bounds.width);
+	move_panel (this->_panel, bounds.y, bounds.x);
+	this->clear ();
+}
+
 void window::load (class screen &screen) {
 	this->assign_to_screen (screen, [] (auto &stack) { return stack.size () - 1; });
 	this->window_did_load ();
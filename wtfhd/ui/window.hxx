@@ -8,7 +8,11 @@
 #ifndef window_hxx
 #define window_hxx
 
+#include <string>
+#include <utility>
+#include <vector>
 #include <functional>
+#include <string_view>
 #include <unordered_set>
 
 #include "ui_common.hxx"
@@ -57,6 +61,13 @@ protected:
 	virtual void print (std::string const &) const noexcept;
 	virtual void println (std::string const &) const noexcept;
 	void refresh () const;
+	// Erases contents and moves the cursor back to the top left corner within the border.
+	void clear () const noexcept;
+	// Shows str padded to the width of the area within the border at its row, writing only cells which differ from what the previous call
+	// left on that row, so redrawing a mostly unchanged screen costs little; clear () and resize_to_screen () start over.
+	void draw_row (int row, std::string_view str, bool highlighted = false) const noexcept;
+	// Takes the whole screen again, e.g. after KEY_RESIZE.
+	void resize_to_screen () noexcept;
 
 	virtual void window_did_load (void) {}
 	virtual void window_will_appear (void) {}
@@ -106,6 +117,17 @@ protected:
 			run_loop->add_pending_callback_invocation (std::bind (f, std::forward <_Args> (args)...));
 		}
 	}
+	
+	// Like invoke_callback, but calls posted with the same key before the main thread gets to them collapse into the last one.
+	template <typename _Fp, typename ..._Args>
+	void invoke_coalesced_callback (util::callback_id_t key, _Fp const &f, _Args &&...args) {
+		auto &run_loop = this->get_run_loop ();
+		if (run_loop->is_main_thread ()) {
+			return std::invoke (f, std::forward <_Args> (args)...);
+		} else {
+			run_loop->add_coalesced_callback_invocation (key, std::bind (f, std::forward <_Args> (args)...));
+		}
+	}
 		
 private:
 	using screen::window::screen, screen::window::current_stack, screen::window::get_run_loop, screen::window::stack_pos;
@@ -136,6 +158,8 @@ private:
 	void print (std::string const &, bool) const noexcept;
 	
 	PANEL *_panel;
+	// Back buffer of draw_row (): text and highlighting of each row as it was drawn last.
+	mutable std::vector <std::pair <std::string, bool>> _drawn_rows;
 	
 	std::weak_ptr <mouse> _mouse;
 	std::weak_ptr <keyboard> _keyboard;
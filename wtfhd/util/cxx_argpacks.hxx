@@ -12,23 +12,13 @@
 
 namespace util {
 	template <typename ..._Types>
-	struct pack {
-	private:
-		template <template <typename ...> typename _Base, typename _Head, typename ..._Tail>
-		static _Base <_Tail...> tail_helper (_Base <> &, _Head &, _Tail &&...);
-		
-	public:
-		typedef std::tuple_element_t <0, std::tuple <_Types...>> head_type;
-		
-		template <template <typename ...> typename _Base>
-		using tail_type = std::invoke_result_t <decltype (tail_helper), _Base <>, _Types...> ();
-	};
-	template <typename _Tp>
-	struct pack <_Tp> {
-		typedef _Tp head_type;
+	struct pack;
+	template <typename _Head, typename ..._Tail>
+	struct pack <_Head, _Tail...> {
+		typedef _Head head_type;
 		
 		template <template <typename ...> typename _Base>
-		using tail_type = _Base <>;
+		using tail_type = _Base <_Tail...>;
 	};
 	template <>
 	struct pack <> {};
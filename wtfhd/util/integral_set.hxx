@@ -9,10 +9,20 @@
 #define integral_set_hxx
 
 #include <map>
-#include <bitset>
+#include <bit>
+#include <array>
+#include <tuple>
+#include <mutex>
 #include <vector>
 #include <climits>
+#include <cstdint>
+#include <variant>
+#include <numeric>
+#include <iterator>
+#include <algorithm>
 #include <type_traits>
+#include <unordered_map>
+#include <shared_mutex>
 
 #include "cxx_argpacks.hxx"
 
@@ -56,6 +66,14 @@ namespace util {
 
 	template <typename ..._Types>
 	using integral_set = typename integral_set_wrapper <_Types...>::type;
+	
+	// Width of values kept by a single chunk container once storage of _N bits is split into prefixes and suffixes.
+	std::size_t constexpr integral_set_chunk_bits (std::size_t const bits) {
+		return (bits > 16) ? integral_set_chunk_bits (bits / 2) : bits;
+	}
+	
+	template <typename ..._Types>
+	struct concurrent_integral_set;
 
 	template <typename _Tp>
 	struct integral_set_base {
@@ -82,9 +100,20 @@ namespace util {
 			return this->_storage.remove (value);
 		}
 		
+		// Sorts values and inserts them chunk by chunk; returns the number of values which were not present before.
+		template <typename _It, typename = typename std::iterator_traits <_It>::value_type>
+		std::size_t insert (_It values_begin, _It values_end) {
+			std::vector <_Tp> values (values_begin, values_end);
+			std::sort (values.begin (), values.end ());
+			values.erase (std::unique (values.begin (), values.end ()), values.end ());
+			return this->_storage.insert (values.data (), values.data () + values.size ());
+		}
+		
 	protected:
 		template <typename _It>
-		integral_set_base (_It values_begin, _It values_end): _storage (values_begin, values_end) {}
+		integral_set_base (_It values_begin, _It values_end): _storage () {
+			this->insert (values_begin, values_end);
+		}
 		
 	private:
 		using storage = integral_set_storage <_Tp>;
@@ -124,12 +153,30 @@ namespace util {
 			return it->second.remove (value_tail...);
 		}
 		
+		// Values sharing the head are handed down to the nested set as a single batch when it is the last one.
+		template <typename _It, typename = typename std::iterator_traits <_It>::value_type>
+		std::size_t insert (_It values_begin, _It values_end) {
+			std::size_t result = 0;
+			if constexpr (sizeof... (_Types) == 1) {
+				std::map <_Tp, std::vector <std::tuple_element_t <0, std::tuple <_Types...>>>> groups;
+				for (auto it = values_begin; it != values_end; it++) {
+					groups [std::get <0> (*it)].push_back (std::get <1> (*it));
+				}
+				for (auto const &[head, tail]: groups) {
+					result += this->_storage [head].insert (tail.begin (), tail.end ());
+				}
+			} else {
+				for (auto it = values_begin; it != values_end; it++) {
+					result += std::apply ([this] (auto const ...values) { return this->insert (values...); }, *it);
+				}
+			}
+			return result;
+		}
+		
 	protected:
 		template <typename _It>
 		integral_set_multi (_It values_begin, _It values_end) {
-			for (auto it = values_begin; it != values_end; it++) {
-				std::apply (&integral_set_multi::insert, std::tuple_cat (std::make_tuple (this), *it));
-			}
+			this->insert (values_begin, values_end);
 		}
 
 	private:
@@ -140,8 +187,255 @@ namespace util {
 		storage _storage;
 	};
 	
+	// Roaring-style chunk containers holding values of at most 16 bits; integral_set_storage_small picks one by cardinality.
+	struct integral_set_chunk {
+		typedef std::uint16_t value_type;
+		
+		// Branchless binary search narrowed down to a short tail which is scanned linearly, so that the compiler may vectorize it.
+		template <typename _Key>
+		static std::size_t lower_bound (_Key const *keys, std::size_t count, value_type const value) {
+			std::size_t constexpr linear_span = 32;
+			std::size_t base = 0;
+			while (count > linear_span) {
+				auto const half = count / 2;
+				base = (keys [base + half - 1] < value) ? base + half : base;
+				count -= half;
+			}
+			std::size_t result = base;
+			for (std::size_t i = 0; i < count; i++) {
+				result += (keys [base + i] < value);
+			}
+			return result;
+		}
+	};
+	
+	template <std::size_t _N>
+	struct integral_set_chunk_array {
+		typedef integral_set_chunk::value_type value_type;
+		
+		// Past this size a bitmap takes less memory.
+		static std::size_t constexpr max_size = std::max <std::size_t> ((std::size_t (1) << _N) / (sizeof (value_type) * CHAR_BIT), 1);
+		
+		std::vector <value_type> values;
+		
+		std::size_t size () const {
+			return this->values.size ();
+		}
+		
+		std::size_t lower_bound (value_type const value) const {
+			return integral_set_chunk::lower_bound (this->values.data (), this->values.size (), value);
+		}
+		
+		bool contains (value_type const value) const {
+			auto const index = this->lower_bound (value);
+			return (index < this->values.size ()) && (this->values [index] == value);
+		}
+		
+		bool insert (value_type const value) {
+			if (this->values.empty () || (this->values.back () < value)) {
+				this->values.push_back (value);
+				return true;
+			}
+			auto const index = this->lower_bound (value);
+			if (this->values [index] == value) {
+				return false;
+			}
+			this->values.insert (this->values.begin () + index, value);
+			return true;
+		}
+		
+		bool remove (value_type const value) {
+			auto const index = this->lower_bound (value);
+			if ((index == this->values.size ()) || (this->values [index] != value)) {
+				return false;
+			}
+			this->values.erase (this->values.begin () + index);
+			return true;
+		}
+		
+		// Values must be sorted and unique.
+		std::size_t insert (value_type const *begin, value_type const *end) {
+			auto const old_size = this->values.size ();
+			std::vector <value_type> merged (old_size + (end - begin));
+			merged.erase (std::set_union (this->values.begin (), this->values.end (), begin, end, merged.begin ()), merged.end ());
+			this->values = std::move (merged);
+			return this->values.size () - old_size;
+		}
+		
+		std::size_t runs_count () const {
+			std::size_t result = !this->values.empty ();
+			for (std::size_t i = 1; i < this->values.size (); i++) {
+				result += (this->values [i] != this->values [i - 1] + 1);
+			}
+			return result;
+		}
+	};
+	
+	template <std::size_t _N>
+	struct integral_set_chunk_bitmap {
+		typedef integral_set_chunk::value_type value_type;
+		typedef std::uint64_t word_type;
+		
+		static std::size_t constexpr word_bits = sizeof (word_type) * CHAR_BIT;
+		static std::size_t constexpr words_count = std::max <std::size_t> ((std::size_t (1) << _N) / word_bits, 1);
+		
+		std::vector <word_type> words = std::vector <word_type> (words_count);
+		std::size_t count = 0;
+		
+		std::size_t size () const {
+			return this->count;
+		}
+		
+		bool contains (value_type const value) const {
+			return (this->words [value / word_bits] >> (value % word_bits)) & 1;
+		}
+		
+		bool insert (value_type const value) {
+			auto &word = this->words [value / word_bits];
+			auto const mask = word_type (1) << (value % word_bits);
+			auto const inserted = !(word & mask);
+			word |= mask;
+			this->count += inserted;
+			return inserted;
+		}
+		
+		bool remove (value_type const value) {
+			auto &word = this->words [value / word_bits];
+			auto const mask = word_type (1) << (value % word_bits);
+			auto const removed = !!(word & mask);
+			word &= ~mask;
+			this->count -= removed;
+			return removed;
+		}
+		
+		std::size_t insert (value_type const *begin, value_type const *end) {
+			auto const old_count = this->count;
+			for (auto it = begin; it != end; it++) {
+				this->insert (*it);
+			}
+			return this->count - old_count;
+		}
+		
+		template <typename _Fn>
+		void for_each (_Fn &&fn) const {
+			for (std::size_t i = 0; i < words_count; i++) {
+				for (auto word = this->words [i]; word; word &= word - 1) {
+					fn (static_cast <value_type> (i * word_bits + std::countr_zero (word)));
+				}
+			}
+		}
+		
+		std::size_t runs_count () const {
+			std::size_t result = 0;
+			word_type carry = 0;
+			for (auto const word: this->words) {
+				// Counts bits which start a run, i.e. set bits whose lower neighbour is clear.
+				result += std::popcount (word & ~((word << 1) | carry));
+				carry = word >> (word_bits - 1);
+			}
+			return result;
+		}
+	};
+	
+	template <std::size_t _N>
+	struct integral_set_chunk_runs {
+		typedef integral_set_chunk::value_type value_type;
+		
+		struct run {
+			value_type first, last;
+		};
+		
+		std::vector <run> runs;
+		std::size_t count = 0;
+		
+		std::size_t size () const {
+			return this->count;
+		}
+		
+		// Index of the first run starting after value.
+		std::size_t upper_bound (value_type const value) const {
+			if (this->runs.empty () || (this->runs.back ().first <= value)) {
+				return this->runs.size ();
+			}
+			std::size_t base = 0, count = this->runs.size ();
+			while (count > 1) {
+				auto const half = count / 2;
+				base = (this->runs [base + half - 1].first <= value) ? base + half : base;
+				count -= half;
+			}
+			return base + (this->runs [base].first <= value);
+		}
+		
+		bool contains (value_type const value) const {
+			auto const index = this->upper_bound (value);
+			return index && (this->runs [index - 1].last >= value);
+		}
+		
+		bool insert (value_type const value) {
+			auto const index = this->upper_bound (value);
+			if (index && (this->runs [index - 1].last >= value)) {
+				return false;
+			}
+			
+			bool const joins_previous = index && (this->runs [index - 1].last + 1 == value);
+			bool const joins_next = (index < this->runs.size ()) && (this->runs [index].first == value + 1);
+			if (joins_previous && joins_next) {
+				this->runs [index - 1].last = this->runs [index].last;
+				this->runs.erase (this->runs.begin () + index);
+			} else if (joins_previous) {
+				this->runs [index - 1].last = value;
+			} else if (joins_next) {
+				this->runs [index].first = value;
+			} else {
+				this->runs.insert (this->runs.begin () + index, { value, value });
+			}
+			this->count++;
+			return true;
+		}
+		
+		bool remove (value_type const value) {
+			auto const index = this->upper_bound (value);
+			if (!index || (this->runs [index - 1].last < value)) {
+				return false;
+			}
+			
+			auto const found = this->runs [index - 1];
+			if (found.first == found.last) {
+				this->runs.erase (this->runs.begin () + (index - 1));
+			} else if (found.first == value) {
+				this->runs [index - 1].first++;
+			} else if (found.last == value) {
+				this->runs [index - 1].last--;
+			} else {
+				this->runs [index - 1].last = value - 1;
+				this->runs.insert (this->runs.begin () + index, { static_cast <value_type> (value + 1), found.last });
+			}
+			this->count--;
+			return true;
+		}
+		
+		std::size_t insert (value_type const *begin, value_type const *end) {
+			auto const old_count = this->count;
+			for (auto it = begin; it != end; it++) {
+				this->insert (*it);
+			}
+			return this->count - old_count;
+		}
+		
+		template <typename _Fn>
+		void for_each (_Fn &&fn) const {
+			for (auto const &run: this->runs) {
+				for (std::size_t value = run.first; value <= run.last; value++) {
+					fn (static_cast <value_type> (value));
+				}
+			}
+		}
+	};
+	
 	template <typename _Tp, std::size_t _N>
 	struct integral_set_storage_small {
+		static_assert (_N <= sizeof (integral_set_chunk::value_type) * CHAR_BIT, "chunk is too wide");
+		
 	public:
 		integral_set_storage_small () {}
 		integral_set_storage_small (std::initializer_list <_Tp> const &values): integral_set_storage_small (values.begin (), values.end ()) {}
@@ -154,23 +448,103 @@ namespace util {
 		}
 
 		bool contains (_Tp const value) const {
-			return this->_bits [value];
+			return std::visit ([value] (auto const &chunk) { return chunk.contains (static_cast <value_type> (value)); }, this->_chunk);
 		}
 		
 		bool insert (_Tp const value) {
-			bool result = true;
-			std::swap (this->_bits [value], result);
-			return !result;
+			if (!std::visit ([value] (auto &chunk) { return chunk.insert (static_cast <value_type> (value)); }, this->_chunk)) {
+				return false;
+			}
+			this->did_change ();
+			return true;
 		}
 		
 		bool remove (_Tp const value) {
-			bool result = false;
-			std::swap (this->_bits [value], result);
+			if (!std::visit ([value] (auto &chunk) { return chunk.remove (static_cast <value_type> (value)); }, this->_chunk)) {
+				return false;
+			}
+			this->did_change ();
+			return true;
+		}
+		
+		// Values must be sorted and unique; returns the number of values which were not present before.
+		std::size_t insert (_Tp const *begin, _Tp const *end) {
+			std::vector <value_type> values (begin, end);
+			auto const result = std::visit ([&values] (auto &chunk) { return chunk.insert (values.data (), values.data () + values.size ()); }, this->_chunk);
+			if (result) {
+				this->did_change ();
+			}
 			return result;
 		}
 		
 	private:
-		std::bitset <(1 << _N)> _bits;
+		typedef integral_set_chunk::value_type value_type;
+		typedef integral_set_chunk_array <_N> array_chunk;
+		typedef integral_set_chunk_bitmap <_N> bitmap_chunk;
+		typedef integral_set_chunk_runs <_N> runs_chunk;
+		
+		static std::size_t constexpr bitmap_bytes = bitmap_chunk::words_count * sizeof (typename bitmap_chunk::word_type);
+		
+		// Switches to the container taking least memory; the run count of an array or bitmap is only computed once it has to be converted.
+		void did_change () {
+			if (auto const array = std::get_if <array_chunk> (&this->_chunk)) {
+				if (array->size () > array_chunk::max_size) {
+					if (array->runs_count () * sizeof (typename runs_chunk::run) < bitmap_bytes) {
+						this->_chunk = this->make_runs (array->values);
+					} else {
+						this->_chunk = this->make_bitmap (array->values);
+					}
+				}
+			} else if (auto const bitmap = std::get_if <bitmap_chunk> (&this->_chunk)) {
+				if (bitmap->size () <= array_chunk::max_size) {
+					this->_chunk = this->make_array (*bitmap);
+				}
+			} else if (auto const runs = std::get_if <runs_chunk> (&this->_chunk)) {
+				auto const runs_bytes = runs->runs.size () * sizeof (typename runs_chunk::run);
+				auto const array_bytes = runs->size () * sizeof (value_type);
+				if ((runs->size () <= array_chunk::max_size) && (array_bytes < runs_bytes)) {
+					this->_chunk = this->make_array (*runs);
+				} else if (runs_bytes > bitmap_bytes) {
+					this->_chunk = this->make_bitmap (*runs);
+				}
+			}
+		}
+		
+		static runs_chunk make_runs (std::vector <value_type> const &values) {
+			runs_chunk result;
+			for (auto const value: values) {
+				if (!result.runs.empty () && (result.runs.back ().last + 1 == value)) {
+					result.runs.back ().last = value;
+				} else {
+					result.runs.push_back ({ value, value });
+				}
+			}
+			result.count = values.size ();
+			return result;
+		}
+		
+		static bitmap_chunk make_bitmap (std::vector <value_type> const &values) {
+			bitmap_chunk result;
+			result.insert (values.data (), values.data () + values.size ());
+			return result;
+		}
+		
+		template <typename _Chunk>
+		static bitmap_chunk make_bitmap (_Chunk const &chunk) {
+			bitmap_chunk result;
+			chunk.for_each ([&result] (value_type const value) { result.insert (value); });
+			return result;
+		}
+		
+		template <typename _Chunk>
+		static array_chunk make_array (_Chunk const &chunk) {
+			array_chunk result;
+			result.values.reserve (chunk.size ());
+			chunk.for_each ([&result] (value_type const value) { result.values.push_back (value); });
+			return result;
+		}
+		
+		std::variant <array_chunk, bitmap_chunk, runs_chunk> _chunk;
 	};
 	
 	template <typename _Tp, std::size_t _N>
@@ -186,54 +560,154 @@ namespace util {
 		}
 		
 		bool contains (_Tp const value) const {
-			auto const &it = std::lower_bound (this->_prefixes.begin (), this->_prefixes.end (), value, prefix::is_less);
-			return (it != this->_prefixes.end ()) && (it->is_equal (value)) && this->_suffixes [it->index].contains (value & suffix_mask);
+			auto const &it = this->_prefixes.find (value >> component_bits);
+			return (it != this->_prefixes.end ()) && this->_suffixes [it->second].contains (value & suffix_mask);
 		}
 		
 		bool insert (_Tp const value) {
-			auto const &it = std::lower_bound (this->_prefixes.begin (), this->_prefixes.end (), value, prefix::is_less);
-			if ((it != this->_prefixes.end ()) && it->is_equal (value)) {
-				return this->_suffixes [it->index].insert (value & suffix_mask);
+			auto const &[it, inserted] = this->_prefixes.try_emplace (value >> component_bits, this->_suffixes.size ());
+			if (!inserted) {
+				return this->_suffixes [it->second].insert (value & suffix_mask);
 			} else {
-				this->_prefixes.insert (it, prefix (value, static_cast <typename prefix::value_type> (this->_suffixes.size ())));
 				this->_suffixes.push_back ({ value & suffix_mask });
 				return true;
 			}
 		}
 		
 		bool remove (_Tp const value) {
-			auto const &it = std::lower_bound (this->_prefixes.begin (), this->_prefixes.end (), value, prefix::is_less);
-			if ((it == this->_prefixes.end ()) || !it->is_equal (value)) {
+			auto const &it = this->_prefixes.find (value >> component_bits);
+			if (it == this->_prefixes.end ()) {
 				return false;
 			}
-			return this->_suffixes [it->index].remove (value & suffix_mask);
+			return this->_suffixes [it->second].remove (value & suffix_mask);
+		}
+		
+		// Values must be sorted and unique, so that values sharing a prefix are handed down as a single batch.
+		std::size_t insert (_Tp const *begin, _Tp const *end) {
+			if (begin == end) {
+				return 0;
+			}
+			std::vector <_Tp> suffixes (end - begin);
+			std::transform (begin, end, suffixes.begin (), [] (_Tp const value) { return value & suffix_mask; });
+			
+			// Makes room for every prefix at once rather than rehashing as they come in.
+			auto const groups_count = 1 + std::inner_product (begin + 1, end, begin, std::size_t (0), std::plus <> (), [] (_Tp const value, _Tp const previous) {
+				return std::size_t ((value >> component_bits) != (previous >> component_bits));
+			});
+			this->_prefixes.reserve (this->_prefixes.size () + groups_count);
+			this->_suffixes.reserve (this->_suffixes.size () + groups_count);
+			
+			std::size_t result = 0;
+			for (auto group = begin; group != end; ) {
+				auto const group_end = std::find_if (group, end, [value = *group] (_Tp const other) { return (other >> component_bits) != (value >> component_bits); });
+				auto const suffixes_begin = suffixes.data () + (group - begin), suffixes_end = suffixes.data () + (group_end - begin);
+				auto const &[it, inserted] = this->_prefixes.try_emplace (*group >> component_bits, this->_suffixes.size ());
+				if (inserted) {
+					this->_suffixes.emplace_back ();
+				}
+				result += this->_suffixes [it->second].insert (suffixes_begin, suffixes_end);
+				group = group_end;
+			}
+			return result;
 		}
 		
 	private:
 		static std::size_t constexpr component_bits = _N / 2;
-		static constexpr _Tp suffix_mask = ~(_Tp (0)) >> component_bits;
+		static constexpr _Tp suffix_mask = (_Tp (1) << component_bits) - 1;
 		
-		struct prefix {
-			typedef _Tp value_type;
-			
-			static std::size_t constexpr bit_width = component_bits;
-			
-			_Tp value: bit_width;
-			_Tp index: bit_width;
-			
-			static constexpr bool is_less (prefix const prefix, _Tp const value) {
-				return prefix.value < (value >> bit_width);
+		// Maps prefixes to their suffixes; hashed rather than sorted, so that scattered values do not shift every prefix above them as they come in.
+		std::unordered_map <_Tp, std::size_t> _prefixes;
+		std::vector <integral_set_storage <_Tp, component_bits>> _suffixes;
+	};
+	
+	// Sharded integral_set safe for concurrent use; values are spread over shards by their chunk prefix,
+	// so that neighbouring values share a shard and keep dense chunk containers.
+	template <typename ..._Types>
+	struct concurrent_integral_set {
+		static_assert (sizeof... (_Types), "invalid use of concurrent_integral_set");
+		
+	public:
+		typedef std::conditional_t <(sizeof... (_Types) > 1), std::tuple <_Types...>, std::tuple_element_t <0, std::tuple <_Types...>>> value_type;
+		
+		concurrent_integral_set () {}
+		concurrent_integral_set (std::initializer_list <value_type> const &values) {
+			this->insert (values.begin (), values.end ());
+		}
+		
+		~concurrent_integral_set () = default;
+		
+		bool contains (_Types const ...values) const {
+			auto &shard = this->shard_for (values...);
+			std::shared_lock lock (shard.lock);
+			return shard.values.contains (values...);
+		}
+		
+		// Returns false if value is already present, so that concurrent callers may use it as test-and-insert.
+		bool insert (_Types const ...values) {
+			auto &shard = this->shard_for (values...);
+			std::unique_lock lock (shard.lock);
+			return shard.values.insert (values...);
+		}
+		
+		bool remove (_Types const ...values) {
+			auto &shard = this->shard_for (values...);
+			std::unique_lock lock (shard.lock);
+			return shard.values.remove (values...);
+		}
+		
+		// Takes each shard lock once per batch; elements are either values or tuples of them, like for integral_set.
+		template <typename _It, typename = typename std::iterator_traits <_It>::value_type>
+		std::size_t insert (_It values_begin, _It values_end) {
+			typedef typename std::iterator_traits <_It>::value_type element_type;
+			std::array <std::vector <element_type>, shards_count> groups;
+			for (auto it = values_begin; it != values_end; it++) {
+				if constexpr (sizeof... (_Types) == 1) {
+					groups [this->shard_index (*it)].push_back (*it);
+				} else {
+					groups [std::apply ([this] (auto const ...values) { return this->shard_index (values...); }, *it)].push_back (*it);
+				}
 			}
 			
-			prefix (_Tp const value, _Tp const index): value (value >> bit_width), index (index) {}
-
-			constexpr bool is_equal (_Tp const value) const {
-				return this->value == (value >> bit_width);
+			std::size_t result = 0;
+			for (std::size_t i = 0; i < shards_count; i++) {
+				if (groups [i].empty ()) {
+					continue;
+				}
+				auto &shard = this->_shards [i];
+				std::unique_lock lock (shard.lock);
+				result += shard.values.insert (groups [i].begin (), groups [i].end ());
 			}
+			return result;
+		}
+		
+	private:
+		typedef integral_set <_Types...> storage;
+		typedef std::tuple_element_t <sizeof... (_Types) - 1, std::tuple <_Types...>> last_type;
+		
+		static std::size_t constexpr shards_bits = 6;
+		static std::size_t constexpr shards_count = std::size_t (1) << shards_bits;
+		static std::size_t constexpr chunk_bits = integral_set_chunk_bits (sizeof (last_type) * CHAR_BIT);
+		
+		struct alignas (64) shard {
+			std::shared_mutex lock;
+			storage values;
 		};
 		
-		std::vector <prefix> _prefixes;
-		std::vector <integral_set_storage <_Tp, component_bits>> _suffixes;
+		static std::size_t shard_index (_Types const ...values) {
+			std::array <std::uint64_t, sizeof... (_Types)> components { static_cast <std::uint64_t> (values)... };
+			components.back () = (chunk_bits < 64) ? (components.back () >> chunk_bits) : 0;
+			std::uint64_t key = 0;
+			for (auto const component: components) {
+				key = (key ^ component) * 0x9E3779B97F4A7C15ULL;
+			}
+			return key >> (64 - shards_bits);
+		}
+		
+		shard &shard_for (_Types const ...values) const {
+			return this->_shards [shard_index (values...)];
+		}
+		
+		std::array <shard, shards_count> mutable _shards;
 	};
 }
 
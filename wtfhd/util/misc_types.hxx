@@ -9,6 +9,7 @@
 #define misc_types_hxx
 
 #include <cmath>
+#include <chrono>
 #include <mutex>
 #include <string>
 #include <climits>
@@ -54,11 +55,11 @@ namespace util {
 	}
 
 	struct progress_t {
-		progress_t (std::size_t ready, std::size_t total): ready (ready), total (total) {}
+		progress_t (std::size_t ready, std::size_t total, std::optional <std::chrono::seconds> remaining = std::nullopt): ready (ready), total (total), remaining (remaining) {}
 		
 		std::string percents () const {
 			assert (this->ready <= this->total);
-			auto const promille = std::lrint (std::round (static_cast <double> (this->ready) / static_cast <double> (this->total) * 1000.0));
+			auto const promille = this->total ? std::lrint (std::round (static_cast <double> (this->ready) / static_cast <double> (this->total) * 1000.0)) : 0L;
 			char buffer [7];
 			std::snprintf (buffer, std::extent_v <decltype (buffer)>, "%ld.%ld%%", promille / 10, promille % 10);
 			return buffer;
@@ -72,8 +73,24 @@ namespace util {
 			return buffer;
 		}
 		
+		// Time left as h:mm:ss or m:ss, empty while it is unknown.
+		std::string remaining_time () const {
+			if (!this->remaining) {
+				return {};
+			}
+			auto const seconds = static_cast <long> (this->remaining->count ());
+			char buffer [32];
+			if (seconds >= 3600) {
+				std::snprintf (buffer, std::extent_v <decltype (buffer)>, "%ld:%02ld:%02ld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+			} else {
+				std::snprintf (buffer, std::extent_v <decltype (buffer)>, "%ld:%02ld", seconds / 60, seconds % 60);
+			}
+			return buffer;
+		}
+		
 		std::size_t const ready;
 		std::size_t const total;
+		std::optional <std::chrono::seconds> const remaining;
 	};
 	
 	template <std::size_t _Sz = sizeof (std::uintptr_t) * CHAR_BIT>
@@ -105,7 +122,7 @@ namespace util {
 		}
 		
 		bool operator== (tristate_bool_base const &other) const {
-			return this->_storage == other.storage;
+			return this->_storage == other._storage;
 		}
 		
 	private:
@@ -0,0 +1,90 @@
+//
+//  mpsc_queue.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/28/20.
+//
+
+#ifndef mpsc_queue_hxx
+#define mpsc_queue_hxx
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <optional>
+
+namespace util {
+	template <typename _Tp, std::size_t _Capacity>
+	class mpsc_queue;
+}
+
+// Bounded lock-free queue for many producers and a single consumer. Every slot carries a sequence number
+// telling whose turn it is: producers claim positions by advancing the tail, then publish them through the slot.
+template <typename _Tp, std::size_t _Capacity>
+class util::mpsc_queue {
+	static_assert (_Capacity && !(_Capacity & (_Capacity - 1)), "capacity must be a power of two");
+
+public:
+	mpsc_queue (): _head (), _tail () {
+		for (std::size_t i = 0; i < _Capacity; i++) {
+			this->_slots [i].sequence.store (i, std::memory_order::relaxed);
+		}
+	}
+
+	mpsc_queue (mpsc_queue const &) = delete;
+	mpsc_queue &operator = (mpsc_queue const &) = delete;
+
+	// Safe to call from any thread; returns false and leaves value intact if the queue is full.
+	bool try_push (_Tp &value) {
+		auto position = this->_tail.load (std::memory_order::relaxed);
+		for (;;) {
+			auto &slot = this->_slots [position & mask];
+			auto const sequence = slot.sequence.load (std::memory_order::acquire);
+			auto const difference = static_cast <std::ptrdiff_t> (sequence - position);
+			if (!difference) {
+				if (this->_tail.compare_exchange_weak (position, position + 1, std::memory_order::relaxed)) {
+					slot.value = std::move (value);
+					slot.sequence.store (position + 1, std::memory_order::release);
+					return true;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = this->_tail.load (std::memory_order::relaxed);
+			}
+		}
+	}
+
+	// Consumer thread only; false while any position is claimed, even by a push yet to be published.
+	bool empty () const {
+		return this->_tail.load (std::memory_order::acquire) == this->_head;
+	}
+
+	// Consumer thread only.
+	std::optional <_Tp> try_pop () {
+		auto &slot = this->_slots [this->_head & mask];
+		if (slot.sequence.load (std::memory_order::acquire) != this->_head + 1) {
+			return std::nullopt;
+		}
+		std::optional <_Tp> result (std::move (slot.value));
+		slot.value = _Tp ();
+		slot.sequence.store (this->_head + _Capacity, std::memory_order::release);
+		this->_head++;
+		return result;
+	}
+
+private:
+	static std::size_t constexpr mask = _Capacity - 1;
+
+	struct alignas (64) slot {
+		std::atomic <std::size_t> sequence;
+		_Tp value;
+	};
+
+	std::array <slot, _Capacity> _slots;
+	alignas (64) std::size_t _head;
+	alignas (64) std::atomic <std::size_t> _tail;
+};
+
+#endif /* mpsc_queue_hxx */
@@ -0,0 +1,116 @@
+//
+//  small_callback.hxx
+//  wtfhd
+//
+//  Created by Kirill Bystrov on 10/28/20.
+//
+
+#ifndef small_callback_hxx
+#define small_callback_hxx
+
+#include <new>
+#include <memory>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <type_traits>
+
+namespace util {
+	class small_callback;
+}
+
+// Move-only void () callable which keeps callables of up to inline_size bytes, e.g. a bound member function and a string, without allocating.
+class util::small_callback {
+public:
+	static std::size_t constexpr inline_size = 56;
+
+	small_callback (): _ops () {}
+
+	template <typename _Fp, typename = std::enable_if_t <!std::is_same_v <std::decay_t <_Fp>, small_callback> && std::is_invocable_v <std::decay_t <_Fp> &>>>
+	small_callback (_Fp &&f): _ops (&ops_for <std::decay_t <_Fp>>::value) {
+		typedef std::decay_t <_Fp> callable_type;
+		if constexpr (is_inline <callable_type>) {
+			new (this->_storage) callable_type (std::forward <_Fp> (f));
+		} else {
+			new (this->_storage) callable_type * (new callable_type (std::forward <_Fp> (f)));
+		}
+	}
+
+	small_callback (small_callback &&other) noexcept: _ops (other._ops) {
+		if (this->_ops) {
+			this->_ops->move (other._storage, this->_storage);
+			other._ops = nullptr;
+		}
+	}
+
+	small_callback (small_callback const &) = delete;
+
+	~small_callback () {
+		this->reset ();
+	}
+
+	small_callback &operator = (small_callback &&other) noexcept {
+		if (this != &other) {
+			this->reset ();
+			if ((this->_ops = other._ops)) {
+				this->_ops->move (other._storage, this->_storage);
+				other._ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	small_callback &operator = (small_callback const &) = delete;
+
+	explicit operator bool () const {
+		return this->_ops;
+	}
+
+	void operator () () {
+		this->_ops->invoke (this->_storage);
+	}
+
+	void reset () {
+		if (this->_ops) {
+			this->_ops->destroy (this->_storage);
+			this->_ops = nullptr;
+		}
+	}
+
+private:
+	struct ops {
+		void (*invoke) (void *storage);
+		// Move-constructs into target and destroys the source.
+		void (*move) (void *source, void *target);
+		void (*destroy) (void *storage);
+	};
+
+	template <typename _Tp>
+	static bool constexpr is_inline = (sizeof (_Tp) <= inline_size) && (alignof (_Tp) <= alignof (std::max_align_t)) && std::is_nothrow_move_constructible_v <_Tp>;
+
+	template <typename _Tp, bool = is_inline <_Tp>>
+	struct ops_for {
+		static constexpr ops value {
+			[] (void *storage) { std::invoke (*static_cast <_Tp *> (storage)); },
+			[] (void *source, void *target) {
+				new (target) _Tp (std::move (*static_cast <_Tp *> (source)));
+				static_cast <_Tp *> (source)->~_Tp ();
+			},
+			[] (void *storage) { static_cast <_Tp *> (storage)->~_Tp (); },
+		};
+	};
+
+	template <typename _Tp>
+	struct ops_for <_Tp, false> {
+		static constexpr ops value {
+			[] (void *storage) { std::invoke (**static_cast <_Tp **> (storage)); },
+			[] (void *source, void *target) { new (target) _Tp * (*static_cast <_Tp **> (source)); },
+			[] (void *storage) { delete *static_cast <_Tp **> (storage); },
+		};
+	};
+
+	ops const *_ops;
+	alignas (std::max_align_t) unsigned char _storage [inline_size];
+};
+
+#endif /* small_callback_hxx */